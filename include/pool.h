@@ -1,6 +1,9 @@
 #ifndef POOL_H
 #define POOL_H
 
+#include <stddef.h>
+#include <sys/types.h>
+
 #define POOL_SUCCESS 0
 #define POOL_ERROR -1
 
@@ -8,22 +11,243 @@
 #define GROUP_FIXED 0x02
 
 #define GROUP_FULL -2
+// status of the completion of a cancelled or discarded work
+#define POOL_CANCELLED -3
+#define GROUP_SHED -4
+// work was still in flight when a timed wait ran out
+#define POOL_TIMEOUT -5
+
+#define IO_READ 0x01
+#define IO_WRITE 0x02
+#define IO_EDGE 0x04
+#define IO_HUP 0x08
+
+#define POLICY_NORMAL 0
+#define POLICY_BATCH 1
+#define POLICY_FIFO 2
+
+#define SHUTDOWN_DRAIN 0
+#define SHUTDOWN_DISCARD 1
+#define SHUTDOWN_DEADLINE 2
+
+#define SHED_REJECT 1
+#define SHED_DROP 2
+
+#define RATE_TASKS 1
+#define RATE_CPU 2
+
+// returned by barrier_wait() to the task that arrived last
+#define BARRIER_LAST 1
+
+// bytes a work struct takes when it is embedded with init_work_slot()
+#define WORK_SLOT_SIZE 128
 
 typedef struct TPool TPool;
 typedef struct TGroup TGroup;
 typedef struct Work Work;
+typedef struct TGraph TGraph;
+typedef struct TNode TNode;
+typedef struct TJoin TJoin;
+typedef struct TLatch TLatch;
+typedef struct TChan TChan;
+typedef struct TBarrier TBarrier;
+typedef struct TWatch TWatch;
+typedef struct TCompQ TCompQ;
+typedef struct TStrand TStrand;
+typedef struct TStrandMap TStrandMap;
 
 typedef void (*work_func)(void *work_arg);
+typedef void (*range_func)(size_t begin, size_t end, void *ctx);
+typedef void (*map_func)(const void *in, void *out, void *ctx);
+typedef void (*io_func)(int fd, int events, void *arg);
+typedef void (*aio_func)(ssize_t result, void *arg);
+
+typedef void (*identity_func)(void *acc, void *ctx);
+typedef void (*accumulate_func)(void *acc, size_t begin, size_t end, void *ctx);
+typedef void (*combine_func)(void *acc, const void *other, void *ctx);
+
+typedef struct Reducer {
+    // size of the accumulator in bytes
+    size_t size;
+
+    identity_func identity;
+    // an accumulator gets chunks that are not next to each other, in no particular order
+    accumulate_func accumulate;
+    // folds other into acc, the accumulators come in no particular order so it must be associative and commutative
+    combine_func combine;
+} Reducer;
+
+/**
+ * Storage for a work struct inside a struct of the caller, such as a request.
+ */
+typedef struct WorkSlot {
+    _Alignas(max_align_t) unsigned char bytes[WORK_SLOT_SIZE];
+} WorkSlot;
+
+typedef struct Completion {
+    // tag given when the work was submitted
+    void *tag;
+    int status;
+} Completion;
+
+typedef struct GroupAttr {
+    // number of independent sub queues, producers and threads are spread across them
+    unsigned int shards;
+    // most work the queue holds, 0 for 100 tasks per thread
+    size_t capacity;
+
+    // stack size of the fibers tasks run on, at least 16 KiB, 0 runs tasks on the thread stacks
+    size_t fiberStack;
+
+    // completion queue every task of the group posts to with its work arg as the tag, NULL for none
+    TCompQ *compq;
+
+    // most extra threads the group runs beyond max while tasks are inside pool_block_begin(), 0 for none
+    unsigned int blockMax;
+
+    // cpus the threads of the group are pinned to, NULL to leave them unpinned
+    const int *cpus;
+    size_t numCpus;
+    // NUMA node the group memory is placed on, its cpus are used when no cpus are given, -1 for none
+    int numaNode;
+
+    // stack and guard size of the threads, 0 keeps the system default
+    size_t stackSize;
+    size_t guardSize;
+    // POLICY_NORMAL and POLICY_BATCH take a nice level as priority, POLICY_FIFO a realtime priority
+    int policy;
+    int priority;
+    // name of the threads, cut to 15 characters, NULL leaves them unnamed
+    const char *name;
+
+    // queue delay in microseconds the group keeps to once the smallest delay of an interval is above it, 0 for no limit
+    unsigned int targetUs;
+    // interval the smallest queue delay is taken over, 0 for 100ms
+    unsigned int intervalUs;
+    // SHED_REJECT fails do_work() with GROUP_SHED while the delay is above target, SHED_DROP cancels the work that waited too long
+    int shed;
+
+    // budget per second, tasks started for RATE_TASKS and cpu milliseconds used for RATE_CPU, 0 for no limit
+    unsigned int rate;
+    // budget the group can save up for a burst in the same unit, 0 for one second of rate
+    unsigned int burst;
+    int rateUnit;
+} GroupAttr;
+
+typedef struct GroupStats {
+    // work waiting in the queue or in the batch of a worker
+    size_t queued;
+    // smallest queue delay of the last interval in microseconds
+    size_t minDelayUs;
+    // set while the queue delay stays above the target
+    int overloaded;
+    // work refused by do_work() and work cancelled before it ran because of the queue delay
+    size_t rejected;
+    size_t dropped;
+    // times a rate limited group held its queued work back because its budget was spent
+    size_t throttled;
+    // threads of the group, compensating threads are not counted
+    unsigned int threads;
+    // policy the threads run with, POLICY_NORMAL for a POLICY_FIFO group where realtime is not permitted
+    int policy;
+} GroupStats;
+
+/**
+ * Limits of a live group, read with group_config() and changed with configure_group().
+ */
+typedef struct GroupConfig {
+    // thread limits, GROUP_FIXED runs min threads
+    unsigned int min;
+    unsigned int max;
+    int flags;
+    // most work the queue holds
+    size_t capacity;
+} GroupConfig;
 
 int init_pool(TPool **tp, unsigned int maxThrds);
 void wait_pool(TPool *tp);
+int wait_pool_timed(TPool *tp, unsigned int timeoutMs);
 void destroy_pool(TPool *tp);
+void shutdown_pool(TPool *tp, int mode, unsigned int timeoutMs);
 
+void init_group_attr(GroupAttr *attr);
 TGroup *add_group(TPool *tp, unsigned int min, unsigned int max, int flags);
+TGroup *add_group_attr(TPool *tp, unsigned int min, unsigned int max, int flags, const GroupAttr *attr);
+void wait_group(TGroup *tg);
+int wait_group_timed(TGroup *tg, unsigned int timeoutMs);
 void destroy_group(TGroup *tg);
+void shutdown_group(TGroup *tg, int mode, unsigned int timeoutMs);
+int group_stats(TGroup *tg, GroupStats *stats);
+int group_config(TGroup *tg, GroupConfig *config);
+int configure_group(TGroup *tg, const GroupConfig *config);
+int resize_group(TGroup *tg, unsigned int min, unsigned int max, int flags);
+size_t migrate_group_work(TGroup *src, TGroup *dst, size_t maxItems);
+size_t shutdown_group_into(TGroup *tg, TGroup *dst);
 
 void init_work(Work **work);
+void init_work_slot(Work **work, WorkSlot *slot, work_func done);
 void add_work(Work *work, work_func func, void *arg);
 int do_work(TGroup *tg, Work *work);
+void add_cancel(Work *work, work_func func);
+void retain_work(Work *work);
+void release_work(Work *work);
+int cancel_work(TGroup *tg, Work *work);
+
+int register_producer(TGroup *tg, unsigned int batch, unsigned int lingerUs);
+int flush_work(TGroup *tg);
+void unregister_producer(TGroup *tg);
+
+void pool_block_begin(void);
+void pool_block_end(void);
+
+int parallel_for(TGroup *tg, size_t begin, size_t end, size_t grain, range_func func, void *ctx);
+int parallel_reduce(TGroup *tg, size_t begin, size_t end, size_t grain, const Reducer *red, void *ctx, void *result);
+int parallel_map(TGroup *tg, const void *in, void *out, size_t len, size_t inSize, size_t outSize, size_t grain, map_func func, void *ctx);
+
+int init_graph(TGraph **graph);
+TNode *add_node(TGraph *graph, TGroup *tg, work_func func, void *arg, TNode **preds, size_t numPreds);
+int run_graph(TGraph *graph);
+void wait_graph(TGraph *graph);
+void destroy_graph(TGraph *graph);
+
+int init_join(TJoin **join);
+int join_work(TJoin *join, TGroup *tg, Work *work);
+void wait_join(TJoin *join);
+void destroy_join(TJoin *join);
+
+int init_strand(TStrand **strand, TGroup *tg);
+int strand_work(TStrand *strand, Work *work);
+void destroy_strand(TStrand *strand);
+int init_strand_map(TStrandMap **map, TGroup *tg, size_t numStrands);
+int strand_map_work(TStrandMap *map, size_t key, Work *work);
+void destroy_strand_map(TStrandMap *map);
+
+int init_latch(TLatch **latch, size_t count);
+void latch_count_down(TLatch *latch);
+void latch_wait(TLatch *latch);
+void destroy_latch(TLatch *latch);
+
+int init_chan(TChan **chan, size_t cap);
+int chan_send(TChan *chan, void *item);
+int chan_recv(TChan *chan, void **item);
+void close_chan(TChan *chan);
+void destroy_chan(TChan *chan);
+
+int init_barrier(TBarrier **barrier, unsigned int count);
+int barrier_wait(TBarrier *barrier);
+void destroy_barrier(TBarrier *barrier);
+
+TWatch *watch_fd(TGroup *tg, int fd, int events, io_func func, void *arg);
+void unwatch_fd(TWatch *w);
+
+int init_compq(TCompQ **cq, size_t cap);
+int compq_fd(TCompQ *cq);
+int compq_work(TCompQ *cq, TGroup *tg, Work *work, void *tag);
+size_t compq_drain(TCompQ *cq, Completion *comps, size_t max);
+void destroy_compq(TCompQ *cq);
+
+int async_read(TGroup *tg, int fd, void *buf, size_t len, off_t offset, aio_func func, void *arg);
+int async_write(TGroup *tg, int fd, const void *buf, size_t len, off_t offset, aio_func func, void *arg);
+int async_fsync(TGroup *tg, int fd, aio_func func, void *arg);
 
 #endif //POOL_H
\ No newline at end of file
@@ -0,0 +1,209 @@
+#ifndef AIL_H
+#define AIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "il.h"
+
+/**
+ * Lock free companions of il.h, items are embedded the same way and found with CONTAINER_OF().
+ * An item is in at most one of these at a time and only the single link is used.
+ *
+ * @note    the stack swaps its top and a tag at once, x86-64 needs -mcx16 for cmpxchg16b
+ */
+
+#ifndef AIL_CACHE_LINE
+#define AIL_CACHE_LINE 64
+#endif
+
+typedef struct AIL {
+    struct AIL *_Atomic next;
+} AIL;
+
+/**
+ * Intrusive queue after Vyukov, any thread can push and a single thread pops.
+ * A push is one exchange and never waits, the stub keeps the queue from ever being empty of items.
+ */
+typedef struct AQ {
+    // last item, swapped by the producers
+    _Alignas(AIL_CACHE_LINE) AIL *_Atomic tail;
+    // next item to pop, only touched by the consumer
+    _Alignas(AIL_CACHE_LINE) AIL *head;
+    AIL stub;
+} AQ;
+
+#if UINTPTR_MAX > 0xffffffffu
+typedef unsigned __int128 ail_dword;
+#else
+typedef uint64_t ail_dword;
+#endif
+
+/**
+ * Top of a Treiber stack with the number of times it was taken from.
+ * The count changes with every pop so an item that was popped and pushed again in between fails the swap.
+ */
+typedef union ATop {
+    struct {
+        AIL *item;
+        uintptr_t tag;
+    } top;
+    ail_dword word;
+} ATop;
+
+/**
+ * Intrusive stack that any thread can push to and pop from, such as a free list.
+ * Popped items stay readable while the stack is in use since a slow pop can still read their link.
+ */
+typedef struct AS {
+    _Alignas(2 * sizeof(void *)) ATop top;
+} AS;
+
+static inline void init_ail(AIL *ail) {
+    atomic_init(&ail->next, NULL);
+}
+
+static inline void init_aq(AQ *q) {
+    init_ail(&q->stub);
+    atomic_init(&q->tail, &q->stub);
+    q->head = &q->stub;
+}
+
+static inline void aq_push(AQ *q, AIL *item) {
+    atomic_store_explicit(&item->next, NULL, memory_order_relaxed);
+    AIL *prev = atomic_exchange_explicit(&q->tail, item, memory_order_acq_rel);
+    // the item can only be popped once it is linked here
+    atomic_store_explicit(&prev->next, item, memory_order_release);
+}
+
+/**
+ * Pops the oldest item, only ever called by the consumer.
+ * Returns NULL while the queue is empty, and also for a moment while a producer is between its two steps,
+ * so the consumer has to be told about new items by the producer as it would be with a locked list.
+ */
+static inline AIL *aq_pop(AQ *q) {
+    AIL *head = q->head;
+    AIL *next = atomic_load_explicit(&head->next, memory_order_acquire);
+
+    if(head == &q->stub) {
+        if(next == NULL) {
+            return NULL;
+        }
+        q->head = next;
+        head = next;
+        next = atomic_load_explicit(&head->next, memory_order_acquire);
+    }
+
+    if(next != NULL) {
+        q->head = next;
+        return head;
+    }
+
+    if(head != atomic_load_explicit(&q->tail, memory_order_acquire)) {
+        return NULL;
+    }
+
+    // the last item is only handed out once the stub is behind it
+    aq_push(q, &q->stub);
+    next = atomic_load_explicit(&head->next, memory_order_acquire);
+    if(next != NULL) {
+        q->head = next;
+        return head;
+    }
+
+    return NULL;
+}
+
+static inline int aq_empty(AQ *q) {
+    return q->head == &q->stub && atomic_load_explicit(&q->stub.next, memory_order_acquire) == NULL;
+}
+
+static inline void init_as(AS *s) {
+    s->top.top.item = NULL;
+    s->top.top.tag = 0;
+}
+
+/**
+ * Reads the top a word at a time, a torn read only makes the swap that follows fail.
+ */
+static inline ATop as_load(AS *s) {
+    ATop top;
+
+    top.top.tag = __atomic_load_n(&s->top.top.tag, __ATOMIC_ACQUIRE);
+    top.top.item = __atomic_load_n(&s->top.top.item, __ATOMIC_ACQUIRE);
+
+    return top;
+}
+
+static inline int as_swap(AS *s, ATop *old, ATop desired) {
+    ail_dword seen = __sync_val_compare_and_swap(&s->top.word, old->word, desired.word);
+    if(seen == old->word) {
+        return 1;
+    }
+
+    old->word = seen;
+    return 0;
+}
+
+static inline void as_push(AS *s, AIL *item) {
+    ATop old = as_load(s);
+    ATop top;
+
+    do {
+        atomic_store_explicit(&item->next, old.top.item, memory_order_relaxed);
+        top.top.item = item;
+        top.top.tag = old.top.tag;
+    } while(!as_swap(s, &old, top));
+}
+
+static inline AIL *as_pop(AS *s) {
+    ATop old = as_load(s);
+    ATop top;
+
+    do {
+        if(old.top.item == NULL) {
+            return NULL;
+        }
+        top.top.item = atomic_load_explicit(&old.top.item->next, memory_order_relaxed);
+        top.top.tag = old.top.tag + 1;
+    } while(!as_swap(s, &old, top));
+
+    return old.top.item;
+}
+
+/**
+ * Takes every item at once and returns them linked through next, the last pushed item first.
+ */
+static inline AIL *as_take_all(AS *s) {
+    ATop old = as_load(s);
+    ATop top;
+
+    do {
+        if(old.top.item == NULL) {
+            return NULL;
+        }
+        top.top.item = NULL;
+        top.top.tag = old.top.tag + 1;
+    } while(!as_swap(s, &old, top));
+
+    return old.top.item;
+}
+
+/**
+ * Reverses a chain of detached items, such as one from as_take_all() to get them in push order.
+ */
+static inline AIL *ail_reverse(AIL *chain) {
+    AIL *prev = NULL;
+
+    while(chain != NULL) {
+        AIL *next = atomic_load_explicit(&chain->next, memory_order_relaxed);
+        atomic_store_explicit(&chain->next, prev, memory_order_relaxed);
+        prev = chain;
+        chain = next;
+    }
+
+    return prev;
+}
+
+#endif //AIL_H
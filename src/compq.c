@@ -0,0 +1,346 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+/**
+ * @note    will remove this later
+ */
+#include <assert.h>
+
+#include "pool.h"
+#include "il.h"
+#include "internal.h"
+
+#define CACHE_LINE 64
+
+/**
+ * Slot of the ring, seq tells producers and consumers whose turn it is.
+ */
+typedef struct Cell {
+    atomic_size_t seq;
+    Completion comp;
+} Cell;
+
+/**
+ * Completion that did not fit in the ring.
+ */
+typedef struct Overflow {
+    IL move;
+    Completion comp;
+} Overflow;
+
+/**
+ * Bounded ring of completions with sequence numbered cells, no lock is taken while the ring has room.
+ * A full ring spills into a locked overflow list so completions are never lost.
+ *
+ * The descriptor is only written when signalled goes from 0 to 1,
+ * many completions between two drains cost a single write.
+ */
+struct TCompQ {
+    _Alignas(CACHE_LINE) atomic_size_t tail;
+    _Alignas(CACHE_LINE) atomic_size_t head;
+
+    _Alignas(CACHE_LINE) atomic_int signalled;
+
+    Cell *cells;
+    size_t mask;
+
+    pthread_mutex_t mutexOverflow;
+    LL overflow;
+    atomic_size_t overflowLen;
+
+    // read end is handed to the event loop, both ends are the same eventfd on linux
+    int readfd;
+    int writefd;
+};
+
+static int internal_compq_push(TCompQ *cq, const Completion *comp);
+static int internal_compq_pop(TCompQ *cq, Completion *comp);
+static void internal_compq_signal(TCompQ *cq);
+static void internal_compq_clear(TCompQ *cq);
+
+/**
+ * Initializes a completion queue.
+ * The descriptor returned by compq_fd() becomes readable when completions are waiting.
+ *
+ * @param   cq      double pointer to completion queue struct for internal memory allocation
+ * @param   cap     slots of the ring, rounded up to a power of two
+ */
+int init_compq(TCompQ **cq, size_t cap) {
+    if(cq == NULL || cap == 0) {
+        return POOL_ERROR;
+    }
+
+    size_t size = 1;
+    while(size < cap) {
+        size <<= 1;
+    }
+
+    int rc = posix_memalign((void **)cq, CACHE_LINE, sizeof(TCompQ));
+    if(rc != 0) {
+        return POOL_ERROR;
+    }
+
+    TCompQ *q = *cq;
+    q->cells = (Cell *)malloc(size * sizeof(Cell));
+    if(q->cells == NULL) {
+        free(q);
+        return POOL_ERROR;
+    }
+
+#ifdef __linux__
+    q->readfd = q->writefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(q->readfd < 0) {
+        free(q->cells);
+        free(q);
+        return POOL_ERROR;
+    }
+#else
+    int fds[2];
+    if(pipe(fds) != 0) {
+        free(q->cells);
+        free(q);
+        return POOL_ERROR;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    q->readfd = fds[0];
+    q->writefd = fds[1];
+#endif
+
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&q->cells[i].seq, i);
+    }
+    q->mask = size - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->signalled, 0);
+
+    pthread_mutex_init(&q->mutexOverflow, NULL);
+    init_list(&q->overflow);
+    atomic_init(&q->overflowLen, 0);
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Descriptor for the event loop, readable while completions are waiting to be drained.
+ *
+ * @param   cq      completion queue struct
+ */
+int compq_fd(TCompQ *cq) {
+    if(cq == NULL) {
+        return POOL_ERROR;
+    }
+
+    return cq->readfd;
+}
+
+/**
+ * Does the work in a group and posts a completion with the tag once it has run.
+ *
+ * @param   cq      completion queue struct
+ * @param   tg      group struct
+ * @param   work    work struct that is populated from the add_work()
+ * @param   tag     returned in the completion
+ */
+int compq_work(TCompQ *cq, TGroup *tg, Work *work, void *tag) {
+    if(cq == NULL || tg == NULL || work == NULL) {
+        return POOL_ERROR;
+    }
+
+    work->compq = cq;
+    work->tag = tag;
+
+    int rc = do_work(tg, work);
+    if(rc != POOL_SUCCESS) {
+        work->compq = NULL;
+        work->tag = NULL;
+    }
+
+    return rc;
+}
+
+/**
+ * Takes up to max completions without blocking.
+ * The descriptor is armed again when completions are left so the event loop can drain them in batches.
+ *
+ * @param   cq      completion queue struct
+ * @param   comps   array of at least max completions
+ * @param   max     most completions to take
+ * @return  number of completions taken
+ */
+size_t compq_drain(TCompQ *cq, Completion *comps, size_t max) {
+    if(cq == NULL || comps == NULL) {
+        return 0;
+    }
+
+    // cleared before draining so a completion posted meanwhile signals again
+    // the exchange pairs with the producer that signalled so its completion is seen below
+    internal_compq_clear(cq);
+    atomic_exchange(&cq->signalled, 0);
+
+    size_t n = 0;
+    while(n < max && internal_compq_pop(cq, &comps[n])) {
+        n++;
+    }
+
+    if(n < max && atomic_load(&cq->overflowLen) > 0) {
+        pthread_mutex_lock(&cq->mutexOverflow);
+        IL *il;
+        while(n < max && (il = list_pop(&cq->overflow)) != NULL) {
+            Overflow *o = CONTAINER_OF(il, Overflow, move);
+            comps[n++] = o->comp;
+            atomic_fetch_sub(&cq->overflowLen, 1);
+            free(o);
+        }
+        pthread_mutex_unlock(&cq->mutexOverflow);
+    }
+
+    if(n == max) {
+        internal_compq_signal(cq);
+    }
+
+    return n;
+}
+
+/**
+ * Frees the completion queue and the completions left in it.
+ * No work posting to the queue can be left in the pool.
+ *
+ * @param   cq      completion queue struct
+ */
+void destroy_compq(TCompQ *cq) {
+    if(cq == NULL) {
+        return;
+    }
+
+    IL *il;
+    while((il = list_pop(&cq->overflow)) != NULL) {
+        free(CONTAINER_OF(il, Overflow, move));
+    }
+    pthread_mutex_destroy(&cq->mutexOverflow);
+
+    close(cq->readfd);
+    if(cq->writefd != cq->readfd) {
+        close(cq->writefd);
+    }
+
+    free(cq->cells);
+    free(cq);
+}
+
+/*  --Module Hooks--  */
+
+void internal_compq_post(TCompQ *cq, void *tag, int status) {
+    Completion comp = {tag, status};
+
+    if(!internal_compq_push(cq, &comp)) {
+        Overflow *o;
+        o = (Overflow *)malloc(sizeof(Overflow));
+        assert(o != NULL);
+        init_il(&o->move);
+        o->comp = comp;
+
+        pthread_mutex_lock(&cq->mutexOverflow);
+        list_append(&cq->overflow, &o->move);
+        atomic_fetch_add(&cq->overflowLen, 1);
+        pthread_mutex_unlock(&cq->mutexOverflow);
+    }
+
+    internal_compq_signal(cq);
+}
+
+/*  --Internal Functions--  */
+
+/**
+ * A producer claims the cell at tail once its seq says the consumers are done with it.
+ *
+ * @return  0 when the ring is full
+ */
+static int internal_compq_push(TCompQ *cq, const Completion *comp) {
+    size_t pos = atomic_load_explicit(&cq->tail, memory_order_relaxed);
+    Cell *cell;
+
+    while(1) {
+        cell = &cq->cells[pos & cq->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if(diff == 0) {
+            if(atomic_compare_exchange_weak_explicit(&cq->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if(diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&cq->tail, memory_order_relaxed);
+        }
+    }
+
+    cell->comp = *comp;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 1;
+}
+
+/**
+ * @return  0 when the ring is empty
+ */
+static int internal_compq_pop(TCompQ *cq, Completion *comp) {
+    size_t pos = atomic_load_explicit(&cq->head, memory_order_relaxed);
+    Cell *cell;
+
+    while(1) {
+        cell = &cq->cells[pos & cq->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if(diff == 0) {
+            if(atomic_compare_exchange_weak_explicit(&cq->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if(diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&cq->head, memory_order_relaxed);
+        }
+    }
+
+    *comp = cell->comp;
+    atomic_store_explicit(&cell->seq, pos + cq->mask + 1, memory_order_release);
+    return 1;
+}
+
+static void internal_compq_signal(TCompQ *cq) {
+    if(atomic_exchange(&cq->signalled, 1) != 0) {
+        return;
+    }
+
+#ifdef __linux__
+    uint64_t one = 1;
+    while(write(cq->writefd, &one, sizeof(one)) < 0 && errno == EINTR);
+#else
+    char one = 1;
+    while(write(cq->writefd, &one, sizeof(one)) < 0 && errno == EINTR);
+#endif
+}
+
+static void internal_compq_clear(TCompQ *cq) {
+#ifdef __linux__
+    uint64_t count;
+    while(read(cq->readfd, &count, sizeof(count)) < 0 && errno == EINTR);
+#else
+    char buf[64];
+    while(read(cq->readfd, buf, sizeof(buf)) > 0);
+#endif
+}
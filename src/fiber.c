@@ -0,0 +1,266 @@
+// ucontext is only exposed on macOS when asking for the XSI interfaces
+#if defined(__APPLE__)
+#define _XOPEN_SOURCE 600
+#endif
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/**
+ * @note    will remove this later
+ */
+#include <assert.h>
+
+#include "pool.h"
+#include "il.h"
+#include "internal.h"
+
+// finished fibers each thread keeps for its next tasks
+#define FIBER_CACHE 16
+
+#ifndef MAP_STACK
+#define MAP_STACK 0
+#endif
+
+/**
+ * A task running on its own stack.
+ * The fiber can switch back to the worker thread in the middle of the task and be resumed later,
+ * possibly by another worker thread of the same group.
+ */
+typedef struct Fiber {
+    IL move;
+
+    ucontext_t ctx;
+    // context of the worker thread that is running the fiber
+    ucontext_t *worker;
+
+    // the mapping starts with a guard page
+    char *stack;
+    size_t size;
+
+    TGroup *tg;
+
+    // the task of the fiber, NULL once the task is finished
+    Work *task;
+
+    // set while the fiber is suspending itself on a wait queue
+    WaitQ *parkQ;
+    pthread_mutex_t *parkMutex;
+
+    // queued in the group when the fiber is woken up
+    Work resume;
+} Fiber;
+
+static __thread Fiber *currFiber = NULL;
+static __thread ucontext_t workerCtx;
+
+static Fiber *internal_fiber_create(TGroup *tg);
+static void internal_fiber_entry(void);
+static Fiber *internal_current_fiber(void);
+static void internal_set_fiber(Fiber *f);
+static ucontext_t *internal_worker_ctx(void);
+
+/*  --Module Hooks--  */
+
+/**
+ * Runs a task on a fiber, or resumes the fiber the work belongs to.
+ * Returns to the worker once the task is finished or the fiber suspended itself.
+ * A suspended fiber is only added to its wait queue here, after its context is saved,
+ * so it can never be resumed by another thread while it is still running.
+ *
+ * @param   cache   finished fibers of the calling worker thread
+ * @return  1 when the fiber suspended itself, 0 once its task is finished
+ */
+int internal_fiber_run(TGroup *tg, LL *cache, Work *work) {
+    Fiber *f;
+
+    if(work->flags & WORK_FIBER) {
+        f = (Fiber *)work->work_arg;
+    } else {
+        IL *il = list_pop(cache);
+        f = (il != NULL) ? CONTAINER_OF(il, Fiber, move) : internal_fiber_create(tg);
+        f->task = work;
+    }
+
+    f->worker = internal_worker_ctx();
+    internal_set_fiber(f);
+    swapcontext(f->worker, &f->ctx);
+    internal_set_fiber(NULL);
+
+    if(f->task == NULL) {
+        if(cache->len < FIBER_CACHE) {
+            list_append(cache, &f->move);
+        } else {
+            internal_fiber_free(&f->move);
+        }
+        return 0;
+    }
+
+    // the fiber suspended itself while holding the lock of the wait queue
+    pthread_mutex_t *mutex = f->parkMutex;
+    list_append(&f->parkQ->fibers, &f->move);
+    pthread_mutex_unlock(mutex);
+    return 1;
+}
+
+void internal_fiber_free(IL *il) {
+    Fiber *f = CONTAINER_OF(il, Fiber, move);
+
+    munmap(f->stack, f->size);
+    free(f);
+}
+
+int internal_in_fiber(void) {
+    return internal_current_fiber() != NULL;
+}
+
+void internal_init_waitq(WaitQ *wq) {
+    pthread_cond_init(&wq->cond, NULL);
+    init_list(&wq->fibers);
+}
+
+void internal_destroy_waitq(WaitQ *wq) {
+    pthread_cond_destroy(&wq->cond);
+}
+
+/**
+ * Works like pthread_cond_wait() and has to be called in a loop that checks the condition.
+ * A fiber switches back to its worker instead of blocking, the worker releases the mutex for it.
+ * The fiber locks the mutex again once it is resumed.
+ *
+ * @param   wq      wait queue of the primitive
+ * @param   mutex   lock of the primitive, held by the caller
+ */
+void internal_wait(WaitQ *wq, pthread_mutex_t *mutex) {
+    Fiber *f = internal_current_fiber();
+
+    if(f == NULL) {
+        // the thread blocks so the rest of its batch goes back to the group
+        internal_release_batch();
+        pthread_cond_wait(&wq->cond, mutex);
+        return;
+    }
+
+    f->parkQ = wq;
+    f->parkMutex = mutex;
+    swapcontext(&f->ctx, f->worker);
+
+    // resumed by a worker, maybe not the one that suspended the fiber
+    f->parkQ = NULL;
+    f->parkMutex = NULL;
+    pthread_mutex_lock(mutex);
+}
+
+/**
+ * Wakes a single waiter.
+ * Has to be called with the lock of the primitive held.
+ */
+void internal_wake_one(WaitQ *wq) {
+    IL *il = list_pop(&wq->fibers);
+    if(il != NULL) {
+        Fiber *f = CONTAINER_OF(il, Fiber, move);
+        internal_requeue(f->tg, &f->resume);
+        return;
+    }
+
+    pthread_cond_signal(&wq->cond);
+}
+
+/**
+ * Wakes every waiter.
+ * Has to be called with the lock of the primitive held.
+ */
+void internal_wake_all(WaitQ *wq) {
+    IL *il;
+    while((il = list_pop(&wq->fibers)) != NULL) {
+        Fiber *f = CONTAINER_OF(il, Fiber, move);
+        internal_requeue(f->tg, &f->resume);
+    }
+
+    pthread_cond_broadcast(&wq->cond);
+}
+
+/*  --Internal Functions--  */
+
+/**
+ * Maps the stack of a new fiber with a guard page below it.
+ */
+static Fiber *internal_fiber_create(TGroup *tg) {
+    Fiber *f;
+    f = (Fiber *)malloc(sizeof(Fiber));
+    assert(f != NULL);
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t stack = (internal_fiber_stack(tg) + page - 1) / page * page;
+
+    f->size = stack + page;
+    f->stack = mmap(NULL, f->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    assert(f->stack != MAP_FAILED);
+
+    int rc = mprotect(f->stack, page, PROT_NONE);
+    assert(rc == 0);
+
+    init_il(&f->move);
+    f->tg = tg;
+    f->task = NULL;
+    f->worker = NULL;
+    f->parkQ = NULL;
+    f->parkMutex = NULL;
+
+    init_il(&f->resume.move);
+    f->resume.wf = NULL;
+    f->resume.work_arg = f;
+    f->resume.flags = WORK_FIBER;
+    f->resume.join = NULL;
+    f->resume.compq = NULL;
+    f->resume.tag = NULL;
+    f->resume.cancel = NULL;
+    f->resume.done = NULL;
+    atomic_init(&f->resume.refs, 1);
+    atomic_init(&f->resume.queue, NULL);
+    f->resume.enqueued = 0;
+    f->resume.group = NULL;
+
+    rc = getcontext(&f->ctx);
+    assert(rc == 0);
+    f->ctx.uc_stack.ss_sp = f->stack + page;
+    f->ctx.uc_stack.ss_size = stack;
+    f->ctx.uc_link = NULL;
+    makecontext(&f->ctx, internal_fiber_entry, 0);
+
+    return f;
+}
+
+/**
+ * Fibers never return from this function.
+ * A finished fiber switches back to its worker and continues here when it is given its next task.
+ */
+static void internal_fiber_entry(void) {
+    while(1) {
+        Fiber *f = internal_current_fiber();
+
+        internal_run_task(f->task);
+        f->task = NULL;
+
+        swapcontext(&f->ctx, f->worker);
+    }
+}
+
+/**
+ * Thread locals are only read through these functions.
+ * A fiber can move between threads so the compiler must not keep a thread local address across a switch.
+ */
+__attribute__((noinline)) static Fiber *internal_current_fiber(void) {
+    return currFiber;
+}
+
+__attribute__((noinline)) static void internal_set_fiber(Fiber *f) {
+    currFiber = f;
+}
+
+__attribute__((noinline)) static ucontext_t *internal_worker_ctx(void) {
+    return &workerCtx;
+}
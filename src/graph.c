@@ -0,0 +1,344 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/**
+ * @note    will remove this later
+ */
+#include <assert.h>
+
+#include "pool.h"
+#include "il.h"
+#include "internal.h"
+
+struct TNode {
+    IL move;
+
+    TGraph *graph;
+    TGroup *tg;
+
+    work_func func;
+    void *arg;
+
+    // predecessors that have not finished in the current run
+    atomic_uint deps;
+    unsigned int numPreds;
+    // set when a predecessor was cancelled in the current run, the node is skipped as well
+    atomic_int skip;
+    // links the nodes a thread runs itself because their group was full
+    TNode *ready;
+
+    TNode **succs;
+    size_t numSuccs;
+    size_t capSuccs;
+};
+
+struct TGraph {
+    pthread_mutex_t mutexGraph;
+    pthread_cond_t condGraph;
+
+    LL nodes;
+
+    // nodes that have not finished in the current run
+    atomic_size_t pending;
+    int running;
+};
+
+static int internal_node_submit(TNode *node);
+static void internal_node_run(void *arg);
+static void internal_node_cancel(void *arg);
+static void internal_node_skip(TNode *node);
+static void internal_node_done(TGraph *graph);
+
+/**
+ * Initializes an empty task graph.
+ *
+ * @param   graph   double pointer to graph struct for internal memory allocation
+ */
+int init_graph(TGraph **graph) {
+    if(graph == NULL) {
+        return POOL_ERROR;
+    }
+
+    *graph = (TGraph *)malloc(sizeof(TGraph));
+    if(*graph == NULL) {
+        return POOL_ERROR;
+    }
+
+    init_list(&(*graph)->nodes);
+    atomic_init(&(*graph)->pending, 0);
+    (*graph)->running = 0;
+
+    pthread_mutex_init(&(*graph)->mutexGraph, NULL);
+    pthread_cond_init(&(*graph)->condGraph, NULL);
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Adds a task to the graph.
+ * The task is queued in its group only once all of its predecessors have finished.
+ * Predecessors have to be added first so a graph can never hold a cycle.
+ *
+ * @param   graph       graph struct
+ * @param   tg          group the task runs in, successors can use different groups
+ * @param   func        the func that will be called in the thread function
+ * @param   arg         the arg passed into the func
+ * @param   preds       nodes of the same graph that must finish before this one
+ * @param   numPreds    number of nodes in preds
+ */
+TNode *add_node(TGraph *graph, TGroup *tg, work_func func, void *arg, TNode **preds, size_t numPreds) {
+    if(graph == NULL || tg == NULL || func == NULL) {
+        return NULL;
+    }
+
+    if(numPreds > 0 && preds == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < numPreds; i++) {
+        if(preds[i] == NULL || preds[i]->graph != graph) {
+            return NULL;
+        }
+    }
+
+    pthread_mutex_lock(&graph->mutexGraph);
+    if(graph->running) {
+        pthread_mutex_unlock(&graph->mutexGraph);
+        return NULL;
+    }
+
+    TNode *node;
+    node = (TNode *)malloc(sizeof(TNode));
+    assert(node != NULL);
+
+    init_il(&node->move);
+    node->graph = graph;
+    node->tg = tg;
+    node->func = func;
+    node->arg = arg;
+    node->numPreds = numPreds;
+    atomic_init(&node->deps, numPreds);
+    atomic_init(&node->skip, 0);
+    node->succs = NULL;
+    node->numSuccs = 0;
+    node->capSuccs = 0;
+
+    for (size_t i = 0; i < numPreds; i++) {
+        TNode *pred = preds[i];
+        if(pred->numSuccs == pred->capSuccs) {
+            pred->capSuccs = (pred->capSuccs == 0) ? 4 : pred->capSuccs * 2;
+            pred->succs = (TNode **)realloc(pred->succs, pred->capSuccs * sizeof(TNode *));
+            assert(pred->succs != NULL);
+        }
+        pred->succs[pred->numSuccs++] = node;
+    }
+
+    list_append(&graph->nodes, &node->move);
+    pthread_mutex_unlock(&graph->mutexGraph);
+
+    return node;
+}
+
+/**
+ * Starts a run of the graph by queueing every task without predecessors.
+ * A graph can be run again once wait_graph() returns.
+ * A task that is cancelled, discarded by a shutdown or dropped by its group is skipped with every task after it,
+ * the run still finishes.
+ *
+ * @param   graph   graph struct
+ */
+int run_graph(TGraph *graph) {
+    if(graph == NULL) {
+        return POOL_ERROR;
+    }
+
+    pthread_mutex_lock(&graph->mutexGraph);
+    if(graph->running) {
+        pthread_mutex_unlock(&graph->mutexGraph);
+        return POOL_ERROR;
+    }
+
+    if(empty(&graph->nodes)) {
+        pthread_mutex_unlock(&graph->mutexGraph);
+        return POOL_SUCCESS;
+    }
+
+    IL *curr;
+    for_each(&graph->nodes.head, curr) {
+        TNode *node = CONTAINER_OF(curr, TNode, move);
+        atomic_store(&node->deps, node->numPreds);
+        atomic_store(&node->skip, 0);
+    }
+    // the extra count keeps the run open until every root is queued
+    atomic_store(&graph->pending, graph->nodes.len + 1);
+    graph->running = 1;
+    pthread_mutex_unlock(&graph->mutexGraph);
+
+    // nodes are only added while the graph is not running so the list is stable
+    for_each(&graph->nodes.head, curr) {
+        TNode *node = CONTAINER_OF(curr, TNode, move);
+        if(node->numPreds == 0 && internal_node_submit(node) == GROUP_FULL) {
+            internal_node_run(node);
+        }
+    }
+    internal_node_done(graph);
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Wait till every task of the current run has finished.
+ *
+ * @param   graph   graph struct
+ */
+void wait_graph(TGraph *graph) {
+    if(graph == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&graph->mutexGraph);
+    while(graph->running) {
+        pthread_cond_wait(&graph->condGraph, &graph->mutexGraph);
+    }
+    pthread_mutex_unlock(&graph->mutexGraph);
+}
+
+/**
+ * Waits for the current run then frees the graph and all of its nodes.
+ *
+ * @param   graph   graph struct
+ */
+void destroy_graph(TGraph *graph) {
+    if(graph == NULL) {
+        return;
+    }
+
+    wait_graph(graph);
+
+    IL *curr;
+    while((curr = list_pop(&graph->nodes)) != NULL) {
+        TNode *node = CONTAINER_OF(curr, TNode, move);
+        free(node->succs);
+        free(node);
+    }
+
+    pthread_cond_destroy(&graph->condGraph);
+    pthread_mutex_destroy(&graph->mutexGraph);
+
+    free(graph);
+}
+
+/*  --Internal Functions--  */
+
+/**
+ * Queues a ready node in its group.
+ * A node its group turns away because it is closing or shedding work is skipped like a cancelled one.
+ *
+ * @return  GROUP_FULL when the queue of the group is full, the caller then runs the node so the run always finishes
+ */
+static int internal_node_submit(TNode *node) {
+    Work *work;
+    int rc;
+
+    init_work(&work);
+    add_work(work, internal_node_run, node);
+    add_cancel(work, internal_node_cancel);
+    work->flags = WORK_INTERNAL;
+
+    rc = do_work(node->tg, work);
+    if(rc == POOL_SUCCESS) {
+        return POOL_SUCCESS;
+    }
+    release_work(work);
+
+    if(rc == GROUP_FULL) {
+        return GROUP_FULL;
+    }
+    internal_node_skip(node);
+    return POOL_SUCCESS;
+}
+
+/**
+ * Runs a node then releases its successors.
+ * The first successor that becomes ready in the group of this worker runs next on the same thread,
+ * while its inputs are still in cache. The other ready successors are queued in their groups.
+ * Successors whose group is full are run here as well, one after the other instead of nested.
+ */
+static void internal_node_run(void *arg) {
+    TNode *node = (TNode *)arg;
+    TGroup *tg = internal_current_group();
+    TNode *ready = NULL;
+
+    while(node != NULL) {
+        TGraph *graph = node->graph;
+        TNode *next = NULL;
+
+        node->func(node->arg);
+
+        for (size_t i = 0; i < node->numSuccs; i++) {
+            TNode *succ = node->succs[i];
+
+            if(atomic_fetch_sub(&succ->deps, 1) != 1) {
+                continue;
+            }
+
+            if(atomic_load(&succ->skip)) {
+                internal_node_skip(succ);
+            } else if(next == NULL && succ->tg == tg) {
+                next = succ;
+            } else if(internal_node_submit(succ) == GROUP_FULL) {
+                succ->ready = ready;
+                ready = succ;
+            }
+        }
+
+        // the graph can be freed once the last node is done so it is not touched after this
+        internal_node_done(graph);
+
+        if(next == NULL && ready != NULL) {
+            next = ready;
+            ready = ready->ready;
+        }
+        node = next;
+    }
+}
+
+/**
+ * The work of the node was taken out of its group before it ran.
+ * Nothing is queued from here since the group can be shutting down.
+ */
+static void internal_node_cancel(void *arg) {
+    internal_node_skip((TNode *)arg);
+}
+
+/**
+ * Finishes a node without running it along with the successors that only it was holding back.
+ * Successors that still wait on other nodes are marked so they are skipped once those finish.
+ */
+static void internal_node_skip(TNode *node) {
+    TGraph *graph = node->graph;
+
+    for (size_t i = 0; i < node->numSuccs; i++) {
+        TNode *succ = node->succs[i];
+
+        // marked before the count drops so the predecessor that finishes last sees it
+        atomic_store(&succ->skip, 1);
+        if(atomic_fetch_sub(&succ->deps, 1) == 1) {
+            internal_node_skip(succ);
+        }
+    }
+
+    internal_node_done(graph);
+}
+
+static void internal_node_done(TGraph *graph) {
+    if(atomic_fetch_sub(&graph->pending, 1) != 1) {
+        return;
+    }
+
+    pthread_mutex_lock(&graph->mutexGraph);
+    graph->running = 0;
+    pthread_cond_broadcast(&graph->condGraph);
+    pthread_mutex_unlock(&graph->mutexGraph);
+}
@@ -61,6 +61,27 @@ static inline IL *list_pop(LL *list) {
     return rc;
 }
 
+/**
+ * Moves every item of the from list to the tail of the to list.
+ * The from list is left empty.
+ */
+static inline void list_splice(LL *to, LL *from) {
+    if(empty(from)) {
+        return;
+    }
+
+    IL *first = from->head.next;
+    IL *last = from->head.prev;
+
+    first->prev = to->head.prev;
+    to->head.prev->next = first;
+    last->next = &to->head;
+    to->head.prev = last;
+
+    to->len += from->len;
+    init_list(from);
+}
+
 #define INIT_LIST(list) \
     list = {{&(list).head, &(list).head}, 0}
 
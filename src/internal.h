@@ -0,0 +1,107 @@
+#ifndef INTERNAL_H
+#define INTERNAL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "pool.h"
+#include "il.h"
+
+// work that resumes a suspended fiber, owned by the fiber and never freed by the pool
+#define WORK_FIBER 0x01
+// work the pool queues on behalf of other work, such as a strand, the group completion queue is not applied
+#define WORK_INTERNAL 0x02
+
+struct Work {
+    IL move;
+
+    work_func wf;
+    void *work_arg;
+    int flags;
+
+    // join that is told when this work finishes, NULL if none
+    TJoin *join;
+
+    // completion queue that receives tag when this work finishes, NULL if none
+    TCompQ *compq;
+    void *tag;
+
+    // called with work_arg when the work is cancelled or discarded, NULL if none
+    work_func cancel;
+    // called with work_arg instead of freeing the work when it lives in a slot of the caller, NULL if malloced
+    work_func done;
+    // the pool holds one reference, retain_work() adds one for a handle that outlives the task
+    atomic_int refs;
+    // shard the work is queued in, NULL while it is staged, running or done
+    void *_Atomic queue;
+    // time the work was passed to a group with a delay target, 0 if none
+    uint64_t enqueued;
+    // group that counts the work as in flight, NULL while it is not accepted
+    TGroup *group;
+};
+
+/**
+ * Waiters of a pool aware wait primitive.
+ * Threads sleep on the condition, fibers are parked in the list and requeued in their group when woken.
+ * The primitive provides the mutex that protects its state and the wait queue.
+ */
+typedef struct WaitQ {
+    pthread_cond_t cond;
+    LL fibers;
+} WaitQ;
+
+typedef struct Reactor Reactor;
+typedef struct Uring Uring;
+
+/*  --Hooks into pool.c used by the other pool modules--  */
+
+unsigned int internal_group_threads(TGroup *tg);
+TGroup *internal_current_group(void);
+int internal_help(TGroup *tg);
+void internal_release_batch(void);
+void internal_run_task(Work *work);
+void internal_requeue(TGroup *tg, Work *work);
+void internal_work_defaults(TGroup *tg, Work *work);
+void internal_cancel_task(Work *work);
+void internal_track(TGroup *tg, Work *work);
+size_t internal_fiber_stack(TGroup *tg);
+Reactor *internal_pool_reactor(TGroup *tg);
+Uring *internal_pool_uring(TGroup *tg);
+TGroup *internal_reserve_group(TPool *tp, unsigned int min, unsigned int max);
+
+// join.c
+void internal_join_done(TJoin *join);
+
+// compq.c
+void internal_compq_post(TCompQ *cq, void *tag, int status);
+
+// fiber.c
+int internal_fiber_run(TGroup *tg, LL *cache, Work *work);
+void internal_fiber_free(IL *il);
+int internal_in_fiber(void);
+void internal_init_waitq(WaitQ *wq);
+void internal_destroy_waitq(WaitQ *wq);
+void internal_wait(WaitQ *wq, pthread_mutex_t *mutex);
+void internal_wake_one(WaitQ *wq);
+void internal_wake_all(WaitQ *wq);
+
+// reactor.c
+Reactor *internal_reactor_init(void);
+void internal_reactor_stop(Reactor *r);
+void internal_reactor_destroy(Reactor *r);
+
+// numa.c
+void *internal_node_alloc(size_t size, int node);
+void internal_node_free(void *ptr, size_t size, int node);
+int internal_node_cpus(const int *cpus, size_t numCpus, int node, void **set, size_t *size);
+void internal_node_cpus_free(void *set);
+void internal_node_pin(pthread_attr_t *attr, void *set, size_t size);
+void internal_node_bind_thread(int node);
+
+// uring.c
+Uring *internal_uring_init(TPool *tp);
+void internal_uring_stop(Uring *u);
+void internal_uring_destroy(Uring *u);
+
+#endif //INTERNAL_H
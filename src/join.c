@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "internal.h"
+
+#define NS_PER_SEC 1000000000L
+// how long an idle waiter sleeps before it looks for work to help with again
+#define JOIN_POLL_NS 1000000L
+
+/**
+ * Counts the children of a task that have not finished.
+ * Children are counted down under the join lock so the waiter can free the join as soon as it returns.
+ * A task running on a fiber is suspended on the wait queue instead of helping.
+ */
+struct TJoin {
+    pthread_mutex_t mutexJoin;
+    WaitQ waitJoin;
+
+    atomic_size_t pending;
+};
+
+/**
+ * Initializes a join used to wait for a set of child tasks.
+ *
+ * @param   join    double pointer to join struct for internal memory allocation
+ */
+int init_join(TJoin **join) {
+    if(join == NULL) {
+        return POOL_ERROR;
+    }
+
+    *join = (TJoin *)malloc(sizeof(TJoin));
+    if(*join == NULL) {
+        return POOL_ERROR;
+    }
+
+    atomic_init(&(*join)->pending, 0);
+    pthread_mutex_init(&(*join)->mutexJoin, NULL);
+    internal_init_waitq(&(*join)->waitJoin);
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Does the work in a group and counts it as a child of the join.
+ *
+ * @param   join    join struct
+ * @param   tg      group struct
+ * @param   work    work struct that is populated from the add_work()
+ */
+int join_work(TJoin *join, TGroup *tg, Work *work) {
+    if(join == NULL || tg == NULL || work == NULL) {
+        return POOL_ERROR;
+    }
+
+    work->join = join;
+    atomic_fetch_add(&join->pending, 1);
+
+    int rc = do_work(tg, work);
+    if(rc != POOL_SUCCESS) {
+        work->join = NULL;
+        internal_join_done(join);
+    }
+
+    return rc;
+}
+
+/**
+ * Wait till all the children of the join are finished.
+ * A worker thread that waits runs the queued tasks of its own group instead of sleeping,
+ * so a task can wait on its children without blocking a thread or waiting on itself.
+ * A task on a fiber is suspended until the last child finishes and its thread runs other tasks meanwhile.
+ *
+ * @param   join    join struct
+ */
+void wait_join(TJoin *join) {
+    if(join == NULL) {
+        return;
+    }
+
+    if(internal_in_fiber()) {
+        pthread_mutex_lock(&join->mutexJoin);
+        while(atomic_load(&join->pending) > 0) {
+            internal_wait(&join->waitJoin, &join->mutexJoin);
+        }
+        pthread_mutex_unlock(&join->mutexJoin);
+        return;
+    }
+
+    TGroup *tg = internal_current_group();
+
+    while(atomic_load(&join->pending) > 0) {
+        if(tg != NULL && internal_help(tg)) {
+            continue;
+        }
+
+        // children are running somewhere else, look for new work every poll
+        struct timespec timeout;
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_nsec += (tg != NULL) ? JOIN_POLL_NS : NS_PER_SEC;
+        if(timeout.tv_nsec >= NS_PER_SEC) {
+            timeout.tv_sec++;
+            timeout.tv_nsec -= NS_PER_SEC;
+        }
+
+        pthread_mutex_lock(&join->mutexJoin);
+        if(atomic_load(&join->pending) > 0) {
+            pthread_cond_timedwait(&join->waitJoin.cond, &join->mutexJoin, &timeout);
+        }
+        pthread_mutex_unlock(&join->mutexJoin);
+    }
+
+    // the last child may still hold the lock after counting down
+    pthread_mutex_lock(&join->mutexJoin);
+    pthread_mutex_unlock(&join->mutexJoin);
+}
+
+/**
+ * Frees the join.
+ * The join must not have any children left.
+ *
+ * @param   join    join struct
+ */
+void destroy_join(TJoin *join) {
+    if(join == NULL) {
+        return;
+    }
+
+    internal_destroy_waitq(&join->waitJoin);
+    pthread_mutex_destroy(&join->mutexJoin);
+
+    free(join);
+}
+
+/*  --Module Hooks--  */
+
+void internal_join_done(TJoin *join) {
+    pthread_mutex_lock(&join->mutexJoin);
+    if(atomic_fetch_sub(&join->pending, 1) == 1) {
+        internal_wake_all(&join->waitJoin);
+    }
+    pthread_mutex_unlock(&join->mutexJoin);
+}
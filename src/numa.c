@@ -0,0 +1,214 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+/**
+ * @note    will remove this later
+ */
+#include <assert.h>
+
+#include "pool.h"
+#include "internal.h"
+
+#define CACHE_LINE 64
+// longest cpulist read from sysfs
+#define CPULIST_SIZE 4096
+
+#ifdef __linux__
+static void internal_node_mask(int node, unsigned long *mask, unsigned long *maxnode);
+#endif
+
+/*  --Module Hooks--  */
+
+/**
+ * Allocates memory placed on a NUMA node.
+ * Memory for a node is mapped on its own pages so the policy does not move other allocations.
+ *
+ * @param   size    bytes to allocate
+ * @param   node    NUMA node of the memory, -1 for any node
+ */
+void *internal_node_alloc(size_t size, int node) {
+    void *ptr;
+
+#ifdef __linux__
+    if(node >= 0) {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(ptr != MAP_FAILED);
+
+        // pages are only placed on first touch so the policy is in place before any use
+        unsigned long mask[(CPU_SETSIZE + 8 * sizeof(unsigned long) - 1) / (8 * sizeof(unsigned long))];
+        unsigned long maxnode;
+        internal_node_mask(node, mask, &maxnode);
+        syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, mask, maxnode, 0);
+
+        return ptr;
+    }
+#endif
+
+    int rc = posix_memalign(&ptr, CACHE_LINE, size);
+    assert(rc == 0);
+
+    return ptr;
+}
+
+/**
+ * Frees memory from internal_node_alloc(), size and node have to match the allocation.
+ */
+void internal_node_free(void *ptr, size_t size, int node) {
+    if(ptr == NULL) {
+        return;
+    }
+
+#ifdef __linux__
+    if(node >= 0) {
+        munmap(ptr, size);
+        return;
+    }
+#endif
+
+    free(ptr);
+}
+
+/**
+ * Builds the cpu set the threads of a group are pinned to.
+ * An explicit cpu list wins over the cpus of the NUMA node.
+ *
+ * @param   cpus    cpu numbers, NULL when only the node is given
+ * @param   numCpus number of cpus
+ * @param   node    NUMA node, -1 for none
+ * @param   set     receives the cpu set, NULL when the threads are not pinned
+ * @param   size    receives the size of the cpu set in bytes
+ * @return  POOL_ERROR for a cpu or node that does not exist
+ */
+int internal_node_cpus(const int *cpus, size_t numCpus, int node, void **set, size_t *size) {
+    *set = NULL;
+    *size = 0;
+
+    if((cpus == NULL || numCpus == 0) && node < 0) {
+        return POOL_SUCCESS;
+    }
+
+#ifdef __linux__
+    long confCpus = sysconf(_SC_NPROCESSORS_CONF);
+    int maxCpu = (confCpus > 0) ? (int)confCpus : 1;
+
+    cpu_set_t *cs = CPU_ALLOC(maxCpu);
+    size_t csSize = CPU_ALLOC_SIZE(maxCpu);
+    assert(cs != NULL);
+    CPU_ZERO_S(csSize, cs);
+
+    // the cpulist of the node also tells if the node exists
+    char list[CPULIST_SIZE] = "";
+    if(node >= 0) {
+        char path[64];
+        FILE *f;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        f = (node < CPU_SETSIZE) ? fopen(path, "r") : NULL;
+        if(f == NULL) {
+            CPU_FREE(cs);
+            return POOL_ERROR;
+        }
+        if(fgets(list, sizeof(list), f) == NULL) {
+            list[0] = '\0';
+        }
+        fclose(f);
+    }
+
+    if(cpus != NULL && numCpus > 0) {
+        for (size_t i = 0; i < numCpus; i++) {
+            if(cpus[i] < 0 || cpus[i] >= maxCpu) {
+                CPU_FREE(cs);
+                return POOL_ERROR;
+            }
+            CPU_SET_S(cpus[i], csSize, cs);
+        }
+    } else {
+        // ranges such as 0-3,8-11
+        char *p = list;
+        while(*p >= '0' && *p <= '9') {
+            long first = strtol(p, &p, 10);
+            long last = first;
+            if(*p == '-') {
+                last = strtol(p + 1, &p, 10);
+            }
+            for (long c = first; c <= last && c < maxCpu; c++) {
+                CPU_SET_S(c, csSize, cs);
+            }
+            if(*p == ',') {
+                p++;
+            }
+        }
+    }
+
+    if(CPU_COUNT_S(csSize, cs) == 0) {
+        CPU_FREE(cs);
+        return POOL_ERROR;
+    }
+
+    *set = cs;
+    *size = csSize;
+#endif
+
+    return POOL_SUCCESS;
+}
+
+void internal_node_cpus_free(void *set) {
+#ifdef __linux__
+    if(set != NULL) {
+        CPU_FREE((cpu_set_t *)set);
+    }
+#endif
+}
+
+/**
+ * Pins the attributes of a new thread to the cpu set of its group.
+ */
+void internal_node_pin(pthread_attr_t *attr, void *set, size_t size) {
+#ifdef __linux__
+    if(set != NULL) {
+        pthread_attr_setaffinity_np(attr, size, (cpu_set_t *)set);
+    }
+#endif
+}
+
+/**
+ * Makes the calling thread prefer memory of the node, covering what the tasks allocate too.
+ */
+void internal_node_bind_thread(int node) {
+#ifdef __linux__
+    if(node >= 0) {
+        unsigned long mask[(CPU_SETSIZE + 8 * sizeof(unsigned long) - 1) / (8 * sizeof(unsigned long))];
+        unsigned long maxnode;
+        internal_node_mask(node, mask, &maxnode);
+        syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, maxnode);
+    }
+#endif
+}
+
+/*  --Internal Functions--  */
+
+#ifdef __linux__
+static void internal_node_mask(int node, unsigned long *mask, unsigned long *maxnode) {
+    size_t bits = 8 * sizeof(unsigned long);
+    size_t words = (CPU_SETSIZE + bits - 1) / bits;
+
+    for (size_t i = 0; i < words; i++) {
+        mask[i] = 0;
+    }
+    mask[node / bits] |= 1UL << (node % bits);
+    *maxnode = words * bits;
+}
+#endif
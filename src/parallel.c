@@ -0,0 +1,389 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+/**
+ * @note    will remove this later
+ */
+#include <assert.h>
+
+#include "pool.h"
+#include "internal.h"
+
+// times the caller yields before it sleeps on the range
+#define RANGE_SPIN 64
+#define CACHE_LINE 64
+
+/**
+ * A range shared by the caller and the helper tasks.
+ * Chunks are claimed with guided scheduling, big chunks first and grain sized chunks at the end.
+ * The range is freed by whoever drops the last reference, helpers can run after the caller returned.
+ * 
+ * Reductions give each participant its own cache line padded accumulator slot.
+ * The slots are combined by the caller once no participant is active.
+ */
+typedef struct Range {
+    atomic_size_t next;
+    size_t end;
+    size_t grain;
+    unsigned int workers;
+
+    // iterations finished, the range is complete when it reaches total
+    atomic_size_t done;
+    size_t total;
+
+    range_func func;
+    void *ctx;
+
+    // participants currently working on the range
+    atomic_uint active;
+
+    // accumulator slots, only used by reductions
+    const Reducer *red;
+    char *slots;
+    size_t stride;
+    atomic_uint claimed;
+
+    // the caller and every queued helper hold a reference
+    atomic_uint refs;
+
+    pthread_mutex_t mutexRange;
+    pthread_cond_t condRange;
+    int finished;
+} Range;
+
+typedef struct MapCtx {
+    const char *in;
+    char *out;
+    size_t inSize;
+    size_t outSize;
+
+    map_func func;
+    void *ctx;
+} MapCtx;
+
+static Range *internal_range_init(TGroup *tg, size_t begin, size_t end, size_t grain, range_func func, const Reducer *red, void *ctx);
+static void internal_range_start(TGroup *tg, Range *r);
+static void internal_range_release(Range *r);
+static int internal_range_claim(Range *r, size_t *begin, size_t *end);
+static void internal_range_run(Range *r);
+static void internal_range_helper(void *arg);
+static void internal_range_cancel(void *arg);
+static void internal_range_wait(Range *r);
+static void internal_range_combine(Range *r, void *result);
+static void internal_map_range(size_t begin, size_t end, void *ctx);
+
+/**
+ * Runs func over [begin, end) split into chunks of at least grain iterations.
+ * The calling thread works on the range too and the call returns once every iteration is done.
+ * Only one work struct is allocated for each helper thread, never one per iteration.
+ *
+ * @param   tg      group whose threads help with the range
+ * @param   begin   first index of the range
+ * @param   end     one past the last index of the range
+ * @param   grain   smallest chunk handed to func, 0 is treated as 1
+ * @param   func    called with each chunk [chunkBegin, chunkEnd)
+ * @param   ctx     passed to func
+ *
+ * @note    safe to call from a task in the same group, the caller can finish the range alone
+ */
+int parallel_for(TGroup *tg, size_t begin, size_t end, size_t grain, range_func func, void *ctx) {
+    if(tg == NULL || func == NULL) {
+        return POOL_ERROR;
+    }
+
+    if(begin >= end) {
+        return POOL_SUCCESS;
+    }
+
+    if(grain == 0) {
+        grain = 1;
+    }
+
+    // no helpers for ranges that fit in a single chunk
+    size_t chunks = (end - begin + grain - 1) / grain;
+    if(chunks == 1) {
+        func(begin, end, ctx);
+        return POOL_SUCCESS;
+    }
+
+    Range *r = internal_range_init(tg, begin, end, grain, func, NULL, ctx);
+    internal_range_start(tg, r);
+    internal_range_release(r);
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Reduces [begin, end) into result.
+ * Every participant folds its chunks into a private accumulator started from the identity.
+ * The accumulators are then combined pairwise in a tree, no lock is shared while the range runs.
+ * 
+ * @param   tg      group whose threads help with the range
+ * @param   begin   first index of the range
+ * @param   end     one past the last index of the range
+ * @param   grain   smallest chunk handed to the accumulate function, 0 is treated as 1
+ * @param   red     accumulator size and the identity, accumulate and combine functions, combine must be commutative
+ * @param   ctx     passed to the reducer functions
+ * @param   result  memory of red->size bytes that receives the reduction
+ */
+int parallel_reduce(TGroup *tg, size_t begin, size_t end, size_t grain, const Reducer *red, void *ctx, void *result) {
+    if(tg == NULL || red == NULL || result == NULL || red->size == 0) {
+        return POOL_ERROR;
+    }
+
+    if(red->identity == NULL || red->accumulate == NULL || red->combine == NULL) {
+        return POOL_ERROR;
+    }
+
+    red->identity(result, ctx);
+    if(begin >= end) {
+        return POOL_SUCCESS;
+    }
+
+    if(grain == 0) {
+        grain = 1;
+    }
+
+    if(end - begin <= grain) {
+        red->accumulate(result, begin, end, ctx);
+        return POOL_SUCCESS;
+    }
+
+    Range *r = internal_range_init(tg, begin, end, grain, NULL, red, ctx);
+    internal_range_start(tg, r);
+    internal_range_combine(r, result);
+    internal_range_release(r);
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Applies func to every element of in and stores the results in out.
+ * 
+ * @param   tg      group whose threads help with the array
+ * @param   in      array of len elements of inSize bytes
+ * @param   out     array of len elements of outSize bytes
+ * @param   grain   smallest number of elements handed to a thread, 0 is treated as 1
+ * @param   func    called with each input element and its output element
+ * @param   ctx     passed to func
+ */
+int parallel_map(TGroup *tg, const void *in, void *out, size_t len, size_t inSize, size_t outSize, size_t grain, map_func func, void *ctx) {
+    if(in == NULL || out == NULL || func == NULL) {
+        return POOL_ERROR;
+    }
+
+    MapCtx map = {(const char *)in, (char *)out, inSize, outSize, func, ctx};
+    return parallel_for(tg, 0, len, grain, internal_map_range, &map);
+}
+
+/*  --Internal Functions--  */
+
+/**
+ * There is at most one helper for each thread of the group and for each chunk after the first.
+ */
+static Range *internal_range_init(TGroup *tg, size_t begin, size_t end, size_t grain, range_func func, const Reducer *red, void *ctx) {
+    Range *r;
+    r = (Range *)malloc(sizeof(Range));
+    assert(r != NULL);
+
+    size_t chunks = (end - begin + grain - 1) / grain;
+    unsigned int workers = internal_group_threads(tg) + 1;
+    if(workers > chunks) {
+        workers = chunks;
+    }
+
+    atomic_init(&r->next, begin);
+    r->end = end;
+    r->grain = grain;
+    r->workers = workers;
+
+    atomic_init(&r->done, 0);
+    r->total = end - begin;
+
+    r->func = func;
+    r->ctx = ctx;
+
+    atomic_init(&r->active, 0);
+
+    r->red = red;
+    r->slots = NULL;
+    r->stride = 0;
+    atomic_init(&r->claimed, 0);
+    if(red != NULL) {
+        int rc;
+        r->stride = (red->size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+        rc = posix_memalign((void **)&r->slots, CACHE_LINE, workers * r->stride);
+        assert(rc == 0);
+    }
+
+    atomic_init(&r->refs, 1);
+
+    pthread_mutex_init(&r->mutexRange, NULL);
+    pthread_cond_init(&r->condRange, NULL);
+    r->finished = 0;
+
+    return r;
+}
+
+/**
+ * Queues the helpers then works on the range until it is done.
+ * Helpers bypass the buffer of a producer thread, the caller waits for them and nothing else would flush it.
+ */
+static void internal_range_start(TGroup *tg, Range *r) {
+    for (unsigned int i = 1; i < r->workers; i++) {
+        Work *work;
+
+        atomic_fetch_add(&r->refs, 1);
+        init_work(&work);
+        add_work(work, internal_range_helper, r);
+        add_cancel(work, internal_range_cancel);
+        work->flags = WORK_INTERNAL;
+
+        // the caller picks up the chunks of helpers that could not be queued
+        if(do_work(tg, work) != POOL_SUCCESS) {
+            free(work);
+            atomic_fetch_sub(&r->refs, 1);
+            break;
+        }
+    }
+
+    internal_range_run(r);
+    internal_range_wait(r);
+}
+
+static void internal_range_release(Range *r) {
+    if(atomic_fetch_sub(&r->refs, 1) != 1) {
+        return;
+    }
+
+    free(r->slots);
+    pthread_cond_destroy(&r->condRange);
+    pthread_mutex_destroy(&r->mutexRange);
+    free(r);
+}
+
+/**
+ * Claims the next chunk of the range.
+ * Each chunk is half of the remaining work split between the workers, but never smaller than grain.
+ *
+ * @return  0 when the range has no chunks left
+ */
+static int internal_range_claim(Range *r, size_t *begin, size_t *end) {
+    size_t next = atomic_load_explicit(&r->next, memory_order_relaxed);
+    size_t chunk;
+
+    do {
+        if(next >= r->end) {
+            return 0;
+        }
+
+        chunk = (r->end - next) / (2 * r->workers);
+        if(chunk < r->grain) {
+            chunk = r->grain;
+        }
+        if(chunk > r->end - next) {
+            chunk = r->end - next;
+        }
+    } while(!atomic_compare_exchange_weak(&r->next, &next, next + chunk));
+
+    *begin = next;
+    *end = next + chunk;
+    return 1;
+}
+
+/**
+ * Runs chunks until the range is empty.
+ * A participant only takes an accumulator slot when there are chunks left, late helpers leave the slots alone.
+ * The last participant to leave a finished range wakes the caller.
+ */
+static void internal_range_run(Range *r) {
+    size_t begin, end;
+    void *acc = NULL;
+
+    atomic_fetch_add(&r->active, 1);
+
+    if(r->red != NULL && atomic_load(&r->next) < r->end) {
+        unsigned int slot = atomic_fetch_add(&r->claimed, 1);
+        assert(slot < r->workers);
+
+        acc = r->slots + slot * r->stride;
+        r->red->identity(acc, r->ctx);
+    }
+
+    while(internal_range_claim(r, &begin, &end)) {
+        if(acc != NULL) {
+            r->red->accumulate(acc, begin, end, r->ctx);
+        } else {
+            r->func(begin, end, r->ctx);
+        }
+        atomic_fetch_add(&r->done, end - begin);
+    }
+
+    if(atomic_fetch_sub(&r->active, 1) == 1 && atomic_load(&r->done) == r->total) {
+        pthread_mutex_lock(&r->mutexRange);
+        r->finished = 1;
+        pthread_cond_broadcast(&r->condRange);
+        pthread_mutex_unlock(&r->mutexRange);
+    }
+}
+
+static void internal_range_helper(void *arg) {
+    Range *r = (Range *)arg;
+
+    internal_range_run(r);
+    internal_range_release(r);
+}
+
+/**
+ * A helper taken out of the group only gives back its reference, the caller runs its chunks.
+ */
+static void internal_range_cancel(void *arg) {
+    internal_range_release((Range *)arg);
+}
+
+/**
+ * The last chunks are usually short so the caller yields for a while before it sleeps.
+ */
+static void internal_range_wait(Range *r) {
+    for (int i = 0; i < RANGE_SPIN; i++) {
+        if(atomic_load(&r->done) == r->total && atomic_load(&r->active) == 0) {
+            return;
+        }
+        sched_yield();
+    }
+
+    pthread_mutex_lock(&r->mutexRange);
+    while(!r->finished) {
+        pthread_cond_wait(&r->condRange, &r->mutexRange);
+    }
+    pthread_mutex_unlock(&r->mutexRange);
+}
+
+/**
+ * Combines the accumulator slots pairwise, the distance between partners doubles every round.
+ * Slot 0 ends up with the whole reduction. Slots are claimed in arrival order and hold chunks from anywhere in the range,
+ * which is why combine has to be commutative as well as associative.
+ */
+static void internal_range_combine(Range *r, void *result) {
+    unsigned int claimed = atomic_load(&r->claimed);
+
+    for (unsigned int step = 1; step < claimed; step *= 2) {
+        for (unsigned int i = 0; i + step < claimed; i += 2 * step) {
+            r->red->combine(r->slots + i * r->stride, r->slots + (i + step) * r->stride, r->ctx);
+        }
+    }
+
+    if(claimed > 0) {
+        memcpy(result, r->slots, r->red->size);
+    }
+}
+
+static void internal_map_range(size_t begin, size_t end, void *ctx) {
+    MapCtx *map = (MapCtx *)ctx;
+    for (size_t i = begin; i < end; i++) {
+        map->func(map->in + i * map->inSize, map->out + i * map->outSize, map->ctx);
+    }
+}
@@ -1,8 +1,25 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <limits.h>
 #include <pthread.h>
 
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
 /**
  * @note    will remove this later
  */
@@ -10,30 +27,111 @@
 
 #include "pool.h"
 #include "il.h"
+#include "internal.h"
 
 #define Q_SIZE_MULT 100
+#define CACHE_LINE 64
+// longest thread name pthread_setname_np() takes with the terminator
+#define NAME_SIZE 16
 
 #define DONE_WAITING 1
 
+#define NS_PER_SEC 1000000000L
+#define NS_PER_US 1000L
+// default time the manager thread sleeps between checks
+#define MANAGER_TICK (5 * NS_PER_SEC)
+// shortest time a producer can keep work staged, bounds how often the manager wakes up
+#define LINGER_MIN (MANAGER_TICK / 1000)
+// default interval in microseconds the smallest queue delay is taken over
+#define CODEL_INTERVAL 100000
+// longest the manager thread sleeps while groups are rate limited
+#define RATE_TICK (10 * NS_PER_US * 1000)
+// tokens of one task or one cpu millisecond, cpu tokens are nanoseconds
+#define TOKEN_UNIT 1000000
+// most tasks a worker takes from the queue at once
+#define RUN_BATCH 16
+// smallest fiber stack, a task and the signal frames it can take need more than a page or two
+#define FIBER_STACK_MIN (16 * 1024)
+
 #define GROUP_CLOSE 0x04
 #define GROUP_CLEAN 0x08
-#define GROUP_WAIT 0x10
+// set by a shutdown that cancels the queued work, the batches of the workers included
+#define GROUP_DISCARD 0x10
 #define SOFT_KILL 0x20
 #define HARD_KILL 0x40
-#define POOL_WAITING 0x80
 
-struct Work {
-    IL move;
+// flags of a compensating thread
+#define THREAD_EXTRA 0x01
+#define THREAD_RETIRING 0x02
+// flag of a thread that leaves because its group was resized below the threads it runs
+#define THREAD_SURPLUS 0x04
+
+/**
+ * Each shard is an independent sub queue with its own lock.
+ * Shards are cache line aligned so producers on different shards do not share a line.
+ */
+struct Shard {
+    _Alignas(CACHE_LINE) pthread_mutex_t mutexShard;
+    LL work;
 
-    work_func wf;
-    void *work_arg;
+    // copy of work.len that can be read without the shard lock
+    atomic_size_t count;
 };
 
 struct Q {
-    LL work;
-    size_t capacity;
+    struct Shard *shards;
+    unsigned int numShards;
+    // can be changed by configure_group() while producers add work
+    atomic_size_t capacity;
+    // NUMA node the shards are placed on, -1 for any
+    int node;
+
+    // total work across all shards, reserved before the work is added to a shard
+    _Alignas(CACHE_LINE) atomic_size_t len;
+    // work taken by workers in a batch that has not started yet, still counted as queued
+    _Alignas(CACHE_LINE) atomic_size_t held;
 };
 
+/**
+ * Queue delay control after CoDel, the delay is measured when work leaves the queue.
+ * The group is overloaded once the smallest delay of a whole interval is above the target,
+ * a queue that only has bursts always lets some work through quickly.
+ */
+typedef struct CoDel {
+    // 0 when there is no target
+    uint64_t target;
+    uint64_t interval;
+    int shed;
+
+    // end of the interval and the smallest delay seen in it
+    _Atomic uint64_t intervalEnd;
+    _Atomic uint64_t minDelay;
+    // smallest delay of the last interval that ended
+    _Atomic uint64_t lastDelay;
+    atomic_int overloaded;
+
+    atomic_size_t rejected;
+    atomic_size_t dropped;
+} CoDel;
+
+/**
+ * Token bucket of a rate limited group, the manager thread refills it on its tick.
+ * A task takes one unit when it is fetched, with a cpu budget it is charged for its cpu time once it ran instead
+ * so the bucket can go into debt.
+ */
+typedef struct Bucket {
+    // TOKEN_UNIT tokens added per second, 0 when the group is not rate limited
+    uint64_t rate;
+    int64_t burst;
+    int unit;
+
+    _Atomic int64_t tokens;
+    // last refill, only touched by the manager thread
+    uint64_t refilled;
+    // times work was held back because the bucket was empty
+    atomic_size_t throttled;
+} Bucket;
+
 typedef enum {
     well, 
     moderate, 
@@ -56,36 +154,121 @@ struct TPool {
     unsigned int thrdMax;
 
     LL groups;
-    int groupsWaiting;
+
+    // work accepted by the groups that has not run or been cancelled yet, waited on by wait_pool()
+    atomic_uint inflight;
+    // threads in wait_pool() or wait_group(), a counter that drops to 0 only wakes anyone while there are some
+    atomic_uint quietWaiters;
+    // bumped whenever a counter drops to 0, waiters sleep on it so a wake never touches a group that is gone
+    atomic_uint quietSeq;
+    // waiters sleep on these where there are no futexes
+    pthread_mutex_t mutexQuiet;
+    pthread_cond_t condQuiet;
+
+    // number of registered producer buffers and the shortest linger among them
+    unsigned int producers;
+    uint64_t linger;
+
+    // groups with a token bucket, the manager thread refills them every RATE_TICK
+    unsigned int rated;
 
     // manager thread for the pool to be dynamic
     int flags;
     State state;
     pthread_t manager;
+
+    // set while a wake up for the manager thread is pending
+    atomic_int signalled;
+
+    // started by the first watched descriptor, NULL until then
+    Reactor *reactor;
+
+    // set up by the first file request, NULL until then
+    // has its own lock since the fallback group is added to the pool while it is held
+    pthread_mutex_t mutexIO;
+    Uring *uring;
 };
 
 struct TGroup {
     IL move;
     
     pthread_mutex_t mutexGrp;
+    // signalled when a compensating thread exits
+    pthread_cond_t condGrp;
 
-    int flags;
+    // read without the group lock by producers and workers
+    _Atomic int flags;
+
+    // stack size of the fibers tasks run on, 0 runs tasks on the thread stacks
+    size_t fiberStack;
+    // tasks started on a fiber that have not finished, suspended ones included
+    // the threads of a destroyed group stay until it is 0 so no fiber is left behind
+    atomic_uint fiberTasks;
+
+    // completion queue of every task without one of its own
+    TCompQ *compq;
 
     // work queue
     struct Q q;
 
+    // work accepted by the group that has not run or been cancelled yet, waited on by wait_group()
+    _Alignas(CACHE_LINE) atomic_uint inflight;
+
+    // queue delay control, read by producers and workers without the group lock
+    CoDel codel;
+    // rate limit, taken from by workers without the group lock
+    Bucket bucket;
+
     LL idleThrds;
     LL activeThrds;
 
+    // copy of idleThrds.len that producers can read without the group lock
+    atomic_uint idle;
+
+    // staging buffers of threads registered as producers for this group
+    LL producers;
+
     // min and max thread limits
     unsigned int thrdMax;
     unsigned int thrdMin;
 
     TPool *pool;
 
-    // number of threads currently created
+    // number of threads currently created and the room in thrds
     unsigned int numThrds;
+    unsigned int thrdsCap;
     pthread_t *thrds;
+
+    // threads that still have to leave after the group was made smaller
+    atomic_uint shrink;
+    // threads that left the thread list and have not exited yet
+    unsigned int leaving;
+    // bumped to have the workers hand their batches back to the queue at their next fetch
+    atomic_uint unbatch;
+
+    // NUMA node of the group memory and threads, -1 for any
+    int numaNode;
+    // cpu set the threads are pinned to, NULL when they are not pinned
+    void *cpus;
+    size_t cpusSize;
+
+    // thread attributes, checked by add_group_attr()
+    size_t stackSize;
+    size_t guardSize;
+    int policy;
+    int priority;
+    char name[NAME_SIZE];
+    // set once realtime scheduling was refused, the threads of a POLICY_FIFO group then run with normal scheduling
+    atomic_int fifoDenied;
+
+    // tasks between pool_block_begin() and pool_block_end()
+    atomic_uint blocked;
+    // most compensating threads the group runs beyond thrdMax
+    unsigned int blockMax;
+    // compensating threads alive and the ones that decided to exit
+    // compensating threads are detached and not part of thrds
+    unsigned int extra;
+    unsigned int retiring;
 };
 
 typedef struct TThread {
@@ -99,28 +282,135 @@ typedef struct TThread {
     // current state of a thread
     State state;
 
+    // shard the thread fetches from first
+    unsigned int shard;
+
+    // set for threads started to make up for blocked tasks, they exit once the blocks end
+    int extra;
+
+    // fibers that finished a task and can run the next one
+    LL fibers;
+
+    // rest of the batch taken from the queue, only touched by the thread itself
+    LL runq;
+    // last request of the group to hand the batch back that the thread followed
+    unsigned int unbatch;
+
     Work *currTask;
 
     TGroup *tg;
 } TThread;
 
+/**
+ * Thread local staging buffer for a producer thread.
+ * The owner appends work without touching the group.
+ * The buffer is flushed into the group queue in batches.
+ * 
+ * @note    lock order is always mutexProducers, mutexPool, mutexGrp then mutexProd
+ */
+typedef struct Producer {
+    IL move;
+
+    pthread_mutex_t mutexProd;
+
+    // staged work that has not been added to the group queue yet
+    LL work;
+    unsigned int batch;
+
+    // time the oldest staged work was added and how long it can wait
+    uint64_t first;
+    uint64_t linger;
+
+    // set to NULL under mutexProducers when the group is destroyed before the producer unregisters
+    _Atomic(TGroup *) tg;
+
+    // next buffer registered by the same thread
+    struct Producer *next;
+} Producer;
+
+static __thread Producer *threadProducers = NULL;
+
+// worker thread running on the current thread, NULL outside of the pool
+static __thread TThread *currThrd = NULL;
+static pthread_key_t producerKey;
+static pthread_once_t producerOnce = PTHREAD_ONCE_INIT;
+// held while a producer leaves or its group detaches it, so neither frees what the other still uses
+static pthread_mutex_t mutexProducers = PTHREAD_MUTEX_INITIALIZER;
+
 /*  --Internal Functions--  */
-static int internal_wait_helper(TGroup *tg);
+static void internal_flush_group(TGroup *tg);
+static void internal_untrack(TGroup *tg);
+static void internal_untrack_n(TGroup *tg, unsigned int n, int pool);
+static int internal_quiet_wait(TPool *tp, atomic_uint *inflight, const struct timespec *deadline);
+static void internal_quiet_wake(TPool *tp);
 
 static TThread *internal_create_thread(TGroup *tg, Work *work);
+static int internal_check_attr(const GroupAttr *attr);
+static int internal_start_thread(TGroup *tg, TThread *tt, int detached);
+static void internal_setup_thread(TGroup *tg);
+static void internal_compensate(TGroup *tg);
+static int internal_retire(TGroup *tg, TThread *tt);
+static int internal_surplus(TGroup *tg, TThread *tt);
+static void internal_add_threads(TGroup *tg, unsigned int numThrds);
 static Health internal_health_check(TGroup *tg);
 
-static void internal_destroy_group(TGroup *tg);
+static void internal_destroy_group(TGroup *tg, int mode, const struct timespec *deadline);
+static void internal_discard(TGroup *tg);
+static void internal_deadline(struct timespec *deadline, unsigned int timeoutMs);
+static Work *internal_fetch(TGroup *tg, unsigned int home);
+static Work *internal_take(TGroup *tg, unsigned int home);
+static Work *internal_next(TGroup *tg, unsigned int home);
+static size_t internal_batch(TGroup *tg);
+static void internal_unbatch(TThread *tt);
+static int internal_codel(CoDel *cd, Work *work);
+static int internal_admit(TGroup *tg, Work *work);
+static int internal_bucket_ready(Bucket *b);
+static void internal_throttle(TGroup *tg);
+static void internal_bucket_charge(Bucket *b, int64_t tokens);
+static void internal_refill(TGroup *tg, uint64_t now);
+static uint64_t internal_cpu_now(void);
 static void internal_destroy_thread(TThread *tt);
 
+static void internal_wake_idle(TGroup *tg);
+static TThread *internal_pop_idle(TGroup *tg);
+static void internal_signal_manager(TPool *tp);
+
+static Producer *internal_find_producer(TGroup *tg);
+static int internal_stage_work(Producer *p, Work *work);
+static int internal_flush_producer(Producer *p);
+static void internal_drain_producers(TGroup *tg, uint64_t now, int force);
+static void internal_release_producer(Producer *p);
+static unsigned int internal_detach_producers(TGroup *tg);
+static void internal_pool_linger(TPool *tp);
+static void internal_producer_key(void);
+static void internal_producer_exit(void *arg);
+
+static uint64_t internal_now(void);
+
+static void internal_run_work(TGroup *tg, Work *work);
+
 static void *worker_thread_function(void *arg);
 static void *manager_thread_function(void *arg);
 
-static void q_init(struct Q *q, size_t capacity);
+static void q_init(struct Q *q, size_t capacity, unsigned int numShards, int node);
+static void q_destroy(struct Q *q);
+static size_t q_reserve(struct Q *q, size_t n);
+static struct Shard *q_shard(struct Q *q);
 static int q_append(struct Q *q, Work *work);
-static Work *q_fetch(struct Q *q);
+static size_t q_append_list(struct Q *q, LL *list, int force);
+static void q_place(struct Q *q, LL *list, size_t n);
+static Work *q_fetch(struct Q *q, unsigned int home);
+static Work *q_fetch_batch(struct Q *q, unsigned int home, LL *list, size_t max);
+static int q_remove(struct Q *q, Work *work);
+static size_t q_take(struct Q *q, LL *list, size_t max, int keep);
+static size_t q_len(struct Q *q);
 static int q_full(struct Q *q);
 static int q_empty(struct Q *q);
+static size_t q_queued(struct Q *q);
+
+// round robin shard for each producer thread, 0 until the thread first submits
+static __thread unsigned int threadShard = 0;
+static atomic_uint nextShard = 0;
 
 /**
  * Initializes the pool that will hold groups.
@@ -143,11 +433,22 @@ int init_pool(TPool **tp, unsigned int maxThrds) {
     if(maxThrds == 0) {
         return POOL_ERROR;
     }
-    (*tp)->groupsWaiting = 0;
+    atomic_init(&(*tp)->inflight, 0);
+    atomic_init(&(*tp)->quietWaiters, 0);
+    atomic_init(&(*tp)->quietSeq, 0);
+    pthread_mutex_init(&(*tp)->mutexQuiet, NULL);
+    pthread_cond_init(&(*tp)->condQuiet, NULL);
+    (*tp)->producers = 0;
+    (*tp)->linger = MANAGER_TICK;
+    (*tp)->rated = 0;
     (*tp)->thrdMax = maxThrds;
     (*tp)->totalThrds = 0;
     (*tp)->flags = 0x00;
     (*tp)->state = dead;
+    atomic_init(&(*tp)->signalled, 0);
+    (*tp)->reactor = NULL;
+    (*tp)->uring = NULL;
+    pthread_mutex_init(&(*tp)->mutexIO, NULL);
 
     init_list(&(*tp)->groups);
 
@@ -167,25 +468,35 @@ void wait_pool(TPool *tp) {
         return;
     }
 
-    pthread_mutex_lock(&tp->mutexPool);
-    tp->groupsWaiting = tp->groups.len;
+    wait_pool_timed(tp, 0);
+}
 
-    IL *curr;
-    int rc;
-    for_each(&tp->groups.head, curr) {
-        TGroup *tg = CONTAINER_OF(curr, TGroup, move);
-        rc = internal_wait_helper(tg);
-        if(rc != 0) {
-            tp->groupsWaiting--;
-        }
+/**
+ * Wait till all jobs are finished or the timeout runs out.
+ * Any number of threads can wait at once, they sleep till the last task of the pool runs or is cancelled.
+ * 
+ * @param   tp          pool struct
+ * @param   timeoutMs   longest time to wait, 0 waits for as long as it takes
+ * @return  POOL_TIMEOUT when work was still in flight at the timeout
+ * 
+ * @note    a task must not wait on the pool it runs in
+ */
+int wait_pool_timed(TPool *tp, unsigned int timeoutMs) {
+    if(tp == NULL) {
+        return POOL_ERROR;
     }
 
-    tp->flags |= POOL_WAITING;
-    while(tp->groupsWaiting > 0) {
-        pthread_cond_wait(&tp->condPool, &tp->mutexPool);
+    struct timespec deadline;
+    internal_deadline(&deadline, timeoutMs);
+
+    pthread_mutex_lock(&tp->mutexPool);
+    IL *curr;
+    for_each(&tp->groups.head, curr) {
+        internal_flush_group(CONTAINER_OF(curr, TGroup, move));
     }
-    tp->flags &= ~POOL_WAITING;
     pthread_mutex_unlock(&tp->mutexPool);
+
+    return internal_quiet_wait(tp, &tp->inflight, (timeoutMs > 0) ? &deadline : NULL);
 }
 
 /**
@@ -195,9 +506,35 @@ void wait_pool(TPool *tp) {
  * @param   tp      pool struct
  */
 void destroy_pool(TPool *tp) {
+    shutdown_pool(tp, SHUTDOWN_DRAIN, 0);
+}
+
+/**
+ * Destroys a pool, the mode tells what happens to the work left in the queues.
+ * SHUTDOWN_DRAIN runs all of it, SHUTDOWN_DISCARD cancels it and SHUTDOWN_DEADLINE runs it till the timeout then cancels the rest.
+ * Tasks that are already running always finish.
+ * 
+ * @param   tp          pool struct
+ * @param   mode        SHUTDOWN_DRAIN, SHUTDOWN_DISCARD or SHUTDOWN_DEADLINE
+ * @param   timeoutMs   time the groups get to drain in SHUTDOWN_DEADLINE mode
+ */
+void shutdown_pool(TPool *tp, int mode, unsigned int timeoutMs) {
     if(tp == NULL) {
         return;
     }
+
+    // one deadline for all the groups
+    struct timespec deadline;
+    internal_deadline(&deadline, timeoutMs);
+
+    // no callback is queued once the reactor stops, the queued ones run with the groups
+    // stopped without the pool lock since queueing work can signal the manager thread
+    if(tp->reactor != NULL) {
+        internal_reactor_stop(tp->reactor);
+    }
+    if(tp->uring != NULL) {
+        internal_uring_stop(tp->uring);
+    }
     
     pthread_mutex_lock(&tp->mutexPool);
     if(tp->state != dead) {
@@ -215,23 +552,78 @@ void destroy_pool(TPool *tp) {
         // lock the pool to continue to destroy the pool
         pthread_mutex_lock(&tp->mutexPool);
     }
+    pthread_mutex_unlock(&tp->mutexPool);
 
+    // every producer is detached before the first group is freed
     IL *curr;
+    pthread_mutex_lock(&mutexProducers);
+    pthread_mutex_lock(&tp->mutexPool);
+    for_each(&tp->groups.head, curr) {
+        internal_detach_producers(CONTAINER_OF(curr, TGroup, move));
+    }
+    tp->producers = 0;
+    tp->linger = MANAGER_TICK;
+    pthread_mutex_unlock(&mutexProducers);
+
     while((curr = list_pop(&tp->groups)) != NULL) {
         TGroup *tg = CONTAINER_OF(curr, TGroup, move);
-        internal_destroy_group(tg);
+        internal_destroy_group(tg, mode, &deadline);
         tp->totalThrds -= tg->thrdMax;
+        if(tg->bucket.rate > 0) {
+            tp->rated--;
+        }
 
-        free(tg);
+        internal_node_free(tg, sizeof(TGroup), tg->numaNode);
     }
     pthread_mutex_unlock(&tp->mutexPool);
 
+    if(tp->reactor != NULL) {
+        internal_reactor_destroy(tp->reactor);
+    }
+    if(tp->uring != NULL) {
+        internal_uring_destroy(tp->uring);
+    }
+    pthread_mutex_destroy(&tp->mutexIO);
+
+    pthread_cond_destroy(&tp->condQuiet);
+    pthread_mutex_destroy(&tp->mutexQuiet);
     pthread_cond_destroy(&tp->condPool);
     pthread_mutex_destroy(&tp->mutexPool);
 
     free(tp);
 }
 
+/**
+ * Sets the group attributes to their defaults.
+ * 
+ * @param   attr    attributes passed to add_group_attr()
+ */
+void init_group_attr(GroupAttr *attr) {
+    if(attr == NULL) {
+        return;
+    }
+
+    attr->shards = 1;
+    attr->capacity = 0;
+    attr->fiberStack = 0;
+    attr->compq = NULL;
+    attr->blockMax = 0;
+    attr->cpus = NULL;
+    attr->numCpus = 0;
+    attr->numaNode = -1;
+    attr->stackSize = 0;
+    attr->guardSize = 0;
+    attr->policy = POLICY_NORMAL;
+    attr->priority = 0;
+    attr->name = NULL;
+    attr->targetUs = 0;
+    attr->intervalUs = 0;
+    attr->shed = SHED_REJECT;
+    attr->rate = 0;
+    attr->burst = 0;
+    attr->rateUnit = RATE_TASKS;
+}
+
 /**
  * Adds a group to a pool.
  * 
@@ -241,13 +633,32 @@ void destroy_pool(TPool *tp) {
  * @param   flags   flag options are DYNAMIC AND FIXED
 */
 TGroup *add_group(TPool *tp, unsigned int min, unsigned int max, int flags) {
+    return add_group_attr(tp, min, max, flags, NULL);
+}
+
+/**
+ * Adds a group to a pool with extra attributes.
+ * 
+ * @param   tp      pool struct
+ * @param   min     lower limit for threads in this group
+ * @param   max     upper limit for threads in this group
+ * @param   flags   flag options are DYNAMIC AND FIXED
+ * @param   attr    group attributes, NULL for the defaults
+*/
+TGroup *add_group_attr(TPool *tp, unsigned int min, unsigned int max, int flags, const GroupAttr *attr) {
     TGroup *tg;
+    GroupAttr defaults;
     int rc;
 
     if(tp == NULL) {
         return NULL;
     }
 
+    if(attr == NULL) {
+        init_group_attr(&defaults);
+        attr = &defaults;
+    }
+
     if(min == 0) { 
         min = 1;
     }
@@ -264,14 +675,68 @@ TGroup *add_group(TPool *tp, unsigned int min, unsigned int max, int flags) {
     }
     pthread_mutex_unlock(&tp->mutexPool);
 
-    tg = (TGroup *)malloc(sizeof(TGroup));
-    assert(tg != NULL);
+    if(internal_check_attr(attr) != POOL_SUCCESS) {
+        return NULL;
+    }
+
+    void *cpus;
+    size_t cpusSize;
+    if(internal_node_cpus(attr->cpus, attr->numCpus, attr->numaNode, &cpus, &cpusSize) != POOL_SUCCESS) {
+        return NULL;
+    }
+
+    // the queue header is cache line aligned within the group
+    tg = (TGroup *)internal_node_alloc(sizeof(TGroup), attr->numaNode);
+    tg->numaNode = attr->numaNode;
+    tg->cpus = cpus;
+    tg->cpusSize = cpusSize;
+
+    // stacks are reserved in whole pages
+    long page = sysconf(_SC_PAGESIZE);
+    tg->stackSize = (attr->stackSize + page - 1) / page * page;
+    tg->guardSize = attr->guardSize;
+    tg->policy = attr->policy;
+    tg->priority = attr->priority;
+    atomic_init(&tg->fifoDenied, 0);
+    tg->name[0] = '\0';
+    if(attr->name != NULL) {
+        strncat(tg->name, attr->name, NAME_SIZE - 1);
+    }
+
+    tg->codel.target = (uint64_t)attr->targetUs * NS_PER_US;
+    tg->codel.interval = (uint64_t)((attr->intervalUs > 0) ? attr->intervalUs : CODEL_INTERVAL) * NS_PER_US;
+    tg->codel.shed = attr->shed;
+    atomic_init(&tg->codel.intervalEnd, internal_now() + tg->codel.interval);
+    atomic_init(&tg->codel.minDelay, UINT64_MAX);
+    atomic_init(&tg->codel.lastDelay, 0);
+    atomic_init(&tg->codel.overloaded, 0);
+    atomic_init(&tg->codel.rejected, 0);
+    atomic_init(&tg->codel.dropped, 0);
+
+    // the bucket starts full
+    tg->bucket.rate = attr->rate;
+    tg->bucket.burst = (int64_t)((attr->burst > 0) ? attr->burst : attr->rate) * TOKEN_UNIT;
+    tg->bucket.unit = attr->rateUnit;
+    atomic_init(&tg->bucket.tokens, tg->bucket.burst);
+    tg->bucket.refilled = internal_now();
+    atomic_init(&tg->bucket.throttled, 0);
 
     tg->thrds = (pthread_t *)malloc(max * sizeof(pthread_t));
     assert(tg->thrds != NULL);
     
     tg->numThrds = 0;
+    tg->thrdsCap = max;
+    atomic_init(&tg->shrink, 0);
+    atomic_init(&tg->unbatch, 0);
+    tg->leaving = 0;
     tg->pool = tp;
+    tg->fiberStack = attr->fiberStack;
+    atomic_init(&tg->fiberTasks, 0);
+    tg->compq = attr->compq;
+    tg->blockMax = attr->blockMax;
+    tg->extra = 0;
+    tg->retiring = 0;
+    atomic_init(&tg->blocked, 0);
     
     if(flags == GROUP_FIXED || min == max) {
         tg->flags = GROUP_FIXED;
@@ -286,51 +751,75 @@ TGroup *add_group(TPool *tp, unsigned int min, unsigned int max, int flags) {
 
     init_list(&tg->idleThrds);
     init_list(&tg->activeThrds);
+    init_list(&tg->producers);
+    atomic_init(&tg->idle, 0);
+    atomic_init(&tg->inflight, 0);
 
     pthread_mutex_init(&tg->mutexGrp, NULL);
+    pthread_cond_init(&tg->condGrp, NULL);
 
-    /**
-     * @note    queue size can be changed later
-     * @note    picked random size
-    */
-    size_t size = max * Q_SIZE_MULT;
-    q_init(&tg->q, size);
+    // the capacity can be changed later with configure_group()
+    size_t size = (attr->capacity > 0) ? attr->capacity : max * Q_SIZE_MULT;
+    q_init(&tg->q, size, (attr->shards > 0) ? attr->shards : 1, tg->numaNode);
 
     pthread_mutex_lock(&tg->mutexGrp);
-    for (size_t i = 0; i < min; i++) {
-        TThread *tt;
-        /**
-         * @note    all the threads should be created or none of them
-         * @todo    error handling needs fixing
-        */
-        tt = internal_create_thread(tg, NULL);
-        assert(tt != NULL);
-
-        list_append(&tg->activeThrds, &tt->move);
-
-        rc = pthread_create(&tt->id, NULL, worker_thread_function, tt);
-        assert(rc == 0);
-        
-        tg->thrds[tg->numThrds] = tt->id;
-        tg->numThrds++;
-    }
+    internal_add_threads(tg, tg->thrdMin);
     pthread_mutex_unlock(&tg->mutexGrp);
 
     pthread_mutex_lock(&tp->mutexPool);
-    // first group added will start the manager thread
-    if(tp->groups.len == 0) {
+    // first group added will start the manager thread, it keeps running when the groups are destroyed
+    if(tp->state == dead) {
         tp->state = idle;
         rc = pthread_create(&tp->manager, NULL, manager_thread_function, tp);
         assert(rc == 0);
     }
     list_append(&tp->groups, &tg->move);
+    if(tg->bucket.rate > 0) {
+        tp->rated++;
+    }
     
-    tp->totalThrds += max;
+    // the same amount is given back when the group is resized or destroyed
+    tp->totalThrds += tg->thrdMax;
     pthread_mutex_unlock(&tp->mutexPool);
 
     return tg;
 }
 
+/**
+ * Wait till all jobs of a group are finished.
+ * 
+ * @param   tg      group struct
+ */
+void wait_group(TGroup *tg) {
+    if(tg == NULL) {
+        return;
+    }
+
+    wait_group_timed(tg, 0);
+}
+
+/**
+ * Wait till all jobs of a group are finished or the timeout runs out.
+ * Work added meanwhile is waited on as well, any number of threads can wait at once.
+ * 
+ * @param   tg          group struct
+ * @param   timeoutMs   longest time to wait, 0 waits for as long as it takes
+ * @return  POOL_TIMEOUT when work was still in flight at the timeout
+ * 
+ * @note    a task must not wait on the group it runs in
+ */
+int wait_group_timed(TGroup *tg, unsigned int timeoutMs) {
+    if(tg == NULL) {
+        return POOL_ERROR;
+    }
+
+    struct timespec deadline;
+    internal_deadline(&deadline, timeoutMs);
+
+    internal_flush_group(tg);
+    return internal_quiet_wait(tg->pool, &tg->inflight, (timeoutMs > 0) ? &deadline : NULL);
+}
+
 /**
  * Destroys and frees all the threads within the group.
  * The group is freed.
@@ -338,174 +827,1816 @@ TGroup *add_group(TPool *tp, unsigned int min, unsigned int max, int flags) {
  * @param   tg      group struct
  */
 void destroy_group(TGroup *tg) {
+    shutdown_group(tg, SHUTDOWN_DRAIN, 0);
+}
+
+/**
+ * Destroys the group, the mode tells what happens to the work left in its queue.
+ * The cancel callbacks of the discarded work run on the calling thread.
+ * 
+ * @param   tg          group struct
+ * @param   mode        SHUTDOWN_DRAIN, SHUTDOWN_DISCARD or SHUTDOWN_DEADLINE
+ * @param   timeoutMs   time the group gets to drain in SHUTDOWN_DEADLINE mode
+ */
+void shutdown_group(TGroup *tg, int mode, unsigned int timeoutMs) {
     if(tg == NULL) {
         return;
     }
 
     TPool *tp = tg->pool;
+    struct timespec deadline;
+    internal_deadline(&deadline, timeoutMs);
 
+    pthread_mutex_lock(&mutexProducers);
     pthread_mutex_lock(&tp->mutexPool);
     item_remove(&tg->move);
+    tp->producers -= internal_detach_producers(tg);
+    internal_pool_linger(tp);
     pthread_mutex_unlock(&tp->mutexPool);
+    pthread_mutex_unlock(&mutexProducers);
 
-    internal_destroy_group(tg);
+    internal_destroy_group(tg, mode, &deadline);
 
     pthread_mutex_lock(&tp->mutexPool);
     tp->groups.len--;
     tp->totalThrds -= tg->thrdMax;
+    if(tg->bucket.rate > 0) {
+        tp->rated--;
+    }
     pthread_mutex_unlock(&tp->mutexPool);
 
-    free(tg);
+    internal_node_free(tg, sizeof(TGroup), tg->numaNode);
 }
 
 /**
- * Initialize a work struct before adding work to it.
+ * Reads the queue delay, shed and rate limit counters of a group and the scheduling policy its threads run with.
  * 
- * @param   work    double pointer to the work struct for internal mem allocation
+ * @param   tg      group struct
+ * @param   stats   receives the statistics
  */
-void init_work(Work **work) {
-    if(work == NULL) {
-        return;
+int group_stats(TGroup *tg, GroupStats *stats) {
+    if(tg == NULL || stats == NULL) {
+        return POOL_ERROR;
     }
 
-    *work = (Work *)malloc(sizeof(Work));
-    assert(*work != NULL);
+    stats->queued = q_queued(&tg->q);
+    stats->minDelayUs = (size_t)(atomic_load_explicit(&tg->codel.lastDelay, memory_order_relaxed) / NS_PER_US);
+    stats->overloaded = atomic_load_explicit(&tg->codel.overloaded, memory_order_relaxed);
+    stats->rejected = atomic_load_explicit(&tg->codel.rejected, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&tg->codel.dropped, memory_order_relaxed);
+    stats->throttled = atomic_load_explicit(&tg->bucket.throttled, memory_order_relaxed);
+
+    pthread_mutex_lock(&tg->mutexGrp);
+    stats->threads = tg->numThrds;
+    pthread_mutex_unlock(&tg->mutexGrp);
+
+    stats->policy = tg->policy;
+    if(tg->policy == POLICY_FIFO && atomic_load_explicit(&tg->fifoDenied, memory_order_relaxed)) {
+        stats->policy = POLICY_NORMAL;
+    }
+
+    return POOL_SUCCESS;
 }
 
 /**
- * Accepts a void function and a void arg.
+ * Reads the limits of a group so they can be changed with configure_group().
  * 
- * @param   work    work struct
- * @param   func    the func that will be called in the thread function
- * @param   arg     the arg passed into the func
+ * @param   tg      group struct
+ * @param   config  receives the limits
  */
-void add_work(Work *work, work_func func, void *arg) {
-    work->wf = func;
-    work->work_arg = arg;
-    init_il(&work->move);
+int group_config(TGroup *tg, GroupConfig *config) {
+    if(tg == NULL || config == NULL) {
+        return POOL_ERROR;
+    }
+
+    pthread_mutex_lock(&tg->mutexGrp);
+    config->min = tg->thrdMin;
+    config->max = tg->thrdMax;
+    config->flags = tg->flags & (GROUP_FIXED | GROUP_DYNAMIC);
+    config->capacity = atomic_load_explicit(&tg->q.capacity, memory_order_relaxed);
+    pthread_mutex_unlock(&tg->mutexGrp);
+
+    return POOL_SUCCESS;
 }
 
 /**
- * Assign the work to a specific group.
- * Do the work.
+ * Changes the limits of a live group without losing its queue.
+ * Missing threads are started at once, threads above the new max leave once they finish their current task.
+ * A smaller capacity only turns work away till the queue drained below it, queued work is kept.
+ * The limits follow add_group(), max is cut to the threads left in the pool.
  * 
  * @param   tg      group struct
- * @param   work    work struct that is populated from the add_work()
+ * @param   config  new limits, a capacity of 0 keeps the current one
  */
-int do_work(TGroup *tg, Work *work) {
-    if(work == NULL || tg == NULL) {
+int configure_group(TGroup *tg, const GroupConfig *config) {
+    if(tg == NULL || config == NULL) {
         return POOL_ERROR;
     }
 
-    TThread *tt;
     TPool *tp = tg->pool;
-    Health health;
-    int rc;
+    unsigned int min = (config->min > 0) ? config->min : 1;
+    unsigned int max = config->max;
 
-    pthread_mutex_lock(&tg->mutexGrp);
-    if(tg->flags & GROUP_CLOSE) {
-        pthread_mutex_unlock(&tg->mutexGrp);
-        return POOL_ERROR;
+    pthread_mutex_lock(&tp->mutexPool);
+    // the threads of the group itself are available to it
+    unsigned int availableThrds = tp->thrdMax - tp->totalThrds + tg->thrdMax;
+    if(availableThrds < max) {
+        max = availableThrds;
     }
 
-    // remove thread from idle list
-    IL *il = list_pop(&tg->idleThrds);
-    if(il == NULL) {
-        // currently there are no idle threads
-        // add work and return
-        rc = (q_append(&tg->q, work) == 0) ? POOL_SUCCESS : GROUP_FULL;
+    if(max == 0 || min > max) {
+        pthread_mutex_unlock(&tp->mutexPool);
+        return POOL_ERROR;
+    }
 
-        health = internal_health_check(tg);
+    pthread_mutex_lock(&tg->mutexGrp);
+    if(tg->flags & SOFT_KILL) {
         pthread_mutex_unlock(&tg->mutexGrp);
+        pthread_mutex_unlock(&tp->mutexPool);
+        return POOL_ERROR;
+    }
 
-        if(health != well) {            
-            pthread_mutex_lock(&tp->mutexPool);
-            tp->state = running;
-            pthread_cond_signal(&tp->condPool);
-            pthread_mutex_unlock(&tp->mutexPool);
-        }
+    tp->totalThrds -= tg->thrdMax;
+    atomic_fetch_and(&tg->flags, ~(GROUP_FIXED | GROUP_DYNAMIC));
+    if(config->flags == GROUP_FIXED || min == max) {
+        atomic_fetch_or(&tg->flags, GROUP_FIXED);
+        tg->thrdMin = tg->thrdMax = min;
+    } else {
+        atomic_fetch_or(&tg->flags, GROUP_DYNAMIC);
+        tg->thrdMin = min;
+        tg->thrdMax = max;
+    }
+    tp->totalThrds += tg->thrdMax;
 
-        return rc;
+    // the manager thread adds threads up to max without growing the list
+    if(tg->thrdsCap < tg->thrdMax) {
+        tg->thrdsCap = tg->thrdMax;
+        tg->thrds = (pthread_t *)realloc(tg->thrds, tg->thrdsCap * sizeof(pthread_t));
+        assert(tg->thrds != NULL);
     }
 
-    tt = CONTAINER_OF(il, TThread, move);
-    // add thread to active list
-    list_append(&tg->activeThrds, il);
-    pthread_mutex_unlock(&tg->mutexGrp);
+    if(config->capacity > 0) {
+        atomic_store(&tg->q.capacity, config->capacity);
+    }
 
-    pthread_mutex_lock(&tt->mutexThrd);
-    tt->currTask = work;
-    tt->state = running;
-    pthread_cond_signal(&tt->condThrd);
-    pthread_mutex_unlock(&tt->mutexThrd);
+    if(tg->numThrds < tg->thrdMin) {
+        internal_add_threads(tg, tg->thrdMin - tg->numThrds);
+    }
 
-    return POOL_SUCCESS;
-}
+    // idle threads are woken without work so they see that they have to leave
+    unsigned int shrink = (tg->numThrds > tg->thrdMax) ? tg->numThrds - tg->thrdMax : 0;
+    atomic_store(&tg->shrink, shrink);
 
-/*  --Internal Functions--  */
+    TThread *tt;
+    for (unsigned int i = 0; i < shrink && (tt = internal_pop_idle(tg)) != NULL; i++) {
+        list_append(&tg->activeThrds, &tt->move);
 
-static int internal_wait_helper(TGroup *tg) {
-    pthread_mutex_lock(&tg->mutexGrp);
-    if(q_empty(&tg->q)) {
-        pthread_mutex_unlock(&tg->mutexGrp);
-        return POOL_ERROR;
+        pthread_mutex_lock(&tt->mutexThrd);
+        tt->state = running;
+        pthread_cond_signal(&tt->condThrd);
+        pthread_mutex_unlock(&tt->mutexThrd);
     }
 
-    tg->flags |= GROUP_WAIT;
+    // a larger queue or more threads can take the work that is waiting
+    internal_wake_idle(tg);
     pthread_mutex_unlock(&tg->mutexGrp);
+    pthread_mutex_unlock(&tp->mutexPool);
+
     return POOL_SUCCESS;
 }
 
 /**
- * Adds a thread to a group.
- * Checks to make sure that the number of threads has not been exceeded before adding
+ * Changes the thread limits and the mode of a live group, see configure_group().
+ * 
+ * @param   tg      group struct
+ * @param   min     lower limit for threads in this group
+ * @param   max     upper limit for threads in this group
+ * @param   flags   GROUP_DYNAMIC or GROUP_FIXED
  */
-static TThread *internal_create_thread(TGroup *tg, Work *work) {
-    if(tg == NULL) {
-        return NULL;
+int resize_group(TGroup *tg, unsigned int min, unsigned int max, int flags) {
+    GroupConfig config = {min, max, flags, 0};
+    return configure_group(tg, &config);
+}
+
+/**
+ * Moves queued work of a group to the back of another group in queue order.
+ * The destination takes only what fits in its capacity and nothing while it sheds work or is closed.
+ * Work staged by producers, fibers waiting to resume and the strands of the group stay where they are.
+ * Workers of the source hand the batches they took back to its queue at their next fetch, so a later move takes them.
+ * The work keeps its join and completion queue.
+ * The move is linear in the work moved since every work records its shard for cancel_work() and its group,
+ * only the in flight counters are moved at once.
+ * 
+ * @param   src         group the work is taken from
+ * @param   dst         group the work is moved to
+ * @param   maxItems    most work to move, 0 for as much as fits
+ * @return  number of work moved
+ */
+size_t migrate_group_work(TGroup *src, TGroup *dst, size_t maxItems) {
+    if(src == NULL || dst == NULL || src == dst) {
+        return 0;
+    }
+
+    atomic_fetch_add(&src->unbatch, 1);
+
+    if(dst->codel.target > 0 && dst->codel.shed == SHED_REJECT && atomic_load_explicit(&dst->codel.overloaded, memory_order_relaxed)) {
+        return 0;
+    }
+
+    size_t want = q_len(&src->q);
+    if(maxItems > 0 && maxItems < want) {
+        want = maxItems;
+    }
+    if(want == 0) {
+        return 0;
+    }
+
+    // the destination cannot close until the work is placed, so its threads or its shutdown see all of it
+    pthread_mutex_lock(&dst->mutexGrp);
+    if(dst->flags & GROUP_CLOSE) {
+        pthread_mutex_unlock(&dst->mutexGrp);
+        return 0;
+    }
+
+    // the room is reserved first so no work has to go back to the source
+    size_t room = q_reserve(&dst->q, want);
+    if(room == 0) {
+        pthread_mutex_unlock(&dst->mutexGrp);
+        return 0;
+    }
+
+    LL moved;
+    init_list(&moved);
+    size_t n = q_take(&src->q, &moved, room, WORK_FIBER | WORK_INTERNAL);
+    if(n < room) {
+        atomic_fetch_sub(&dst->q.len, room - n);
+    }
+    if(n == 0) {
+        pthread_mutex_unlock(&dst->mutexGrp);
+        return 0;
+    }
+
+    IL *curr;
+    for_each(&moved.head, curr) {
+        CONTAINER_OF(curr, Work, move)->group = dst;
+    }
+
+    // counted in the destination before the source lets go so the pool is never seen idle
+    atomic_fetch_add(&dst->inflight, (unsigned int)n);
+    if(dst->pool != src->pool) {
+        atomic_fetch_add(&dst->pool->inflight, (unsigned int)n);
+    }
+    internal_untrack_n(src, (unsigned int)n, dst->pool != src->pool);
+
+    q_place(&dst->q, &moved, n);
+    internal_wake_idle(dst);
+    pthread_mutex_unlock(&dst->mutexGrp);
+
+    if(internal_health_check(dst) != well) {
+        internal_signal_manager(dst->pool);
+    }
+
+    return n;
+}
+
+/**
+ * Destroys a group after moving its queued work to another group, staged work and the batches of its workers included.
+ * The batches come back once the tasks the workers run are done.
+ * Work the destination does not take runs on the threads of the group like SHUTDOWN_DRAIN.
+ * 
+ * @param   tg      group struct
+ * @param   dst     group that takes over the work
+ * @return  number of work moved
+ */
+size_t shutdown_group_into(TGroup *tg, TGroup *dst) {
+    if(tg == NULL) {
+        return 0;
+    }
+
+    // no new work is taken while the backlog moves
+    pthread_mutex_lock(&tg->mutexGrp);
+    atomic_fetch_or(&tg->flags, GROUP_CLOSE);
+    internal_drain_producers(tg, 0, 1);
+    pthread_mutex_unlock(&tg->mutexGrp);
+
+    // each move asks the workers for their batches, the work they hand back is moved in the next round
+    size_t moved = 0;
+    while(1) {
+        moved += migrate_group_work(tg, dst, 0);
+
+        pthread_mutex_lock(&tg->mutexGrp);
+        if(dst == NULL || dst == tg || atomic_load(&tg->q.held) == 0) {
+            pthread_mutex_unlock(&tg->mutexGrp);
+            break;
+        }
+        pthread_cond_wait(&tg->condGrp, &tg->mutexGrp);
+        pthread_mutex_unlock(&tg->mutexGrp);
+    }
+    shutdown_group(tg, SHUTDOWN_DRAIN, 0);
+
+    return moved;
+}
+
+/**
+ * Initialize a work struct before adding work to it.
+ * 
+ * @param   work    double pointer to the work struct for internal mem allocation
+ */
+void init_work(Work **work) {
+    if(work == NULL) {
+        return;
+    }
+
+    *work = (Work *)malloc(sizeof(Work));
+    assert(*work != NULL);
+    (*work)->done = NULL;
+}
+
+/**
+ * Initialize a work struct in storage of the caller instead of allocating it.
+ * The work is used like one from init_work(), add_work() is called on it before it is passed to a group.
+ * Once the work ran or was cancelled and its last reference is released, the pool calls done with the work arg
+ * instead of freeing the work. The pool does not touch the work after that, so done can use the slot again.
+ * 
+ * @param   work    double pointer that receives the work struct in the slot
+ * @param   slot    storage of the caller that outlives the work
+ * @param   done    called with the work arg once the pool is done with the work
+ */
+void init_work_slot(Work **work, WorkSlot *slot, work_func done) {
+    _Static_assert(sizeof(Work) <= sizeof(WorkSlot), "WORK_SLOT_SIZE is smaller than the work struct");
+    _Static_assert(_Alignof(Work) <= _Alignof(WorkSlot), "work struct is aligned stricter than WorkSlot");
+
+    if(work == NULL || slot == NULL || done == NULL) {
+        return;
+    }
+
+    *work = (Work *)slot->bytes;
+    (*work)->done = done;
+}
+
+/**
+ * Accepts a void function and a void arg.
+ * 
+ * @param   work    work struct
+ * @param   func    the func that will be called in the thread function
+ * @param   arg     the arg passed into the func
+ */
+void add_work(Work *work, work_func func, void *arg) {
+    work->wf = func;
+    work->work_arg = arg;
+    work->flags = 0x00;
+    work->join = NULL;
+    work->compq = NULL;
+    work->tag = NULL;
+    work->cancel = NULL;
+    atomic_init(&work->refs, 1);
+    atomic_init(&work->queue, NULL);
+    work->enqueued = 0;
+    work->group = NULL;
+    init_il(&work->move);
+}
+
+/**
+ * Sets a callback that is called with the work arg instead of the work func when the work is cancelled or discarded.
+ * It runs on the thread that cancels the work or destroys its group and must not add work to the pool.
+ * 
+ * @param   work    work struct that is populated from the add_work()
+ * @param   func    releases what the work arg holds
+ */
+void add_cancel(Work *work, work_func func) {
+    if(work == NULL) {
+        return;
+    }
+
+    work->cancel = func;
+}
+
+/**
+ * Keeps the work struct valid after the work ran or was cancelled so it can be used as a handle for cancel_work().
+ * Has to be called before the work is passed to the pool, every retain_work() needs a release_work().
+ * 
+ * @param   work    work struct that is populated from the add_work()
+ */
+void retain_work(Work *work) {
+    if(work == NULL) {
+        return;
+    }
+
+    atomic_fetch_add_explicit(&work->refs, 1, memory_order_relaxed);
+}
+
+/**
+ * Drops a reference taken with retain_work(), the work struct is freed with its last reference.
+ * Work in a slot of the caller is handed back with its done callback instead.
+ * 
+ * @param   work    work struct
+ */
+void release_work(Work *work) {
+    if(work == NULL) {
+        return;
+    }
+
+    if(atomic_fetch_sub_explicit(&work->refs, 1, memory_order_acq_rel) == 1) {
+        if(work->done != NULL) {
+            work->done(work->work_arg);
+        } else {
+            free(work);
+        }
+    }
+}
+
+/**
+ * Takes queued work out of its group before it runs.
+ * The cancel callback is called and the join and completion queue of the work are told, the completion with POOL_CANCELLED.
+ * Work that is staged by a producer, taken by a worker in a batch, running or done is not cancelled.
+ * 
+ * @param   tg      group the work was passed to
+ * @param   work    work struct held with retain_work()
+ * @return  POOL_ERROR when the work was not in the queue
+ */
+int cancel_work(TGroup *tg, Work *work) {
+    if(tg == NULL || work == NULL) {
+        return POOL_ERROR;
+    }
+
+    if(q_remove(&tg->q, work) != POOL_SUCCESS) {
+        return POOL_ERROR;
+    }
+
+    internal_cancel_task(work);
+    return POOL_SUCCESS;
+}
+
+/**
+ * Assign the work to a specific group.
+ * Do the work.
+ * 
+ * @param   tg      group struct
+ * @param   work    work struct that is populated from the add_work()
+ */
+int do_work(TGroup *tg, Work *work) {
+    if(work == NULL || tg == NULL) {
+        return POOL_ERROR;
+    }
+
+    TPool *tp = tg->pool;
+    Health health;
+    int rc;
+
+    internal_work_defaults(tg, work);
+
+    // a queue with a delay target stamps the work, overloaded groups can turn it away
+    if(tg->codel.target > 0) {
+        if(tg->codel.shed == SHED_REJECT && atomic_load_explicit(&tg->codel.overloaded, memory_order_relaxed)) {
+            atomic_fetch_add_explicit(&tg->codel.rejected, 1, memory_order_relaxed);
+            return GROUP_SHED;
+        }
+        work->enqueued = internal_now();
+    }
+
+    // registered producers stage the work in their own buffer
+    // work the pool queues for itself is never held back in a buffer nothing else flushes in time
+    if(threadProducers != NULL && !(work->flags & WORK_INTERNAL)) {
+        Producer *p = internal_find_producer(tg);
+        if(p != NULL) {
+            // counted before a flush can hand it to a worker
+            internal_track(tg, work);
+            rc = internal_stage_work(p, work);
+            if(rc != POOL_SUCCESS) {
+                work->group = NULL;
+                internal_untrack(tg);
+            }
+            return rc;
+        }
+    }
+
+    if(tg->flags & GROUP_CLOSE) {
+        return POOL_ERROR;
+    }
+
+    // only the shard lock is taken to add the work
+    // the reference keeps the work valid for the close check below even if a worker runs it first
+    internal_track(tg, work);
+    atomic_fetch_add_explicit(&work->refs, 1, memory_order_relaxed);
+    rc = (q_append(&tg->q, work) == 0) ? POOL_SUCCESS : GROUP_FULL;
+    if(rc != POOL_SUCCESS) {
+        atomic_fetch_sub_explicit(&work->refs, 1, memory_order_relaxed);
+        work->group = NULL;
+        internal_untrack(tg);
+        return rc;
+    }
+
+    // the group can close after the check above while its last worker already left
+    // work still queued is taken back, work a worker fetched meanwhile runs
+    atomic_thread_fence(memory_order_seq_cst);
+    if((tg->flags & GROUP_CLOSE) && q_remove(&tg->q, work) == POOL_SUCCESS) {
+        atomic_fetch_sub_explicit(&work->refs, 1, memory_order_relaxed);
+        work->group = NULL;
+        internal_untrack(tg);
+        return POOL_ERROR;
+    }
+    release_work(work);
+
+    // pairs with the idle count being raised before an idle thread checks the queue one last time
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&tg->idle, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&tg->mutexGrp);
+        internal_wake_idle(tg);
+        pthread_mutex_unlock(&tg->mutexGrp);
+    }
+
+    health = internal_health_check(tg);
+    if(health != well) {            
+        internal_signal_manager(tp);
+    }
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Registers the calling thread as a producer for a group.
+ * Work passed to do_work() from this thread is staged in a thread local buffer instead of the group queue.
+ * The buffer is flushed when it holds batch tasks, when flush_work() is called,
+ * or by the manager thread once the oldest staged task has waited lingerUs.
+ * 
+ * @param   tg          group struct
+ * @param   batch       number of staged tasks that triggers a flush
+ * @param   lingerUs    longest time in microseconds a task can stay staged
+ * 
+ * @note    the manager thread wakes up every lingerUs while producers are registered, lingerUs below 5000 is raised to 5000
+ */
+int register_producer(TGroup *tg, unsigned int batch, unsigned int lingerUs) {
+    if(tg == NULL || batch == 0) {
+        return POOL_ERROR;
+    }
+
+    if(internal_find_producer(tg) != NULL) {
+        return POOL_ERROR;
+    }
+
+    TPool *tp = tg->pool;
+    Producer *p;
+
+    pthread_once(&producerOnce, internal_producer_key);
+
+    p = (Producer *)malloc(sizeof(Producer));
+    assert(p != NULL);
+
+    init_il(&p->move);
+    init_list(&p->work);
+    p->batch = batch;
+    p->first = 0;
+    p->linger = (uint64_t)lingerUs * NS_PER_US;
+    if(p->linger < LINGER_MIN) {
+        p->linger = LINGER_MIN;
+    }
+    atomic_init(&p->tg, tg);
+    pthread_mutex_init(&p->mutexProd, NULL);
+
+    // the pool lock keeps the count in step with a group that detaches its producers
+    pthread_mutex_lock(&tp->mutexPool);
+    pthread_mutex_lock(&tg->mutexGrp);
+    if(tg->flags & GROUP_CLOSE) {
+        pthread_mutex_unlock(&tg->mutexGrp);
+        pthread_mutex_unlock(&tp->mutexPool);
+        pthread_mutex_destroy(&p->mutexProd);
+        free(p);
+        return POOL_ERROR;
+    }
+    list_append(&tg->producers, &p->move);
+    pthread_mutex_unlock(&tg->mutexGrp);
+
+    tp->producers++;
+    if(p->linger < tp->linger) {
+        tp->linger = p->linger;
+    }
+    pthread_mutex_unlock(&tp->mutexPool);
+
+    p->next = threadProducers;
+    threadProducers = p;
+    pthread_setspecific(producerKey, threadProducers);
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Hands all the work staged by the calling thread to the group queue.
+ * 
+ * @param   tg      group struct
+ * 
+ * @return  GROUP_FULL when the queue could not take all of the staged work
+ */
+int flush_work(TGroup *tg) {
+    if(tg == NULL) {
+        return POOL_ERROR;
+    }
+
+    Producer *p = internal_find_producer(tg);
+    if(p == NULL) {
+        return POOL_SUCCESS;
+    }
+
+    return internal_flush_producer(p);
+}
+
+/**
+ * Removes the producer buffer of the calling thread from a group.
+ * Staged work is added to the group queue even if the queue is full.
+ * 
+ * @param   tg      group struct
+ */
+void unregister_producer(TGroup *tg) {
+    if(tg == NULL || threadProducers == NULL) {
+        return;
+    }
+
+    Producer **prev = &threadProducers;
+    Producer *p;
+    for(p = threadProducers; p != NULL; prev = &p->next, p = p->next) {
+        if(atomic_load_explicit(&p->tg, memory_order_relaxed) == tg) {
+            break;
+        }
+    }
+
+    if(p == NULL) {
+        return;
+    }
+
+    *prev = p->next;
+    pthread_setspecific(producerKey, threadProducers);
+
+    internal_release_producer(p);
+}
+
+/**
+ * Tells the group that the calling task is about to block in a call the pool does not control.
+ * While tasks are blocked the group can run up to blockMax compensating threads beyond thrdMax,
+ * so the queued work keeps running. The compensating threads exit once the blocks end.
+ * Does nothing outside of a worker thread or in a group without blockMax.
+ *
+ * @note    has to be paired with pool_block_end() in the same task
+ */
+void pool_block_begin(void) {
+    TThread *tt = currThrd;
+    if(tt == NULL) {
+        return;
+    }
+
+    internal_release_batch();
+
+    TGroup *tg = tt->tg;
+    if(tg->blockMax == 0) {
+        return;
+    }
+
+    atomic_fetch_add(&tg->blocked, 1);
+
+    pthread_mutex_lock(&tg->mutexGrp);
+    internal_compensate(tg);
+    pthread_mutex_unlock(&tg->mutexGrp);
+}
+
+/**
+ * Tells the group that the calling task is done blocking.
+ * An idle compensating thread that is not needed anymore is woken so it can exit.
+ */
+void pool_block_end(void) {
+    TThread *tt = currThrd;
+    if(tt == NULL || tt->tg->blockMax == 0) {
+        return;
+    }
+
+    TGroup *tg = tt->tg;
+    unsigned int blocked = atomic_fetch_sub(&tg->blocked, 1) - 1;
+
+    pthread_mutex_lock(&tg->mutexGrp);
+    IL *curr;
+    for_each(&tg->idleThrds.head, curr) {
+        TThread *idle = CONTAINER_OF(curr, TThread, move);
+        if(!idle->extra || tg->extra - tg->retiring <= blocked) {
+            continue;
+        }
+
+        item_remove(&idle->move);
+        tg->idleThrds.len--;
+        atomic_fetch_sub(&tg->idle, 1);
+        list_append(&tg->activeThrds, &idle->move);
+
+        pthread_mutex_lock(&idle->mutexThrd);
+        idle->state = running;
+        pthread_cond_signal(&idle->condThrd);
+        pthread_mutex_unlock(&idle->mutexThrd);
+        break;
+    }
+    pthread_mutex_unlock(&tg->mutexGrp);
+}
+
+/*  --Module Hooks--  */
+
+/**
+ * Number of threads a group can run at once.
+ */
+unsigned int internal_group_threads(TGroup *tg) {
+    return tg->thrdMax;
+}
+
+/**
+ * Stack size of the fibers of a group, 0 when the group does not use fibers.
+ */
+size_t internal_fiber_stack(TGroup *tg) {
+    return tg->fiberStack;
+}
+
+/**
+ * Reactor of the pool of a group, started on first use.
+ */
+Reactor *internal_pool_reactor(TGroup *tg) {
+    TPool *tp = tg->pool;
+    Reactor *r;
+
+    pthread_mutex_lock(&tp->mutexPool);
+    if(tp->reactor == NULL) {
+        tp->reactor = internal_reactor_init();
+    }
+    r = tp->reactor;
+    pthread_mutex_unlock(&tp->mutexPool);
+
+    return r;
+}
+
+/**
+ * File request ring of the pool of a group, set up on first use.
+ */
+Uring *internal_pool_uring(TGroup *tg) {
+    TPool *tp = tg->pool;
+    Uring *u;
+
+    pthread_mutex_lock(&tp->mutexIO);
+    if(tp->uring == NULL) {
+        tp->uring = internal_uring_init(tp);
+    }
+    u = tp->uring;
+    pthread_mutex_unlock(&tp->mutexIO);
+
+    return u;
+}
+
+/**
+ * Adds a group that the pool runs for itself, its threads are added to the budget given to init_pool().
+ */
+TGroup *internal_reserve_group(TPool *tp, unsigned int min, unsigned int max) {
+    TGroup *tg;
+
+    pthread_mutex_lock(&tp->mutexPool);
+    tp->thrdMax += max;
+    pthread_mutex_unlock(&tp->mutexPool);
+
+    tg = add_group(tp, min, max, GROUP_DYNAMIC);
+    if(tg == NULL) {
+        pthread_mutex_lock(&tp->mutexPool);
+        tp->thrdMax -= max;
+        pthread_mutex_unlock(&tp->mutexPool);
+    }
+
+    return tg;
+}
+
+/**
+ * Group of the worker thread that is calling, NULL when called from outside of the pool.
+ */
+TGroup *internal_current_group(void) {
+    return (currThrd != NULL) ? currThrd->tg : NULL;
+}
+
+/**
+ * Runs one queued task of the group on the calling thread.
+ * 
+ * @return  0 when the queue had no work
+ */
+int internal_help(TGroup *tg) {
+    Work *work = internal_fetch(tg, (currThrd != NULL) ? currThrd->shard : 0);
+    if(work == NULL) {
+        return 0;
+    }
+
+    internal_run_work(tg, work);
+    return 1;
+}
+
+/**
+ * Hands the rest of the batch of the calling worker back to its group before the worker blocks.
+ * The work would otherwise wait behind the blocked task, and it may be the work the task waits for.
+ */
+void internal_release_batch(void) {
+    TThread *tt = currThrd;
+    if(tt == NULL || empty(&tt->runq)) {
+        return;
+    }
+
+    TGroup *tg = tt->tg;
+    internal_unbatch(tt);
+
+    // a move of the work of a closing group waits for the batches to come back
+    pthread_mutex_lock(&tg->mutexGrp);
+    internal_wake_idle(tg);
+    pthread_cond_broadcast(&tg->condGrp);
+    pthread_mutex_unlock(&tg->mutexGrp);
+}
+
+/**
+ * Runs a task on the calling thread and frees it.
+ * The completion queue and the join of the task are told after the task is freed.
+ */
+void internal_run_task(Work *work) {
+    TJoin *join = work->join;
+    TCompQ *compq = work->compq;
+    void *tag = work->tag;
+    TGroup *tg = work->group;
+
+    work->wf(work->work_arg);
+    release_work(work);
+
+    if(compq != NULL) {
+        internal_compq_post(compq, tag, POOL_SUCCESS);
+    }
+
+    if(join != NULL) {
+        internal_join_done(join);
+    }
+
+    // last so a waiter that wakes up sees everything the task did
+    if(tg != NULL) {
+        internal_untrack(tg);
+    }
+}
+
+/**
+ * Adds work to the queue even if the queue is full.
+ * Used for work that was already accepted by the group, such as fibers that are ready to resume.
+ */
+void internal_requeue(TGroup *tg, Work *work) {
+    // a fiber resuming is still counted by the task it runs
+    if(!(work->flags & WORK_FIBER)) {
+        internal_track(tg, work);
+    }
+
+    LL list;
+    init_list(&list);
+    list_append(&list, &work->move);
+    q_append_list(&tg->q, &list, 1);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&tg->idle, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&tg->mutexGrp);
+        internal_wake_idle(tg);
+        pthread_mutex_unlock(&tg->mutexGrp);
+    }
+}
+
+/**
+ * Gives work the completion queue of the group unless it has its own.
+ * Work the pool queues for itself only stands in for other work and never posts.
+ */
+void internal_work_defaults(TGroup *tg, Work *work) {
+    if(tg->compq != NULL && work->compq == NULL && !(work->flags & WORK_INTERNAL)) {
+        work->compq = tg->compq;
+        work->tag = work->work_arg;
+    }
+}
+
+/**
+ * Calls the cancel callback of work that never ran and frees it.
+ * The completion queue and the join are told like for work that ran.
+ */
+void internal_cancel_task(Work *work) {
+    TJoin *join = work->join;
+    TCompQ *compq = work->compq;
+    void *tag = work->tag;
+    TGroup *tg = work->group;
+
+    if(work->cancel != NULL) {
+        work->cancel(work->work_arg);
+    }
+    release_work(work);
+
+    if(compq != NULL) {
+        internal_compq_post(compq, tag, POOL_CANCELLED);
+    }
+
+    if(join != NULL) {
+        internal_join_done(join);
+    }
+
+    if(tg != NULL) {
+        internal_untrack(tg);
+    }
+}
+
+/**
+ * Counts work as in flight in its group and pool till it runs or is cancelled.
+ * Work that is handed on by the pool, such as the tasks of a strand, is counted once it is accepted.
+ */
+void internal_track(TGroup *tg, Work *work) {
+    work->group = tg;
+    atomic_fetch_add(&tg->inflight, 1);
+    atomic_fetch_add(&tg->pool->inflight, 1);
+}
+
+/*  --Internal Functions--  */
+
+/**
+ * Cancels every queued task of the group, fibers waiting to resume stay queued so their tasks can finish.
+ * The cancel callbacks run on the calling thread, the group is not locked.
+ */
+static void internal_discard(TGroup *tg) {
+    LL discarded;
+    init_list(&discarded);
+
+    q_take(&tg->q, &discarded, SIZE_MAX, WORK_FIBER);
+
+    IL *il;
+    while((il = list_pop(&discarded)) != NULL) {
+        internal_cancel_task(CONTAINER_OF(il, Work, move));
+    }
+}
+
+/**
+ * Realtime deadline timeoutMs from now for the timed condition waits.
+ */
+static void internal_deadline(struct timespec *deadline, unsigned int timeoutMs) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += timeoutMs / 1000;
+    deadline->tv_nsec += (long)(timeoutMs % 1000) * 1000000L;
+    if(deadline->tv_nsec >= NS_PER_SEC) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= NS_PER_SEC;
+    }
+}
+
+/**
+ * Fetches work for a thread that does not hold the group lock.
+ * Work that waited too long in an overloaded SHED_DROP group is cancelled on the calling thread instead of run.
+ */
+static Work *internal_fetch(TGroup *tg, unsigned int home) {
+    Work *work;
+
+    while((work = internal_next(tg, home)) != NULL && !internal_admit(tg, work));
+
+    // nothing is left waiting so the delay is over
+    if(work == NULL && tg->codel.target > 0 && atomic_load_explicit(&tg->codel.overloaded, memory_order_relaxed) && q_empty(&tg->q)) {
+        atomic_store_explicit(&tg->codel.overloaded, 0, memory_order_relaxed);
+    }
+
+    return work;
+}
+
+/**
+ * Fetches work while the group has budget left, a rate limited group holds its threads off once the bucket is empty.
+ * Safe to call with the group lock held.
+ */
+static Work *internal_take(TGroup *tg, unsigned int home) {
+    Bucket *b = &tg->bucket;
+
+    if(b->rate == 0) {
+        return q_fetch(&tg->q, home);
+    }
+
+    if(b->unit == RATE_CPU) {
+        // charged for its cpu time after it ran
+        if(!internal_bucket_ready(b)) {
+            internal_throttle(tg);
+            return NULL;
+        }
+        return q_fetch(&tg->q, home);
+    }
+
+    int64_t tokens = atomic_load_explicit(&b->tokens, memory_order_relaxed);
+    do {
+        if(tokens < TOKEN_UNIT) {
+            internal_throttle(tg);
+            return NULL;
+        }
+    } while(!atomic_compare_exchange_weak(&b->tokens, &tokens, tokens - TOKEN_UNIT));
+
+    Work *work = q_fetch(&tg->q, home);
+    if(work == NULL) {
+        internal_bucket_charge(b, -TOKEN_UNIT);
+    }
+
+    return work;
+}
+
+/**
+ * Fetches the next task of a worker of the group, taking a batch from the queue once its run list is empty.
+ * Threads of other groups that help out take single tasks so they never hold on to work they do not own.
+ */
+static Work *internal_next(TGroup *tg, unsigned int home) {
+    TThread *tt = currThrd;
+    int owner = (tt != NULL && tt->tg == tg);
+
+    // a discarding shutdown cancels the batch as well, only fibers that wait to resume are run
+    if(tg->flags & GROUP_DISCARD) {
+        if(owner) {
+            internal_unbatch(tt);
+        }
+        internal_discard(tg);
+
+        Work *work;
+        while((work = internal_take(tg, home)) != NULL && !(work->flags & WORK_FIBER)) {
+            internal_cancel_task(work);
+        }
+        return work;
+    }
+
+    if(!owner) {
+        return internal_take(tg, home);
+    }
+
+    unsigned int unbatch = atomic_load(&tg->unbatch);
+    if(tt->unbatch != unbatch) {
+        tt->unbatch = unbatch;
+        internal_release_batch();
+    }
+
+    IL *il = list_pop(&tt->runq);
+    if(il != NULL) {
+        atomic_fetch_sub_explicit(&tg->q.held, 1, memory_order_relaxed);
+        return CONTAINER_OF(il, Work, move);
+    }
+
+    size_t batch = internal_batch(tg);
+    if(batch == 1) {
+        return internal_take(tg, home);
+    }
+
+    Work *work = q_fetch_batch(&tg->q, home, &tt->runq, batch);
+
+    // a batch taken while the group asked for them back goes back at once, the held count is read after the request
+    atomic_thread_fence(memory_order_seq_cst);
+    unbatch = atomic_load(&tg->unbatch);
+    if(tt->unbatch != unbatch) {
+        tt->unbatch = unbatch;
+        internal_release_batch();
+    }
+
+    return work;
+}
+
+/**
+ * Number of tasks a worker takes at once.
+ * The queue is split with the idle threads, which are woken for the work anyway, and only half of the share is taken
+ * so running threads that come back for more still find work. Rate limited groups take one task per token
+ * and a closing group takes none so its work can still move or be cancelled.
+ */
+static size_t internal_batch(TGroup *tg) {
+    if(tg->bucket.rate > 0 || (tg->flags & GROUP_CLOSE)) {
+        return 1;
+    }
+
+    size_t batch = q_len(&tg->q) / (2 * ((size_t)atomic_load_explicit(&tg->idle, memory_order_relaxed) + 1));
+    if(batch < 1) {
+        batch = 1;
+    } else if(batch > RUN_BATCH) {
+        batch = RUN_BATCH;
+    }
+
+    return batch;
+}
+
+/**
+ * Gives the rest of the batch of the thread back to the queue so other threads can run it.
+ */
+static void internal_unbatch(TThread *tt) {
+    TGroup *tg = tt->tg;
+    size_t n = tt->runq.len;
+
+    if(n == 0) {
+        return;
+    }
+
+    // the work was accepted before so it does not have to fit
+    q_append_list(&tg->q, &tt->runq, 1);
+    atomic_fetch_sub_explicit(&tg->q.held, n, memory_order_relaxed);
+}
+
+static int internal_bucket_ready(Bucket *b) {
+    int64_t tokens = atomic_load_explicit(&b->tokens, memory_order_relaxed);
+    return (b->rate == 0 || tokens >= ((b->unit == RATE_TASKS) ? TOKEN_UNIT : 1));
+}
+
+/**
+ * Counts a fetch that found work queued but no budget left.
+ */
+static void internal_throttle(TGroup *tg) {
+    if(!q_empty(&tg->q)) {
+        atomic_fetch_add_explicit(&tg->bucket.throttled, 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * Takes tokens from the bucket, a negative charge gives them back.
+ */
+static void internal_bucket_charge(Bucket *b, int64_t tokens) {
+    atomic_fetch_sub_explicit(&b->tokens, tokens, memory_order_relaxed);
+}
+
+/**
+ * Adds the tokens earned since the last refill up to the burst and hands the queued work to idle threads.
+ * This function assumes that the pool and the group are already locked.
+ */
+static void internal_refill(TGroup *tg, uint64_t now) {
+    Bucket *b = &tg->bucket;
+
+    if(b->rate == 0) {
+        return;
+    }
+
+    // a bucket fills up within a second so longer gaps do not matter
+    uint64_t elapsed = now - b->refilled;
+    if(elapsed > NS_PER_SEC) {
+        elapsed = NS_PER_SEC;
+    }
+    b->refilled = now;
+
+    // rate * TOKEN_UNIT * elapsed / NS_PER_SEC without overflowing
+    int64_t add = (int64_t)(b->rate * elapsed / (NS_PER_SEC / TOKEN_UNIT));
+    int64_t tokens = atomic_load_explicit(&b->tokens, memory_order_relaxed);
+    int64_t next;
+    do {
+        next = (tokens + add > b->burst) ? b->burst : tokens + add;
+    } while(!atomic_compare_exchange_weak(&b->tokens, &tokens, next));
+
+    internal_wake_idle(tg);
+}
+
+static uint64_t internal_cpu_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Takes the queue delay of work that left the queue into account.
+ * The thread that sees the interval end first decides whether the group is overloaded for the next one.
+ * 
+ * @return  1 when the work should be dropped
+ */
+static int internal_codel(CoDel *cd, Work *work) {
+    // fibers and the work the pool queues for itself are never dropped, only user work is
+    if(cd->target == 0 || work->enqueued == 0 || (work->flags & (WORK_FIBER | WORK_INTERNAL))) {
+        return 0;
+    }
+
+    uint64_t now = internal_now();
+    uint64_t delay = (now > work->enqueued) ? now - work->enqueued : 0;
+
+    uint64_t min = atomic_load_explicit(&cd->minDelay, memory_order_relaxed);
+    while(delay < min && !atomic_compare_exchange_weak(&cd->minDelay, &min, delay));
+
+    uint64_t end = atomic_load_explicit(&cd->intervalEnd, memory_order_relaxed);
+    if(now >= end && atomic_compare_exchange_strong(&cd->intervalEnd, &end, now + cd->interval)) {
+        min = atomic_exchange(&cd->minDelay, UINT64_MAX);
+        atomic_store_explicit(&cd->lastDelay, min, memory_order_relaxed);
+        atomic_store_explicit(&cd->overloaded, min > cd->target, memory_order_relaxed);
+    }
+
+    // work is only dropped once it waited twice the target so a queue that is just above target still makes progress
+    return (cd->shed == SHED_DROP && atomic_load_explicit(&cd->overloaded, memory_order_relaxed) && delay > 2 * cd->target);
+}
+
+/**
+ * Passes work that left the queue through the queue delay check, work that is dropped is cancelled here.
+ * Work handed to a thread under the group lock is checked by that thread before it runs.
+ * 
+ * @return  0 when the work was dropped
+ */
+static int internal_admit(TGroup *tg, Work *work) {
+    if(!internal_codel(&tg->codel, work)) {
+        return 1;
+    }
+
+    // dropped work does not use up the budget
+    if(tg->bucket.unit == RATE_TASKS) {
+        internal_bucket_charge(&tg->bucket, -TOKEN_UNIT);
+    }
+    atomic_fetch_add_explicit(&tg->codel.dropped, 1, memory_order_relaxed);
+    internal_cancel_task(work);
+    return 0;
+}
+
+/**
+ * Staged work is counted as in flight so it has to reach the queue before anyone waits on it.
+ */
+static void internal_flush_group(TGroup *tg) {
+    pthread_mutex_lock(&tg->mutexGrp);
+    internal_drain_producers(tg, 0, 1);
+    internal_wake_idle(tg);
+    pthread_mutex_unlock(&tg->mutexGrp);
+}
+
+/**
+ * Counts work of the group as done and wakes the waiters of a counter that dropped to 0.
+ * The pool is read first since the group can be destroyed as soon as its counter is 0,
+ * the wake only touches the pool for the same reason.
+ */
+static void internal_untrack(TGroup *tg) {
+    internal_untrack_n(tg, 1, 1);
+}
+
+/**
+ * Counts n work of the group as done at once, the pool counter only when pool is set.
+ */
+static void internal_untrack_n(TGroup *tg, unsigned int n, int pool) {
+    TPool *tp = tg->pool;
+
+    int drained = (atomic_fetch_sub(&tg->inflight, n) == n);
+    if(pool && atomic_fetch_sub(&tp->inflight, n) == n) {
+        drained = 1;
+    }
+    if(drained) {
+        internal_quiet_wake(tp);
+    }
+}
+
+/**
+ * Sleeps till an in flight counter is 0.
+ * The pool sequence is the futex word, so only the task that takes a counter to 0 makes a system call
+ * and waiters of other counters see a spurious wake.
+ * 
+ * @param   deadline    realtime deadline, NULL for none
+ * @return  POOL_TIMEOUT when the counter was not 0 by the deadline
+ */
+static int internal_quiet_wait(TPool *tp, atomic_uint *inflight, const struct timespec *deadline) {
+    int rc = POOL_SUCCESS;
+
+    atomic_fetch_add(&tp->quietWaiters, 1);
+
+#ifdef __linux__
+    // the sequence is read before the counter so a drop to 0 in between changes it
+    unsigned int seq = atomic_load(&tp->quietSeq);
+    while(atomic_load(inflight) > 0) {
+        // the kernel compares the sequence again so a drop to 0 before the sleep is not missed
+        if(syscall(SYS_futex, &tp->quietSeq, FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME, seq, deadline, NULL, FUTEX_BITSET_MATCH_ANY) != 0 && errno == ETIMEDOUT) {
+            rc = (atomic_load(inflight) > 0) ? POOL_TIMEOUT : POOL_SUCCESS;
+            break;
+        }
+        seq = atomic_load(&tp->quietSeq);
+    }
+#else
+    pthread_mutex_lock(&tp->mutexQuiet);
+    while(atomic_load(inflight) > 0) {
+        if(deadline == NULL) {
+            pthread_cond_wait(&tp->condQuiet, &tp->mutexQuiet);
+        } else if(pthread_cond_timedwait(&tp->condQuiet, &tp->mutexQuiet, deadline) == ETIMEDOUT) {
+            rc = (atomic_load(inflight) > 0) ? POOL_TIMEOUT : POOL_SUCCESS;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tp->mutexQuiet);
+#endif
+
+    atomic_fetch_sub(&tp->quietWaiters, 1);
+    return rc;
+}
+
+static void internal_quiet_wake(TPool *tp) {
+    if(atomic_load(&tp->quietWaiters) == 0) {
+        return;
+    }
+
+#ifdef __linux__
+    atomic_fetch_add(&tp->quietSeq, 1);
+    syscall(SYS_futex, &tp->quietSeq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&tp->mutexQuiet);
+    pthread_cond_broadcast(&tp->condQuiet);
+    pthread_mutex_unlock(&tp->mutexQuiet);
+#endif
+}
+
+/**
+ * Adds a thread to a group.
+ * Checks to make sure that the number of threads has not been exceeded before adding
+ */
+static TThread *internal_create_thread(TGroup *tg, Work *work) {
+    if(tg == NULL) {
+        return NULL;
     }
 
     TThread *tt;
-    tt = (TThread *)malloc(sizeof(TThread));
-    assert(tt != NULL);
+    tt = (TThread *)internal_node_alloc(sizeof(TThread), tg->numaNode);
 
     tt->state = running;
     tt->tg = tg;
     tt->currTask = work;
+    tt->shard = tg->numThrds % tg->q.numShards;
+    tt->extra = 0;
+    init_list(&tt->fibers);
+    init_list(&tt->runq);
+    tt->unbatch = atomic_load(&tg->unbatch);
+
+    init_il(&tt->move);
+    if(pthread_mutex_init(&tt->mutexThrd, NULL)) {
+        goto error;
+    }
+    if(pthread_cond_init(&tt->condThrd, NULL)) {
+        goto error;
+    }
+
+    return tt;
+
+error:
+    internal_node_free(tt, sizeof(TThread), tg->numaNode);
+    return NULL;
+}
+
+/**
+ * Starts the thread of a worker, pinned to the cpus of its group.
+ *
+ * @param   detached    compensating threads are detached, the others are joined by destroy_group()
+ */
+static int internal_start_thread(TGroup *tg, TThread *tt, int detached) {
+    pthread_attr_t attr;
+    int rc;
+
+    pthread_attr_init(&attr);
+    if(detached) {
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    }
+    if(tg->stackSize > 0) {
+        pthread_attr_setstacksize(&attr, tg->stackSize);
+    }
+    if(tg->guardSize > 0) {
+        pthread_attr_setguardsize(&attr, tg->guardSize);
+    }
+    internal_node_pin(&attr, tg->cpus, tg->cpusSize);
+
+    // realtime threads get their policy at creation so a refusal shows up here
+    int fifo = (tg->policy == POLICY_FIFO && !atomic_load_explicit(&tg->fifoDenied, memory_order_relaxed));
+    if(fifo) {
+        struct sched_param param = {.sched_priority = tg->priority};
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+
+    rc = pthread_create(&tt->id, &attr, worker_thread_function, tt);
+    if(rc == EPERM && fifo) {
+        // realtime scheduling is not permitted, the group keeps running with normal scheduling
+        // the configured policy stays as it is and group_stats() reports the one the threads run with
+        atomic_store_explicit(&tg->fifoDenied, 1, memory_order_relaxed);
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        rc = pthread_create(&tt->id, &attr, worker_thread_function, tt);
+    }
+    pthread_attr_destroy(&attr);
+
+    return rc;
+}
+
+/**
+ * Names the calling thread and sets its batch policy and nice level, these are per thread on linux only.
+ * A nice level below the current one needs privileges and is left as it is without them.
+ */
+static void internal_setup_thread(TGroup *tg) {
+#ifdef __linux__
+    if(tg->name[0] != '\0') {
+        pthread_setname_np(pthread_self(), tg->name);
+    }
+    if(tg->policy == POLICY_BATCH) {
+        struct sched_param param = {0};
+        pthread_setschedparam(pthread_self(), SCHED_BATCH, &param);
+    }
+    if(tg->policy != POLICY_FIFO && tg->priority != 0) {
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), tg->priority);
+    }
+#else
+    (void)tg;
+#endif
+}
+
+/**
+ * Checks the thread attributes of a group before anything is allocated for it.
+ *
+ * @return  POOL_ERROR for a stack below the minimum, an unknown policy, shed mode or rate unit or a priority out of its range
+ */
+static int internal_check_attr(const GroupAttr *attr) {
+    if(attr->stackSize > 0 && attr->stackSize < (size_t)PTHREAD_STACK_MIN) {
+        return POOL_ERROR;
+    }
+
+    if(attr->fiberStack > 0 && (attr->fiberStack < FIBER_STACK_MIN || attr->fiberStack < (size_t)PTHREAD_STACK_MIN)) {
+        return POOL_ERROR;
+    }
+
+    switch(attr->policy) {
+        case POLICY_NORMAL:
+        case POLICY_BATCH:
+            if(attr->priority < -20 || attr->priority > 19) {
+                return POOL_ERROR;
+            }
+            break;
+        case POLICY_FIFO:
+            if(attr->priority < sched_get_priority_min(SCHED_FIFO) || attr->priority > sched_get_priority_max(SCHED_FIFO)) {
+                return POOL_ERROR;
+            }
+            break;
+        default:
+            return POOL_ERROR;
+    }
+
+    if(attr->targetUs > 0 && attr->shed != SHED_REJECT && attr->shed != SHED_DROP) {
+        return POOL_ERROR;
+    }
+
+    if(attr->rate > 0 && attr->rateUnit != RATE_TASKS && attr->rateUnit != RATE_CPU) {
+        return POOL_ERROR;
+    }
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Starts compensating threads while tasks are blocked and work is waiting with no idle thread to run it.
+ * A compensating thread takes its first task from the queue.
+ * This function assumes that the group is already locked.
+ */
+static void internal_compensate(TGroup *tg) {
+    unsigned int blocked = atomic_load(&tg->blocked);
+    unsigned int cap = (blocked < tg->blockMax) ? blocked : tg->blockMax;
+
+    while(!(tg->flags & SOFT_KILL) && tg->extra - tg->retiring < cap && empty(&tg->idleThrds) && !q_empty(&tg->q)) {
+        TThread *tt;
+        Work *work;
+        int rc;
+
+        work = internal_take(tg, tg->numThrds % tg->q.numShards);
+        if(work == NULL) {
+            break;
+        }
+
+        tt = internal_create_thread(tg, work);
+        assert(tt != NULL);
+        tt->extra = THREAD_EXTRA;
+
+        list_append(&tg->activeThrds, &tt->move);
+        tg->extra++;
+
+        rc = internal_start_thread(tg, tt, 1);
+        assert(rc == 0);
+    }
+}
+
+/**
+ * Decides if a compensating thread exits because fewer tasks are blocked than there are compensating threads.
+ * This function assumes that the group is already locked.
+ */
+static int internal_retire(TGroup *tg, TThread *tt) {
+    if(tg->extra - tg->retiring <= atomic_load(&tg->blocked)) {
+        return 0;
+    }
+
+    tt->extra |= THREAD_RETIRING;
+    tg->retiring++;
+    return 1;
+}
+
+/**
+ * Decides if a thread exits because its group was made smaller than the threads it runs.
+ * The thread takes itself off the thread list and detaches so a shutdown does not join it.
+ * A group that is shutting down keeps its threads, the shutdown joins them.
+ * This function assumes that the group is already locked.
+ */
+static int internal_surplus(TGroup *tg, TThread *tt) {
+    if(tt->extra || (tg->flags & SOFT_KILL) || atomic_load(&tg->shrink) == 0) {
+        return 0;
+    }
+
+    pthread_t self = pthread_self();
+    for (unsigned int i = 0; i < tg->numThrds; i++) {
+        if(pthread_equal(tg->thrds[i], self)) {
+            tg->thrds[i] = tg->thrds[tg->numThrds - 1];
+            break;
+        }
+    }
+    tg->numThrds--;
+    atomic_fetch_sub(&tg->shrink, 1);
+
+    tt->extra = THREAD_SURPLUS;
+    tg->leaving++;
+    pthread_detach(self);
+    return 1;
+}
+
+/**
+ * Starts threads that wait for work.
+ * This function assumes that the group is already locked.
+ */
+static void internal_add_threads(TGroup *tg, unsigned int numThrds) {
+    for (unsigned int i = 0; i < numThrds; i++) {
+        TThread *tt;
+        int rc;
+
+        /**
+         * @note    all the threads should be created or none of them
+         * @todo    error handling needs fixing
+        */
+        tt = internal_create_thread(tg, NULL);
+        assert(tt != NULL);
+
+        list_append(&tg->activeThrds, &tt->move);
+
+        rc = internal_start_thread(tg, tt, 0);
+        assert(rc == 0);
+        
+        tg->thrds[tg->numThrds] = tt->id;
+        tg->numThrds++;
+    }
+}
+
+/**
+ * The queue length is read without a lock so the group does not need to be locked.
+ * 
+ * @todo    this function is not complete yet
+ * @todo    function can be better
+ */
+static Health internal_health_check(TGroup *tg) {
+    Health health;
+
+    if(q_queued(&tg->q) == 0) {
+        health = well;
+    } else {
+        float ratio = (float)q_queued(&tg->q) / (float)atomic_load_explicit(&tg->q.capacity, memory_order_relaxed);
+        health = (ratio < 0.25) ? moderate : poor;
+    }
+
+    return health;
+}
+
+/**
+ * Hands queued work to the idle threads of a group.
+ * This function assumes that the group is already locked.
+ */
+static void internal_wake_idle(TGroup *tg) {
+    TThread *tt;
+    while(!q_empty(&tg->q) && internal_bucket_ready(&tg->bucket) && (tt = internal_pop_idle(tg)) != NULL) {
+        list_append(&tg->activeThrds, &tt->move);
+
+        // the task can be NULL if a running thread took it first
+        pthread_mutex_lock(&tt->mutexThrd);
+        tt->currTask = internal_take(tg, tt->shard);
+        tt->state = running;
+        pthread_cond_signal(&tt->condThrd);
+        pthread_mutex_unlock(&tt->mutexThrd);
+    }
+}
+
+/**
+ * Removes a thread from the idle list.
+ * This function assumes that the group is already locked.
+ */
+static TThread *internal_pop_idle(TGroup *tg) {
+    IL *il = list_pop(&tg->idleThrds);
+    if(il == NULL) {
+        return NULL;
+    }
+
+    atomic_fetch_sub(&tg->idle, 1);
+    return CONTAINER_OF(il, TThread, move);
+}
+
+/**
+ * Wakes the manager thread so it can check the health of the groups.
+ * Only the first caller since the manager last ran takes the pool lock.
+ */
+static void internal_signal_manager(TPool *tp) {
+    if(atomic_exchange(&tp->signalled, 1)) {
+        return;
+    }
+
+    pthread_mutex_lock(&tp->mutexPool);
+    tp->state = running;
+    pthread_cond_signal(&tp->condPool);
+    pthread_mutex_unlock(&tp->mutexPool);
+}
+
+static Producer *internal_find_producer(TGroup *tg) {
+    Producer *p;
+    for(p = threadProducers; p != NULL; p = p->next) {
+        if(atomic_load_explicit(&p->tg, memory_order_relaxed) == tg) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Appends work to the buffer of the calling producer.
+ * A full buffer is flushed before and after the work is staged.
+ */
+static int internal_stage_work(Producer *p, Work *work) {
+    int flush;
+
+    pthread_mutex_lock(&p->mutexProd);
+    if(p->work.len >= p->batch) {
+        pthread_mutex_unlock(&p->mutexProd);
+        internal_flush_producer(p);
+        pthread_mutex_lock(&p->mutexProd);
+
+        // the queue could not make room for the staged work
+        if(p->work.len >= p->batch) {
+            pthread_mutex_unlock(&p->mutexProd);
+            return GROUP_FULL;
+        }
+    }
+
+    if(empty(&p->work)) {
+        p->first = internal_now();
+    }
+    list_append(&p->work, &work->move);
+    flush = (p->work.len >= p->batch);
+    pthread_mutex_unlock(&p->mutexProd);
+
+    if(flush) {
+        internal_flush_producer(p);
+    }
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Moves the staged work of a producer into the group queue.
+ * The buffer is detached first so the group is never locked while holding the producer lock.
+ * Work that does not fit in the queue is put back in front of the buffer.
+ */
+static int internal_flush_producer(Producer *p) {
+    TGroup *tg = atomic_load_explicit(&p->tg, memory_order_relaxed);
+    Health health;
+    int rc = POOL_SUCCESS;
+    LL work;
+
+    if(tg == NULL) {
+        return POOL_ERROR;
+    }
+
+    init_list(&work);
+
+    pthread_mutex_lock(&p->mutexProd);
+    list_splice(&work, &p->work);
+    pthread_mutex_unlock(&p->mutexProd);
+
+    if(empty(&work)) {
+        return POOL_SUCCESS;
+    }
+
+    pthread_mutex_lock(&tg->mutexGrp);
+    q_append_list(&tg->q, &work, 0);
+    internal_wake_idle(tg);
+
+    if(!empty(&work)) {
+        pthread_mutex_lock(&p->mutexProd);
+        list_splice(&work, &p->work);
+        list_splice(&p->work, &work);
+        pthread_mutex_unlock(&p->mutexProd);
+        rc = GROUP_FULL;
+    }
+
+    health = internal_health_check(tg);
+    pthread_mutex_unlock(&tg->mutexGrp);
+
+    if(health != well) {
+        internal_signal_manager(tg->pool);
+    }
+
+    return rc;
+}
+
+/**
+ * Moves staged work that has lingered too long into the group queue.
+ * This function assumes that the group is already locked.
+ * 
+ * @param   now     current time, buffers staged before now - linger are drained
+ * @param   force   drain every buffer and ignore the queue capacity
+ */
+static void internal_drain_producers(TGroup *tg, uint64_t now, int force) {
+    IL *curr;
+    for_each(&tg->producers.head, curr) {
+        Producer *p = CONTAINER_OF(curr, Producer, move);
 
-    init_il(&tt->move);
-    if(pthread_mutex_init(&tt->mutexThrd, NULL)) {
-        goto error;
-    }
-    if(pthread_cond_init(&tt->condThrd, NULL)) {
-        goto error;
+        pthread_mutex_lock(&p->mutexProd);
+        if(!empty(&p->work) && (force || now - p->first >= p->linger)) {
+            q_append_list(&tg->q, &p->work, force);
+        }
+        pthread_mutex_unlock(&p->mutexProd);
     }
+}
 
-    return tt;
+/**
+ * Flushes and frees a producer buffer.
+ * The producer must already be removed from the thread local list.
+ */
+static void internal_release_producer(Producer *p) {
+    // the group cannot be freed while it still has to detach this producer
+    pthread_mutex_lock(&mutexProducers);
+    TGroup *tg = atomic_load_explicit(&p->tg, memory_order_relaxed);
 
-error:
-    free(tt);
-    return NULL;
+    if(tg != NULL) {
+        TPool *tp = tg->pool;
+
+        pthread_mutex_lock(&tp->mutexPool);
+        pthread_mutex_lock(&tg->mutexGrp);
+        pthread_mutex_lock(&p->mutexProd);
+        q_append_list(&tg->q, &p->work, 1);
+        pthread_mutex_unlock(&p->mutexProd);
+
+        item_remove(&p->move);
+        tg->producers.len--;
+        internal_wake_idle(tg);
+        pthread_mutex_unlock(&tg->mutexGrp);
+
+        tp->producers--;
+        internal_pool_linger(tp);
+        pthread_mutex_unlock(&tp->mutexPool);
+    }
+    pthread_mutex_unlock(&mutexProducers);
+
+    pthread_mutex_destroy(&p->mutexProd);
+    free(p);
 }
 
 /**
- * This function assumes that the group is already locked.
- * For now it is only used in the manager thread function to check the health of a group.
+ * Drains the staged work of every producer of a closing group and detaches the producers from it.
+ * The producers keep their buffers until they unregister.
+ * This function assumes that mutexProducers and the pool are already locked.
  * 
- * @todo    this function is not complete yet
- * @todo    function can be better
+ * @return  number of producers detached
  */
-static Health internal_health_check(TGroup *tg) {
-    Health health;
+static unsigned int internal_detach_producers(TGroup *tg) {
+    unsigned int producers;
+    IL *prod;
 
-    if(q_empty(&tg->q)) {
-        health = well;
-    } else {
-        float ratio = (float)tg->q.work.len / (float)tg->q.capacity;
-        health = (ratio < 0.25) ? moderate : poor;
+    pthread_mutex_lock(&tg->mutexGrp);
+    // no producer registers once the group is closed
+    tg->flags |= GROUP_CLOSE;
+    internal_drain_producers(tg, 0, 1);
+    producers = tg->producers.len;
+
+    while((prod = list_pop(&tg->producers)) != NULL) {
+        Producer *p = CONTAINER_OF(prod, Producer, move);
+        atomic_store_explicit(&p->tg, NULL, memory_order_relaxed);
     }
+    internal_wake_idle(tg);
+    pthread_mutex_unlock(&tg->mutexGrp);
 
-    return health;
+    return producers;
+}
+
+/**
+ * Sets how long the manager sleeps to the shortest linger of the remaining producers.
+ * This function assumes that the pool is already locked.
+ */
+static void internal_pool_linger(TPool *tp) {
+    uint64_t linger = MANAGER_TICK;
+    IL *curr, *prod;
+
+    if(tp->producers > 0) {
+        for_each(&tp->groups.head, curr) {
+            TGroup *tg = CONTAINER_OF(curr, TGroup, move);
+
+            pthread_mutex_lock(&tg->mutexGrp);
+            for_each(&tg->producers.head, prod) {
+                Producer *p = CONTAINER_OF(prod, Producer, move);
+                if(p->linger < linger) {
+                    linger = p->linger;
+                }
+            }
+            pthread_mutex_unlock(&tg->mutexGrp);
+        }
+    }
+
+    tp->linger = linger;
+}
+
+static void internal_producer_key(void) {
+    pthread_key_create(&producerKey, internal_producer_exit);
+}
+
+/**
+ * Producer threads that exit without unregistering still hand their staged work to the groups.
+ */
+static void internal_producer_exit(void *arg) {
+    Producer *p = (Producer *)arg;
+    while(p != NULL) {
+        Producer *next = p->next;
+        internal_release_producer(p);
+        p = next;
+    }
+    threadProducers = NULL;
+}
+
+static uint64_t internal_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
 }
 
 /**
@@ -515,7 +2646,7 @@ static Health internal_health_check(TGroup *tg) {
  * 
  * @note    this will not free the group
  */
-static void internal_destroy_group(TGroup *tg) {
+static void internal_destroy_group(TGroup *tg, int mode, const struct timespec *deadline) {
     pthread_t *threads;
     size_t numThrds = 0;
 
@@ -526,28 +2657,53 @@ static void internal_destroy_group(TGroup *tg) {
     numThrds = tg->numThrds;
 
     // can only loop through idle threads since active threads will result in a deadlock
-    IL *curr;
-    while((curr = list_pop(&tg->idleThrds)) != NULL) {
-        TThread *tt;
-        tt = CONTAINER_OF(curr, TThread, move);
-
-        list_append(&tg->activeThrds, curr);
+    TThread *tt;
+    while((tt = internal_pop_idle(tg)) != NULL) {
+        list_append(&tg->activeThrds, &tt->move);
 
         pthread_mutex_lock(&tt->mutexThrd);
         tt->state = running;
         pthread_cond_signal(&tt->condThrd);
         pthread_mutex_unlock(&tt->mutexThrd);
     }
+
+    // threads only leave once the queue and their batches are empty and each one that leaves broadcasts
+    int rc = 0;
+    while(mode == SHUTDOWN_DEADLINE && rc != ETIMEDOUT && q_queued(&tg->q) > 0) {
+        rc = pthread_cond_timedwait(&tg->condGrp, &tg->mutexGrp, deadline);
+    }
+
+    // the workers cancel the batches they hold before they take the next task
+    if(mode != SHUTDOWN_DRAIN) {
+        tg->flags |= GROUP_DISCARD;
+    }
     pthread_mutex_unlock(&tg->mutexGrp);
 
+    if(mode != SHUTDOWN_DRAIN) {
+        internal_discard(tg);
+    }
+
     for (size_t i = 0; i < numThrds; i++) {
         if(pthread_join(threads[i], NULL) != 0) {
             assert(0);
         }
     }
 
+    // compensating threads and threads that left a smaller group are detached so wait for them to leave the group
+    pthread_mutex_lock(&tg->mutexGrp);
+    while(tg->extra > 0 || tg->leaving > 0) {
+        pthread_cond_wait(&tg->condGrp, &tg->mutexGrp);
+    }
+    pthread_mutex_unlock(&tg->mutexGrp);
+
+    // nothing runs the work that was requeued after the last worker looked at the queue
+    internal_discard(tg);
+
+    pthread_cond_destroy(&tg->condGrp);
     pthread_mutex_destroy(&tg->mutexGrp);
+    q_destroy(&tg->q);
     free(tg->thrds);
+    internal_node_cpus_free(tg->cpus);
 }
 
 /**
@@ -559,6 +2715,8 @@ static void internal_destroy_group(TGroup *tg) {
 */
 static void internal_destroy_thread(TThread *tt) {
     TGroup *tg = tt->tg;
+    // the group can be gone once a compensating thread unlocks it
+    int node = tg->numaNode;
 
     pthread_mutex_lock(&tg->mutexGrp);
     item_remove(&tt->move);
@@ -569,12 +2727,32 @@ static void internal_destroy_thread(TThread *tt) {
         // all threads terminating should be in a running state
         assert(0);
     }
+
+    // the group can be freed as soon as the last compensating thread unlocks it
+    if(tt->extra & THREAD_EXTRA) {
+        tg->extra--;
+        if(tt->extra & THREAD_RETIRING) {
+            tg->retiring--;
+        }
+        pthread_cond_broadcast(&tg->condGrp);
+    } else if(tt->extra & THREAD_SURPLUS) {
+        tg->leaving--;
+        pthread_cond_broadcast(&tg->condGrp);
+    } else if(tg->flags & SOFT_KILL) {
+        // tells a shutdown waiting on a deadline that the queue ran empty
+        pthread_cond_broadcast(&tg->condGrp);
+    }
     pthread_mutex_unlock(&tg->mutexGrp);
 
+    IL *il;
+    while((il = list_pop(&tt->fibers)) != NULL) {
+        internal_fiber_free(il);
+    }
+
     pthread_cond_destroy(&tt->condThrd);
     pthread_mutex_destroy(&tt->mutexThrd);
 
-    free(tt);
+    internal_node_free(tt, sizeof(TThread), node);
 }
 
 /**
@@ -586,37 +2764,71 @@ static void internal_destroy_thread(TThread *tt) {
 static void *worker_thread_function(void *arg) {
     TThread *tt = (TThread *) arg;
     TGroup *tg = tt->tg;
-    TPool *tp = tg->pool;
+
+    currThrd = tt;
+    internal_node_bind_thread(tg->numaNode);
+    internal_setup_thread(tg);
+
+    // set while the current task came from internal_fetch(), which already checked its queue delay
+    int admitted = 0;
 
     while(1) {
         Work *task;
-        int wait;
 
         pthread_mutex_lock(&tt->mutexThrd);
 top:
         if((task = tt->currTask) != NULL) {
             pthread_mutex_unlock(&tt->mutexThrd);
-            // begin executing the task
-            work_func func = task->wf;
-            void *arg = task->work_arg;
-            func(arg);
+            // work handed over by the group, the manager or the thread's own last look at the queue is checked here
+            if(admitted || internal_admit(tg, task)) {
+                // begin executing the task
+                internal_run_work(tg, task);
+            }
+            admitted = 0;
 
             // we do not unlock this because after we free the task we grab more tasks
             pthread_mutex_lock(&tt->mutexThrd);
-            
-            free(tt->currTask);
             tt->currTask = NULL;
         }
 
+        // compensating threads leave as soon as the blocked tasks they stand in for are done
+        // threads only leave between tasks once their batch is done
+        if(tt->extra && empty(&tt->runq)) {
+            int retire;
+            pthread_mutex_lock(&tg->mutexGrp);
+            retire = internal_retire(tg, tt);
+            pthread_mutex_unlock(&tg->mutexGrp);
+            if(retire) {
+                break;
+            }
+        }
+
+        // threads above the max of a group that was made smaller leave between tasks
+        if(atomic_load_explicit(&tg->shrink, memory_order_relaxed) > 0 && empty(&tt->runq)) {
+            int leave;
+            pthread_mutex_lock(&tg->mutexGrp);
+            leave = internal_surplus(tg, tt);
+            pthread_mutex_unlock(&tg->mutexGrp);
+            if(leave) {
+                break;
+            }
+        }
+
+        if(tg->flags & HARD_KILL) {
+            break;
+        }
+
+        // grab a new task from the batch of the thread or a new batch, only the shard locks are taken
+        tt->currTask = internal_fetch(tg, tt->shard);
+        if(tt->currTask != NULL) {
+            admitted = 1;
+            goto top;
+        }
+
         // the group lock is within the thread lock
         // this will deadlock only if a someone tries to lock any thread in the active thread list
         // the only threads that can be locked are threads that are in the idle list
         pthread_mutex_lock(&tg->mutexGrp);
-        if(tg->flags & HARD_KILL) {
-            pthread_mutex_unlock(&tg->mutexGrp);
-            break;
-        }
-        
         if(tg->flags & GROUP_CLEAN) {
             assert(0);
             /**
@@ -625,14 +2837,36 @@ top:
             // tt->state = (THREAD_COUNT(tg) == tg->thrdMin) ? RUNNING : SOFT_KILL;
         }
 
-        // grab a new task
-        tt->currTask = q_fetch(&tg->q);
-        if(tt->currTask != NULL) {
+        // threads wait idle for suspended fibers, the last one to finish lets them all leave
+        if((tg->flags & SOFT_KILL) && atomic_load(&tg->fiberTasks) == 0) {
+            // producers do not hold the group lock so check the queue once more before leaving
+            // a discarding shutdown cancels what is left once the threads are gone
+            tt->currTask = (tg->flags & GROUP_DISCARD) ? NULL : q_fetch(&tg->q, tt->shard);
+            if(tt->currTask == NULL) {
+                TThread *idle;
+                while((idle = internal_pop_idle(tg)) != NULL) {
+                    list_append(&tg->activeThrds, &idle->move);
+
+                    pthread_mutex_lock(&idle->mutexThrd);
+                    idle->state = running;
+                    pthread_cond_signal(&idle->condThrd);
+                    pthread_mutex_unlock(&idle->mutexThrd);
+                }
+            }
             pthread_mutex_unlock(&tg->mutexGrp);
-            goto top;
+            if(tt->currTask != NULL) {
+                goto top;
+            }
+            break;
+        }
+
+        // a compensating thread stays idle only while it is still needed
+        if(tt->extra && internal_retire(tg, tt)) {
+            pthread_mutex_unlock(&tg->mutexGrp);
+            break;
         }
 
-        if(tg->flags & SOFT_KILL) {
+        if(internal_surplus(tg, tt)) {
             pthread_mutex_unlock(&tg->mutexGrp);
             break;
         }
@@ -642,26 +2876,26 @@ top:
             // append thread to idle list
             item_remove(&tt->move);
             tt->state = idle;
-
-            // the last thread that is being waited on within a group
-            wait = ((tg->flags & GROUP_WAIT) && (tg->activeThrds.len == 1));
-            if(wait) {
-                tg->flags &= ~GROUP_WAIT;
-            }
                 
             tg->activeThrds.len--;
             list_append(&tg->idleThrds, &tt->move);
+            atomic_fetch_add(&tg->idle, 1);
         }
-        pthread_mutex_unlock(&tg->mutexGrp);
 
-        if(wait) {
-            pthread_mutex_lock(&tp->mutexPool);
-            tp->groupsWaiting--;
-            if(tp->groupsWaiting == 0) {
-                pthread_cond_broadcast(&tp->condPool);
-            }
-            pthread_mutex_unlock(&tp->mutexPool);
+        // work added before the idle count was raised did not wake anyone
+        atomic_thread_fence(memory_order_seq_cst);
+        tt->currTask = internal_take(tg, tt->shard);
+        if(tt->currTask != NULL) {
+            item_remove(&tt->move);
+            tg->idleThrds.len--;
+            atomic_fetch_sub(&tg->idle, 1);
+
+            list_append(&tg->activeThrds, &tt->move);
+            tt->state = running;
+            pthread_mutex_unlock(&tg->mutexGrp);
+            goto top;
         }
+        pthread_mutex_unlock(&tg->mutexGrp);
 
         while(tt->state == idle) {
             pthread_cond_wait(&tt->condThrd, &tt->mutexThrd);
@@ -674,6 +2908,31 @@ top:
     return NULL;
 }
 
+/**
+ * Runs a task on a worker thread.
+ * Groups in fiber mode run every task on a fiber so the task can suspend without blocking the thread.
+ */
+static void internal_run_work(TGroup *tg, Work *work) {
+    int charge = (tg->bucket.rate > 0 && tg->bucket.unit == RATE_CPU);
+    uint64_t start = charge ? internal_cpu_now() : 0;
+
+    if(tg->fiberStack > 0) {
+        // a task is counted from its start on a fiber till it finished, however often it is suspended
+        if(!(work->flags & WORK_FIBER)) {
+            atomic_fetch_add(&tg->fiberTasks, 1);
+        }
+        if(internal_fiber_run(tg, &currThrd->fibers, work) == 0) {
+            atomic_fetch_sub(&tg->fiberTasks, 1);
+        }
+    } else {
+        internal_run_task(work);
+    }
+
+    if(charge) {
+        internal_bucket_charge(&tg->bucket, (int64_t)(internal_cpu_now() - start));
+    }
+}
+
 /**
  * Acts as a manager for the entire pool. Will check groups and make sure they are healthy.
  * Depending ont he health status, the manager may need to create or delete threads within a group.
@@ -691,14 +2950,25 @@ static void *manager_thread_function(void *arg) {
 
     while(1) {
         int rc = 0;
+        uint64_t now;
 
         clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += 5;
 
         pthread_mutex_lock(&tp->mutexPool);
+        // registered producers need the manager to flush their lingering work
+        uint64_t tick = tp->linger;
+        if(tp->rated > 0 && tick > RATE_TICK) {
+            tick = RATE_TICK;
+        }
+        timeout.tv_sec += tick / NS_PER_SEC;
+        timeout.tv_nsec += tick % NS_PER_SEC;
+        if(timeout.tv_nsec >= NS_PER_SEC) {
+            timeout.tv_sec++;
+            timeout.tv_nsec -= NS_PER_SEC;
+        }
+
         // time outs or running state will execute the manager thread
-        // the manager thread will not execute when the wait_pool() is executing
-        while(!(rc == ETIMEDOUT || tp->state == running) || (tp->flags & POOL_WAITING)) {
+        while(!(rc == ETIMEDOUT || tp->state == running)) {
             rc = pthread_cond_timedwait(&tp->condPool, &tp->mutexPool, &timeout);
         }
 
@@ -706,16 +2976,24 @@ static void *manager_thread_function(void *arg) {
             pthread_mutex_unlock(&tp->mutexPool);
             break;
         }
+        atomic_store(&tp->signalled, 0);
 
         IL *curr;
         TGroup *tg;
+        now = internal_now();
         for_each(&tp->groups.head, curr) {
             unsigned int addThrds = 0;
 
             tg = CONTAINER_OF(curr, TGroup, move);
 
             pthread_mutex_lock(&tg->mutexGrp);
-            rc = internal_health_check(tg);
+            internal_drain_producers(tg, now, 0);
+            internal_refill(tg, now);
+            internal_wake_idle(tg);
+            internal_compensate(tg);
+
+            // a group that was made smaller can still run more threads than its max
+            rc = (tg->numThrds < tg->thrdMax) ? internal_health_check(tg) : well;
             switch (rc) {
                 case well:
                     break;
@@ -737,13 +3015,13 @@ static void *manager_thread_function(void *arg) {
                 TThread *tt;
                 Work *work;
 
-                work = q_fetch(&tg->q);
+                work = internal_take(tg, tg->numThrds % tg->q.numShards);
                 tt = internal_create_thread(tg, work);
                 assert(tt != NULL);
 
                 list_append(&tg->activeThrds, &tt->move);
 
-                rc = pthread_create(&tt->id, NULL, worker_thread_function, tt);
+                rc = internal_start_thread(tg, tt, 0);
                 assert(rc == 0);
                 
                 tg->thrds[tg->numThrds] = tt->id;
@@ -758,37 +3036,297 @@ static void *manager_thread_function(void *arg) {
 }
 
 /*  --Queue--   */
-static void q_init(struct Q *q, size_t capacity) {
-    q->capacity = capacity;
-    init_list(&q->work);
+static void q_init(struct Q *q, size_t capacity, unsigned int numShards, int node) {
+    q->shards = (struct Shard *)internal_node_alloc(numShards * sizeof(struct Shard), node);
+    q->node = node;
+
+    for (unsigned int i = 0; i < numShards; i++) {
+        struct Shard *shard = &q->shards[i];
+        pthread_mutex_init(&shard->mutexShard, NULL);
+        init_list(&shard->work);
+        atomic_init(&shard->count, 0);
+    }
+
+    q->numShards = numShards;
+    atomic_init(&q->capacity, capacity);
+    atomic_init(&q->len, 0);
+    atomic_init(&q->held, 0);
+}
+
+static void q_destroy(struct Q *q) {
+    for (unsigned int i = 0; i < q->numShards; i++) {
+        pthread_mutex_destroy(&q->shards[i].mutexShard);
+    }
+    internal_node_free(q->shards, q->numShards * sizeof(struct Shard), q->node);
+}
+
+/**
+ * Reserves room for up to n work in the queue.
+ * 
+ * @return  the number of work that can be added
+ */
+static size_t q_reserve(struct Q *q, size_t n) {
+    size_t len = atomic_load_explicit(&q->len, memory_order_relaxed);
+    size_t room;
+
+    if(q_full(q)) {
+        return 0;
+    }
+
+    size_t capacity = atomic_load_explicit(&q->capacity, memory_order_relaxed);
+    do {
+        if(len >= capacity) {
+            return 0;
+        }
+        room = capacity - len;
+        if(room > n) {
+            room = n;
+        }
+    } while(!atomic_compare_exchange_weak(&q->len, &len, len + room));
+
+    return room;
+}
+
+/**
+ * Each producer thread is given its own shard in round robin order.
+ */
+static struct Shard *q_shard(struct Q *q) {
+    if(threadShard == 0) {
+        threadShard = atomic_fetch_add_explicit(&nextShard, 1, memory_order_relaxed) + 1;
+    }
+    return &q->shards[(threadShard - 1) % q->numShards];
 }
 
 static int q_append(struct Q *q, Work *work) {
-    int rc = POOL_ERROR;
-    if(!q_full(q)) {
-        list_append(&q->work, &work->move);
-        rc = POOL_SUCCESS;
+    if(q_reserve(q, 1) == 0) {
+        return POOL_ERROR;
     }
-    return rc;
+
+    struct Shard *shard = q_shard(q);
+    pthread_mutex_lock(&shard->mutexShard);
+    list_append(&shard->work, &work->move);
+    atomic_store_explicit(&work->queue, shard, memory_order_relaxed);
+    atomic_store_explicit(&shard->count, shard->work.len, memory_order_relaxed);
+    pthread_mutex_unlock(&shard->mutexShard);
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Moves work from the front of the list to the queue.
+ * Without force only the work that fits in the queue is moved and the rest stays in the list.
+ * 
+ * @return  number of work moved
+ */
+static size_t q_append_list(struct Q *q, LL *list, int force) {
+    size_t moved;
+
+    if(force) {
+        moved = list->len;
+        atomic_fetch_add(&q->len, moved);
+    } else {
+        moved = q_reserve(q, list->len);
+    }
+
+    if(moved == 0) {
+        return 0;
+    }
+
+    q_place(q, list, moved);
+    return moved;
+}
+
+/**
+ * Moves n work from the front of the list to a shard, the room for it was already reserved in the queue length.
+ */
+static void q_place(struct Q *q, LL *list, size_t n) {
+    struct Shard *shard = q_shard(q);
+    // the shard is recorded before the work is visible to cancel_work()
+    IL *curr;
+    size_t i = 0;
+    for_each(&list->head, curr) {
+        if(i++ == n) {
+            break;
+        }
+        atomic_store_explicit(&CONTAINER_OF(curr, Work, move)->queue, shard, memory_order_relaxed);
+    }
+
+    pthread_mutex_lock(&shard->mutexShard);
+    if(n == list->len) {
+        list_splice(&shard->work, list);
+    } else {
+        for (i = 0; i < n; i++) {
+            list_append(&shard->work, list_pop(list));
+        }
+    }
+    atomic_store_explicit(&shard->count, shard->work.len, memory_order_relaxed);
+    pthread_mutex_unlock(&shard->mutexShard);
 }
 
-static Work *q_fetch(struct Q *q) {
+/**
+ * Fetches work from the home shard first then scans the other shards.
+ * Shards that look empty are skipped without taking their lock.
+ */
+static Work *q_fetch(struct Q *q, unsigned int home) {
     if(q_empty(q)) {
         return NULL;
     }
 
-    IL *il;
-    il = list_pop(&q->work);
+    for (unsigned int i = 0; i < q->numShards; i++) {
+        struct Shard *shard = &q->shards[(home + i) % q->numShards];
+        IL *il;
 
-    Work *work;
-    work = CONTAINER_OF(il, Work, move);
-    return work;
+        if(atomic_load_explicit(&shard->count, memory_order_relaxed) == 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&shard->mutexShard);
+        il = list_pop(&shard->work);
+        atomic_store_explicit(&shard->count, shard->work.len, memory_order_relaxed);
+        if(il != NULL) {
+            atomic_store_explicit(&CONTAINER_OF(il, Work, move)->queue, NULL, memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&shard->mutexShard);
+
+        if(il != NULL) {
+            atomic_fetch_sub(&q->len, 1);
+            return CONTAINER_OF(il, Work, move);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Fetches up to max work from the home shard first then the other shards, each shard is locked once.
+ * The first work is returned and the rest is appended to the list, where it is counted as held.
+ */
+static Work *q_fetch_batch(struct Q *q, unsigned int home, LL *list, size_t max) {
+    Work *first = NULL;
+    size_t n = 0;
+
+    if(q_empty(q)) {
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < q->numShards && n < max; i++) {
+        struct Shard *shard = &q->shards[(home + i) % q->numShards];
+        IL *il;
+
+        if(atomic_load_explicit(&shard->count, memory_order_relaxed) == 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&shard->mutexShard);
+        while(n < max && (il = list_pop(&shard->work)) != NULL) {
+            Work *work = CONTAINER_OF(il, Work, move);
+            atomic_store_explicit(&work->queue, NULL, memory_order_relaxed);
+            if(first == NULL) {
+                first = work;
+            } else {
+                list_append(list, il);
+            }
+            n++;
+        }
+        atomic_store_explicit(&shard->count, shard->work.len, memory_order_relaxed);
+        pthread_mutex_unlock(&shard->mutexShard);
+    }
+
+    if(n > 0) {
+        // held goes up first so the work is never missing from the count
+        atomic_fetch_add_explicit(&q->held, n - 1, memory_order_relaxed);
+        atomic_fetch_sub(&q->len, n);
+    }
+
+    return first;
+}
+
+/**
+ * Unlinks queued work from its shard.
+ * The shard recorded in the work is checked again under the shard lock since a worker can fetch the work meanwhile.
+ * 
+ * @return  POOL_ERROR when the work is not in this queue
+ */
+static int q_remove(struct Q *q, Work *work) {
+    struct Shard *shard = (struct Shard *)atomic_load_explicit(&work->queue, memory_order_relaxed);
+
+    if(shard == NULL || shard < q->shards || shard >= q->shards + q->numShards) {
+        return POOL_ERROR;
+    }
+
+    pthread_mutex_lock(&shard->mutexShard);
+    if(atomic_load_explicit(&work->queue, memory_order_relaxed) != shard) {
+        pthread_mutex_unlock(&shard->mutexShard);
+        return POOL_ERROR;
+    }
+
+    item_remove(&work->move);
+    shard->work.len--;
+    atomic_store_explicit(&shard->count, shard->work.len, memory_order_relaxed);
+    atomic_store_explicit(&work->queue, NULL, memory_order_relaxed);
+    pthread_mutex_unlock(&shard->mutexShard);
+
+    atomic_fetch_sub(&q->len, 1);
+    return POOL_SUCCESS;
+}
+
+/**
+ * Moves up to max queued work to the list in queue order, shard by shard.
+ * Work with any of the keep flags stays queued, such as the work that resumes fibers.
+ * 
+ * @return  number of work moved
+ */
+static size_t q_take(struct Q *q, LL *list, size_t max, int keep) {
+    size_t moved = 0;
+
+    for (unsigned int i = 0; i < q->numShards && moved < max; i++) {
+        struct Shard *shard = &q->shards[i];
+        LL kept;
+        IL *il;
+
+        if(atomic_load_explicit(&shard->count, memory_order_relaxed) == 0) {
+            continue;
+        }
+
+        init_list(&kept);
+
+        pthread_mutex_lock(&shard->mutexShard);
+        while(moved < max && (il = list_pop(&shard->work)) != NULL) {
+            Work *work = CONTAINER_OF(il, Work, move);
+            if(work->flags & keep) {
+                list_append(&kept, il);
+            } else {
+                atomic_store_explicit(&work->queue, NULL, memory_order_relaxed);
+                list_append(list, il);
+                moved++;
+            }
+        }
+        // the kept work goes back in front of the work that was not looked at
+        list_splice(&kept, &shard->work);
+        list_splice(&shard->work, &kept);
+        atomic_store_explicit(&shard->count, shard->work.len, memory_order_relaxed);
+        pthread_mutex_unlock(&shard->mutexShard);
+    }
+
+    atomic_fetch_sub(&q->len, moved);
+    return moved;
+}
+
+static size_t q_len(struct Q *q) {
+    return atomic_load_explicit(&q->len, memory_order_relaxed);
 }
 
 static int q_full(struct Q *q) {
-    return (q->work.len == q->capacity);
+    return (q_len(q) >= atomic_load_explicit(&q->capacity, memory_order_relaxed));
 }
 
 static int q_empty(struct Q *q) {
-    return empty(&q->work);
+    return (q_len(q) == 0);
+}
+
+/**
+ * Work that has not started yet, including the work held in the batches of workers.
+ */
+static size_t q_queued(struct Q *q) {
+    return q_len(q) + atomic_load_explicit(&q->held, memory_order_relaxed);
 }
\ No newline at end of file
@@ -0,0 +1,507 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+/**
+ * @note    will remove this later
+ */
+#include <assert.h>
+
+#include "pool.h"
+#include "il.h"
+#include "internal.h"
+
+#ifdef __linux__
+
+// events taken from the kernel in one wake up of the reactor
+#define REACTOR_EVENTS 64
+// how long the reactor waits before retrying watches whose group queue was full
+#define REACTOR_RETRY_MS 1
+
+/**
+ * Waits on the epoll set of a pool and queues the callbacks of ready descriptors in their groups.
+ * Watches are only freed by the reactor thread, after the batch of events that may still point at them.
+ */
+struct Reactor {
+    pthread_mutex_t mutexReactor;
+
+    int epfd;
+    // wakes the reactor when the pool is destroyed
+    int wakefd;
+
+    pthread_t thread;
+    int stop;
+
+    // registered watches, unwatched ones wait in retired for the end of the current batch
+    LL watches;
+    LL retired;
+    // watches whose callback did not fit in the group queue
+    LL deferred;
+
+    // unwatch_fd() calls waiting for a running callback to return
+    WaitQ waitRun;
+};
+
+/**
+ * A descriptor registered with the reactor.
+ *
+ * Level triggered watches are one shot in the kernel and armed again once the callback returns,
+ * so a callback never runs twice at the same time for one descriptor.
+ * Edge triggered watches stay armed, edges that arrive while the callback is queued or running
+ * are counted in pending and make the same task run the callback again.
+ */
+struct TWatch {
+    IL move;
+    IL defer;
+
+    Reactor *r;
+    TGroup *tg;
+
+    int fd;
+    int events;
+
+    io_func func;
+    void *arg;
+
+    // events seen since the callback last started
+    atomic_int ready;
+    // wake ups since the callback last started, a task is queued while it is above 0
+    atomic_uint pending;
+
+    // the registration and the queued task each hold a reference
+    atomic_uint refs;
+    atomic_int closed;
+    // set while the task of the watch is past its last look at closed
+    atomic_int running;
+};
+
+// watch whose callback runs on the current thread, so unwatch_fd() from the callback does not wait for itself
+static __thread TWatch *currWatch = NULL;
+
+static void *reactor_thread_function(void *arg);
+static void internal_watch_dispatch(TWatch *w);
+static void internal_watch_run(void *arg);
+static void internal_watch_cancel(void *arg);
+static void internal_watch_release(TWatch *w);
+static uint32_t internal_epoll_events(int events);
+
+/**
+ * Registers a file descriptor with the reactor of the pool.
+ * Once the descriptor is ready the callback is queued in the group with the ready events.
+ * The reactor thread is started by the first watch of a pool.
+ *
+ * @param   tg      group the callback runs in
+ * @param   fd      descriptor to watch, it has to stay open until unwatch_fd()
+ * @param   events  IO_READ and/or IO_WRITE, IO_EDGE for edge triggered readiness
+ * @param   func    called with the descriptor and the ready events
+ * @param   arg     passed to func
+ *
+ * @note    edge triggered callbacks have to read or write until the call would block
+ */
+TWatch *watch_fd(TGroup *tg, int fd, int events, io_func func, void *arg) {
+    if(tg == NULL || fd < 0 || func == NULL || (events & (IO_READ | IO_WRITE)) == 0) {
+        return NULL;
+    }
+
+    Reactor *r = internal_pool_reactor(tg);
+    if(r == NULL) {
+        return NULL;
+    }
+
+    TWatch *w;
+    w = (TWatch *)malloc(sizeof(TWatch));
+    assert(w != NULL);
+
+    init_il(&w->move);
+    init_il(&w->defer);
+    w->r = r;
+    w->tg = tg;
+    w->fd = fd;
+    w->events = events;
+    w->func = func;
+    w->arg = arg;
+    atomic_init(&w->ready, 0);
+    atomic_init(&w->pending, 0);
+    atomic_init(&w->refs, 1);
+    atomic_init(&w->closed, 0);
+    atomic_init(&w->running, 0);
+
+    struct epoll_event ev;
+    ev.events = internal_epoll_events(events);
+    ev.data.ptr = w;
+
+    pthread_mutex_lock(&r->mutexReactor);
+    if(r->stop || epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        pthread_mutex_unlock(&r->mutexReactor);
+        free(w);
+        return NULL;
+    }
+    list_append(&r->watches, &w->move);
+    pthread_mutex_unlock(&r->mutexReactor);
+
+    return w;
+}
+
+/**
+ * Removes a descriptor from the reactor.
+ * Callbacks that are queued but have not started are dropped, one that is running on another thread is waited for.
+ * The descriptor can be closed once this returns.
+ *
+ * @param   w       watch struct returned by watch_fd()
+ *
+ * @note    called from the callback of the watch it returns right away, the callback is the last use of the descriptor
+ */
+void unwatch_fd(TWatch *w) {
+    if(w == NULL) {
+        return;
+    }
+
+    Reactor *r = w->r;
+
+    pthread_mutex_lock(&r->mutexReactor);
+    if(!atomic_load(&w->closed)) {
+        atomic_store(&w->closed, 1);
+        if(!r->stop) {
+            epoll_ctl(r->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+        }
+
+        item_remove(&w->move);
+        r->watches.len--;
+        list_append(&r->retired, &w->move);
+    }
+
+    // the reference keeps the watch while the reactor and the callback drop theirs
+    int wait = (currWatch != w && atomic_load(&w->running));
+    if(wait) {
+        atomic_fetch_add(&w->refs, 1);
+        while(atomic_load(&w->running)) {
+            internal_wait(&r->waitRun, &r->mutexReactor);
+        }
+    }
+    pthread_mutex_unlock(&r->mutexReactor);
+
+    if(wait) {
+        internal_watch_release(w);
+    }
+}
+
+/*  --Module Hooks--  */
+
+Reactor *internal_reactor_init(void) {
+    Reactor *r;
+    r = (Reactor *)malloc(sizeof(Reactor));
+    assert(r != NULL);
+
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(r->epfd < 0) {
+        free(r);
+        return NULL;
+    }
+
+    r->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(r->wakefd < 0) {
+        close(r->epfd);
+        free(r);
+        return NULL;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if(epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev) != 0) {
+        close(r->wakefd);
+        close(r->epfd);
+        free(r);
+        return NULL;
+    }
+
+    pthread_mutex_init(&r->mutexReactor, NULL);
+    internal_init_waitq(&r->waitRun);
+    r->stop = 0;
+    init_list(&r->watches);
+    init_list(&r->retired);
+    init_list(&r->deferred);
+
+    if(pthread_create(&r->thread, NULL, reactor_thread_function, r) != 0) {
+        internal_destroy_waitq(&r->waitRun);
+        pthread_mutex_destroy(&r->mutexReactor);
+        close(r->wakefd);
+        close(r->epfd);
+        free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+/**
+ * Stops the reactor thread so no callback is queued anymore.
+ * Called before the groups of the pool are destroyed, their queued callbacks still run.
+ */
+void internal_reactor_stop(Reactor *r) {
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&r->mutexReactor);
+    r->stop = 1;
+    pthread_mutex_unlock(&r->mutexReactor);
+
+    while(write(r->wakefd, &one, sizeof(one)) < 0 && errno == EINTR);
+
+    if(pthread_join(r->thread, NULL) != 0) {
+        assert(0);
+    }
+}
+
+/**
+ * Frees the reactor and every watch left in it.
+ * Called after the groups of the pool are destroyed so no callback holds a watch anymore.
+ */
+void internal_reactor_destroy(Reactor *r) {
+    IL *il;
+
+    // retired watches can be left with only the reference of the deferred list
+    while((il = list_pop(&r->deferred)) != NULL) {
+        internal_watch_release(CONTAINER_OF(il, TWatch, defer));
+    }
+    while((il = list_pop(&r->watches)) != NULL) {
+        free(CONTAINER_OF(il, TWatch, move));
+    }
+    while((il = list_pop(&r->retired)) != NULL) {
+        free(CONTAINER_OF(il, TWatch, move));
+    }
+
+    close(r->wakefd);
+    close(r->epfd);
+    internal_destroy_waitq(&r->waitRun);
+    pthread_mutex_destroy(&r->mutexReactor);
+
+    free(r);
+}
+
+/*  --Internal Functions--  */
+
+/**
+ * Each wake up handles a whole batch of events under the reactor lock.
+ * Retired watches are released at the end of the batch, no later batch can return them.
+ */
+static void *reactor_thread_function(void *arg) {
+    Reactor *r = (Reactor *)arg;
+    struct epoll_event events[REACTOR_EVENTS];
+
+    while(1) {
+        pthread_mutex_lock(&r->mutexReactor);
+        int timeout = empty(&r->deferred) ? -1 : REACTOR_RETRY_MS;
+        int stop = r->stop;
+        pthread_mutex_unlock(&r->mutexReactor);
+
+        if(stop) {
+            break;
+        }
+
+        int n = epoll_wait(r->epfd, events, REACTOR_EVENTS, timeout);
+        if(n < 0 && errno != EINTR) {
+            assert(0);
+        }
+
+        pthread_mutex_lock(&r->mutexReactor);
+
+        // retry the watches whose group was full before taking new ones
+        LL deferred;
+        init_list(&deferred);
+        list_splice(&deferred, &r->deferred);
+
+        IL *il;
+        while((il = list_pop(&deferred)) != NULL) {
+            internal_watch_dispatch(CONTAINER_OF(il, TWatch, defer));
+        }
+
+        for (int i = 0; i < n; i++) {
+            TWatch *w = (TWatch *)events[i].data.ptr;
+            if(w == NULL || r->stop || atomic_load(&w->closed)) {
+                continue;
+            }
+
+            int ready = 0;
+            if(events[i].events & EPOLLIN) {
+                ready |= IO_READ;
+            }
+            if(events[i].events & EPOLLOUT) {
+                ready |= IO_WRITE;
+            }
+            if(events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+                ready |= IO_HUP;
+            }
+
+            atomic_fetch_or(&w->ready, ready);
+            if(atomic_fetch_add(&w->pending, 1) == 0) {
+                atomic_fetch_add(&w->refs, 1);
+                internal_watch_dispatch(w);
+            }
+        }
+
+        LL retired;
+        init_list(&retired);
+        list_splice(&retired, &r->retired);
+        pthread_mutex_unlock(&r->mutexReactor);
+
+        while((il = list_pop(&retired)) != NULL) {
+            internal_watch_release(CONTAINER_OF(il, TWatch, move));
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Queues the callback of a watch, the caller holds the reactor lock and a reference for the task.
+ * A full group queue defers the watch to the next wake up of the reactor.
+ */
+static void internal_watch_dispatch(TWatch *w) {
+    Reactor *r = w->r;
+    Work *work;
+    int rc;
+
+    if(atomic_load(&w->closed) || r->stop) {
+        atomic_store(&w->pending, 0);
+        internal_watch_release(w);
+        return;
+    }
+
+    init_work(&work);
+    add_work(work, internal_watch_run, w);
+    add_cancel(work, internal_watch_cancel);
+
+    rc = do_work(w->tg, work);
+    if(rc == POOL_SUCCESS) {
+        return;
+    }
+
+    free(work);
+    if(rc == GROUP_FULL) {
+        list_append(&r->deferred, &w->defer);
+        return;
+    }
+
+    // the group is closing, the descriptor is not watched anymore
+    atomic_store(&w->pending, 0);
+    internal_watch_release(w);
+}
+
+/**
+ * Runs the callback until no wake up arrived while it was running.
+ * A one shot watch is armed in the kernel again afterwards.
+ * Running is raised before closed is read, so an unwatch either stops the callback or waits for it.
+ */
+static void internal_watch_run(void *arg) {
+    TWatch *w = (TWatch *)arg;
+    unsigned int pending = atomic_load(&w->pending);
+    TWatch *prev = currWatch;
+
+    currWatch = w;
+    atomic_store(&w->running, 1);
+    while(1) {
+        int ready = atomic_exchange(&w->ready, 0);
+        if(!atomic_load(&w->closed) && ready != 0) {
+            w->func(w->fd, ready, w->arg);
+        }
+
+        if(atomic_compare_exchange_strong(&w->pending, &pending, 0)) {
+            break;
+        }
+    }
+    atomic_store(&w->running, 0);
+    currWatch = prev;
+
+    if(atomic_load(&w->closed)) {
+        Reactor *r = w->r;
+        pthread_mutex_lock(&r->mutexReactor);
+        internal_wake_all(&r->waitRun);
+        pthread_mutex_unlock(&r->mutexReactor);
+    }
+
+    if(!(w->events & IO_EDGE)) {
+        Reactor *r = w->r;
+        struct epoll_event ev;
+        ev.events = internal_epoll_events(w->events);
+        ev.data.ptr = w;
+
+        // the lock keeps the descriptor from being removed and reused while it is armed again
+        pthread_mutex_lock(&r->mutexReactor);
+        if(!atomic_load(&w->closed) && !r->stop) {
+            epoll_ctl(r->epfd, EPOLL_CTL_MOD, w->fd, &ev);
+        }
+        pthread_mutex_unlock(&r->mutexReactor);
+    }
+
+    internal_watch_release(w);
+}
+
+/**
+ * The group was shut down before the callback ran, the reference of the task is dropped.
+ */
+static void internal_watch_cancel(void *arg) {
+    TWatch *w = (TWatch *)arg;
+
+    atomic_store(&w->pending, 0);
+    internal_watch_release(w);
+}
+
+static void internal_watch_release(TWatch *w) {
+    if(atomic_fetch_sub(&w->refs, 1) == 1) {
+        free(w);
+    }
+}
+
+static uint32_t internal_epoll_events(int events) {
+    uint32_t ev = 0;
+
+    if(events & IO_READ) {
+        ev |= EPOLLIN | EPOLLRDHUP;
+    }
+    if(events & IO_WRITE) {
+        ev |= EPOLLOUT;
+    }
+
+    ev |= (events & IO_EDGE) ? EPOLLET : EPOLLONESHOT;
+    return ev;
+}
+
+#else
+
+/**
+ * The reactor is built on epoll, other platforms cannot watch descriptors.
+ */
+TWatch *watch_fd(TGroup *tg, int fd, int events, io_func func, void *arg) {
+    (void)tg;
+    (void)fd;
+    (void)events;
+    (void)func;
+    (void)arg;
+    return NULL;
+}
+
+void unwatch_fd(TWatch *w) {
+    (void)w;
+}
+
+Reactor *internal_reactor_init(void) {
+    return NULL;
+}
+
+void internal_reactor_stop(Reactor *r) {
+    (void)r;
+}
+
+void internal_reactor_destroy(Reactor *r) {
+    (void)r;
+}
+
+#endif
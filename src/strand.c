@@ -0,0 +1,283 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+/**
+ * @note    will remove this later
+ */
+#include <assert.h>
+
+#include "pool.h"
+#include "il.h"
+#include "internal.h"
+
+// tasks a strand runs before it lets the rest of the group run
+#define STRAND_BATCH 16
+
+/**
+ * Runs the tasks posted to it one at a time in order.
+ * The strand is queued in its group as a single task while it has work, so no thread waits on it.
+ */
+struct TStrand {
+    pthread_mutex_t mutexStrand;
+    // woken once the strand has no work left
+    WaitQ waitStrand;
+
+    TGroup *tg;
+    LL work;
+
+    // set while the strand is queued or running in the group
+    int scheduled;
+};
+
+/**
+ * Fixed set of strands that keys are hashed onto.
+ */
+struct TStrandMap {
+    TStrand *strands;
+    size_t numStrands;
+};
+
+static void internal_strand_init(TStrand *strand, TGroup *tg);
+static void internal_strand_destroy(TStrand *strand);
+static Work *internal_strand_task(TStrand *strand);
+static void internal_strand_run(void *arg);
+static void internal_strand_cancel(void *arg);
+static size_t internal_strand_hash(size_t key);
+
+/**
+ * Initializes a strand that runs its tasks in a group.
+ *
+ * @param   strand  double pointer to strand struct for internal memory allocation
+ * @param   tg      group the tasks run in
+ */
+int init_strand(TStrand **strand, TGroup *tg) {
+    if(strand == NULL || tg == NULL) {
+        return POOL_ERROR;
+    }
+
+    *strand = (TStrand *)malloc(sizeof(TStrand));
+    if(*strand == NULL) {
+        return POOL_ERROR;
+    }
+
+    internal_strand_init(*strand, tg);
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Posts work to the strand, it runs after the work posted before it and never at the same time.
+ * An idle strand is queued in its group, so the call fails like do_work() when the group does not take it.
+ *
+ * @param   strand  strand struct
+ * @param   work    work struct that is populated from the add_work()
+ */
+int strand_work(TStrand *strand, Work *work) {
+    if(strand == NULL || work == NULL) {
+        return POOL_ERROR;
+    }
+
+    internal_work_defaults(strand->tg, work);
+
+    pthread_mutex_lock(&strand->mutexStrand);
+    if(!strand->scheduled) {
+        // the task cannot run before the strand is unlocked
+        Work *task = internal_strand_task(strand);
+        int rc = do_work(strand->tg, task);
+        if(rc != POOL_SUCCESS) {
+            pthread_mutex_unlock(&strand->mutexStrand);
+            release_work(task);
+            return rc;
+        }
+        strand->scheduled = 1;
+    }
+    // the strand is in flight till it runs the work so the group is never seen idle in between
+    internal_track(strand->tg, work);
+    list_append(&strand->work, &work->move);
+    pthread_mutex_unlock(&strand->mutexStrand);
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Waits for the work of the strand to finish and frees it.
+ *
+ * @param   strand  strand struct
+ */
+void destroy_strand(TStrand *strand) {
+    if(strand == NULL) {
+        return;
+    }
+
+    internal_strand_destroy(strand);
+    free(strand);
+}
+
+/**
+ * Initializes a map of strands in a group.
+ * Work posted with the same key always goes to the same strand, different keys can share a strand.
+ *
+ * @param   map         double pointer to strand map struct for internal memory allocation
+ * @param   tg          group the tasks run in
+ * @param   numStrands  number of strands keys are spread across
+ */
+int init_strand_map(TStrandMap **map, TGroup *tg, size_t numStrands) {
+    if(map == NULL || tg == NULL || numStrands == 0) {
+        return POOL_ERROR;
+    }
+
+    *map = (TStrandMap *)malloc(sizeof(TStrandMap));
+    if(*map == NULL) {
+        return POOL_ERROR;
+    }
+
+    (*map)->strands = (TStrand *)malloc(numStrands * sizeof(TStrand));
+    if((*map)->strands == NULL) {
+        free(*map);
+        return POOL_ERROR;
+    }
+
+    for (size_t i = 0; i < numStrands; i++) {
+        internal_strand_init(&(*map)->strands[i], tg);
+    }
+    (*map)->numStrands = numStrands;
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Posts work to the strand of the key.
+ *
+ * @param   map     strand map struct
+ * @param   key     key such as a connection or account id
+ * @param   work    work struct that is populated from the add_work()
+ */
+int strand_map_work(TStrandMap *map, size_t key, Work *work) {
+    if(map == NULL) {
+        return POOL_ERROR;
+    }
+
+    return strand_work(&map->strands[internal_strand_hash(key) % map->numStrands], work);
+}
+
+/**
+ * Waits for the work of every strand to finish and frees the map.
+ *
+ * @param   map     strand map struct
+ */
+void destroy_strand_map(TStrandMap *map) {
+    if(map == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < map->numStrands; i++) {
+        internal_strand_destroy(&map->strands[i]);
+    }
+
+    free(map->strands);
+    free(map);
+}
+
+/*  --Internal Functions--  */
+
+static void internal_strand_init(TStrand *strand, TGroup *tg) {
+    pthread_mutex_init(&strand->mutexStrand, NULL);
+    internal_init_waitq(&strand->waitStrand);
+    init_list(&strand->work);
+    strand->tg = tg;
+    strand->scheduled = 0;
+}
+
+static void internal_strand_destroy(TStrand *strand) {
+    pthread_mutex_lock(&strand->mutexStrand);
+    while(strand->scheduled) {
+        internal_wait(&strand->waitStrand, &strand->mutexStrand);
+    }
+    pthread_mutex_unlock(&strand->mutexStrand);
+
+    internal_destroy_waitq(&strand->waitStrand);
+    pthread_mutex_destroy(&strand->mutexStrand);
+}
+
+/**
+ * Task that stands for the strand in its group.
+ * It does not post to the completion queue of the group, the work of the strand does.
+ */
+static Work *internal_strand_task(TStrand *strand) {
+    Work *work;
+
+    init_work(&work);
+    add_work(work, internal_strand_run, strand);
+    add_cancel(work, internal_strand_cancel);
+    work->flags = WORK_INTERNAL;
+
+    return work;
+}
+
+/**
+ * Runs a batch of the strand work then queues the strand again behind the other work of the group.
+ * The strand is unlocked while its work runs, work posted meanwhile is appended behind it.
+ */
+static void internal_strand_run(void *arg) {
+    TStrand *strand = (TStrand *)arg;
+
+    for (size_t i = 0; i < STRAND_BATCH; i++) {
+        IL *il;
+
+        pthread_mutex_lock(&strand->mutexStrand);
+        if((il = list_pop(&strand->work)) == NULL) {
+            strand->scheduled = 0;
+            internal_wake_all(&strand->waitStrand);
+            pthread_mutex_unlock(&strand->mutexStrand);
+            return;
+        }
+        pthread_mutex_unlock(&strand->mutexStrand);
+
+        internal_run_task(CONTAINER_OF(il, Work, move));
+    }
+
+    // the strand was already accepted by the group so a full queue does not stop it
+    pthread_mutex_lock(&strand->mutexStrand);
+    if(empty(&strand->work)) {
+        strand->scheduled = 0;
+        internal_wake_all(&strand->waitStrand);
+    } else {
+        internal_requeue(strand->tg, internal_strand_task(strand));
+    }
+    pthread_mutex_unlock(&strand->mutexStrand);
+}
+
+/**
+ * The group discarded the strand so the work left in it is cancelled as well.
+ */
+static void internal_strand_cancel(void *arg) {
+    TStrand *strand = (TStrand *)arg;
+    LL work;
+    IL *il;
+
+    pthread_mutex_lock(&strand->mutexStrand);
+    init_list(&work);
+    list_splice(&work, &strand->work);
+    strand->scheduled = 0;
+    internal_wake_all(&strand->waitStrand);
+    pthread_mutex_unlock(&strand->mutexStrand);
+
+    while((il = list_pop(&work)) != NULL) {
+        internal_cancel_task(CONTAINER_OF(il, Work, move));
+    }
+}
+
+/**
+ * Mixes the key so keys that differ in a few bits land on different strands.
+ */
+static size_t internal_strand_hash(size_t key) {
+    uint64_t x = (uint64_t)key;
+
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+
+    return (size_t)x;
+}
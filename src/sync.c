@@ -0,0 +1,423 @@
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "pool.h"
+#include "internal.h"
+
+#define CACHE_LINE 64
+// polls of the phase before a barrier waiter sleeps
+#define BARRIER_SPIN 4096
+// set in the inside count by destroy_barrier(), tasks that leave after it tell it under the lock
+#define BARRIER_DESTROY 0x80000000u
+
+/**
+ * Opens once count_down was called count times.
+ */
+struct TLatch {
+    pthread_mutex_t mutexLatch;
+    WaitQ waitLatch;
+
+    size_t count;
+};
+
+/**
+ * Bounded channel of pointers.
+ * Senders wait while the ring is full and receivers wait while it is empty.
+ */
+struct TChan {
+    pthread_mutex_t mutexChan;
+    WaitQ sendQ;
+    WaitQ recvQ;
+
+    void **ring;
+    size_t cap;
+    size_t head;
+    size_t len;
+
+    int closed;
+};
+
+/**
+ * Sense reversing barrier, the last task to arrive starts the next phase by bumping it.
+ * Waiters poll the phase for a while before they sleep on it, threads on a futex and fibers in the wait queue.
+ * The arrival count and the phase sit on their own cache lines so arrivals do not disturb the pollers.
+ */
+struct TBarrier {
+    _Alignas(CACHE_LINE) atomic_uint remaining;
+    // tasks within barrier_wait(), the barrier is only freed once they all left
+    atomic_uint inside;
+    _Alignas(CACHE_LINE) atomic_uint phase;
+    // waiters that stopped polling, the last arrival only wakes anyone when there are some
+    atomic_uint sleepers;
+
+    _Alignas(CACHE_LINE) pthread_mutex_t mutexBarrier;
+    WaitQ waitBarrier;
+
+    unsigned int count;
+    unsigned int spin;
+};
+
+static void internal_barrier_leave(TBarrier *barrier);
+
+/**
+ * Initializes a latch.
+ * Waiting on the latch suspends the fiber of a task instead of blocking its thread.
+ *
+ * @param   latch   double pointer to latch struct for internal memory allocation
+ * @param   count   number of count downs that open the latch
+ */
+int init_latch(TLatch **latch, size_t count) {
+    if(latch == NULL) {
+        return POOL_ERROR;
+    }
+
+    *latch = (TLatch *)malloc(sizeof(TLatch));
+    if(*latch == NULL) {
+        return POOL_ERROR;
+    }
+
+    pthread_mutex_init(&(*latch)->mutexLatch, NULL);
+    internal_init_waitq(&(*latch)->waitLatch);
+    (*latch)->count = count;
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Counts the latch down and wakes the waiters once it is open.
+ * Counting down an open latch does nothing.
+ *
+ * @param   latch   latch struct
+ */
+void latch_count_down(TLatch *latch) {
+    if(latch == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&latch->mutexLatch);
+    if(latch->count > 0 && --latch->count == 0) {
+        internal_wake_all(&latch->waitLatch);
+    }
+    pthread_mutex_unlock(&latch->mutexLatch);
+}
+
+/**
+ * Wait till the latch is open.
+ *
+ * @param   latch   latch struct
+ */
+void latch_wait(TLatch *latch) {
+    if(latch == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&latch->mutexLatch);
+    while(latch->count > 0) {
+        internal_wait(&latch->waitLatch, &latch->mutexLatch);
+    }
+    pthread_mutex_unlock(&latch->mutexLatch);
+}
+
+/**
+ * Frees the latch.
+ * The latch must not have any waiters left.
+ *
+ * @param   latch   latch struct
+ */
+void destroy_latch(TLatch *latch) {
+    if(latch == NULL) {
+        return;
+    }
+
+    internal_destroy_waitq(&latch->waitLatch);
+    pthread_mutex_destroy(&latch->mutexLatch);
+
+    free(latch);
+}
+
+/**
+ * Initializes a channel.
+ * Sending to a full channel or receiving from an empty one suspends the fiber of a task instead of blocking its thread.
+ *
+ * @param   chan    double pointer to channel struct for internal memory allocation
+ * @param   cap     number of items the channel buffers, at least 1
+ */
+int init_chan(TChan **chan, size_t cap) {
+    if(chan == NULL || cap == 0) {
+        return POOL_ERROR;
+    }
+
+    *chan = (TChan *)malloc(sizeof(TChan));
+    if(*chan == NULL) {
+        return POOL_ERROR;
+    }
+
+    (*chan)->ring = (void **)malloc(cap * sizeof(void *));
+    if((*chan)->ring == NULL) {
+        free(*chan);
+        return POOL_ERROR;
+    }
+
+    pthread_mutex_init(&(*chan)->mutexChan, NULL);
+    internal_init_waitq(&(*chan)->sendQ);
+    internal_init_waitq(&(*chan)->recvQ);
+
+    (*chan)->cap = cap;
+    (*chan)->head = 0;
+    (*chan)->len = 0;
+    (*chan)->closed = 0;
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Sends an item, waits while the channel is full.
+ *
+ * @param   chan    channel struct
+ * @param   item    item passed to a receiver
+ * @return  POOL_ERROR once the channel is closed
+ */
+int chan_send(TChan *chan, void *item) {
+    if(chan == NULL) {
+        return POOL_ERROR;
+    }
+
+    pthread_mutex_lock(&chan->mutexChan);
+    while(!chan->closed && chan->len == chan->cap) {
+        internal_wait(&chan->sendQ, &chan->mutexChan);
+    }
+
+    if(chan->closed) {
+        pthread_mutex_unlock(&chan->mutexChan);
+        return POOL_ERROR;
+    }
+
+    chan->ring[(chan->head + chan->len) % chan->cap] = item;
+    chan->len++;
+    internal_wake_one(&chan->recvQ);
+    pthread_mutex_unlock(&chan->mutexChan);
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Receives an item, waits while the channel is empty.
+ * Items sent before the channel was closed are still received.
+ *
+ * @param   chan    channel struct
+ * @param   item    receives the item
+ * @return  POOL_ERROR once the channel is closed and empty
+ */
+int chan_recv(TChan *chan, void **item) {
+    if(chan == NULL || item == NULL) {
+        return POOL_ERROR;
+    }
+
+    pthread_mutex_lock(&chan->mutexChan);
+    while(!chan->closed && chan->len == 0) {
+        internal_wait(&chan->recvQ, &chan->mutexChan);
+    }
+
+    if(chan->len == 0) {
+        pthread_mutex_unlock(&chan->mutexChan);
+        return POOL_ERROR;
+    }
+
+    *item = chan->ring[chan->head];
+    chan->head = (chan->head + 1) % chan->cap;
+    chan->len--;
+    internal_wake_one(&chan->sendQ);
+    pthread_mutex_unlock(&chan->mutexChan);
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Closes the channel and wakes every waiter.
+ *
+ * @param   chan    channel struct
+ */
+void close_chan(TChan *chan) {
+    if(chan == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&chan->mutexChan);
+    chan->closed = 1;
+    internal_wake_all(&chan->sendQ);
+    internal_wake_all(&chan->recvQ);
+    pthread_mutex_unlock(&chan->mutexChan);
+}
+
+/**
+ * Frees the channel.
+ * The channel must not have any waiters left.
+ *
+ * @param   chan    channel struct
+ */
+void destroy_chan(TChan *chan) {
+    if(chan == NULL) {
+        return;
+    }
+
+    internal_destroy_waitq(&chan->recvQ);
+    internal_destroy_waitq(&chan->sendQ);
+    pthread_mutex_destroy(&chan->mutexChan);
+
+    free(chan->ring);
+    free(chan);
+}
+
+/**
+ * Initializes a reusable barrier for count tasks.
+ * Waiting suspends the fiber of a task instead of blocking its thread,
+ * tasks without a fiber need a thread each so the group has to run at least count threads.
+ *
+ * @param   barrier double pointer to barrier struct for internal memory allocation
+ * @param   count   number of tasks that meet at the barrier in every phase
+ */
+int init_barrier(TBarrier **barrier, unsigned int count) {
+    if(barrier == NULL || count == 0) {
+        return POOL_ERROR;
+    }
+
+    if(posix_memalign((void **)barrier, CACHE_LINE, sizeof(TBarrier)) != 0) {
+        return POOL_ERROR;
+    }
+
+    TBarrier *b = *barrier;
+    atomic_init(&b->remaining, count);
+    atomic_init(&b->inside, 0);
+    atomic_init(&b->phase, 0);
+    atomic_init(&b->sleepers, 0);
+    pthread_mutex_init(&b->mutexBarrier, NULL);
+    internal_init_waitq(&b->waitBarrier);
+    b->count = count;
+
+    // polling only pays off when the other tasks can arrive on other cpus meanwhile
+    b->spin = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? BARRIER_SPIN : 0;
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Waits till count tasks called it in the current phase, then the barrier is ready for the next phase.
+ *
+ * @param   barrier barrier struct
+ * @return  BARRIER_LAST for the task that arrived last, POOL_SUCCESS for the others
+ */
+int barrier_wait(TBarrier *barrier) {
+    if(barrier == NULL) {
+        return POOL_ERROR;
+    }
+
+    atomic_fetch_add(&barrier->inside, 1);
+    unsigned int phase = atomic_load_explicit(&barrier->phase, memory_order_acquire);
+
+    if(atomic_fetch_sub_explicit(&barrier->remaining, 1, memory_order_acq_rel) == 1) {
+        // reset before the phase moves on since waiters can arrive again as soon as they see it
+        atomic_store_explicit(&barrier->remaining, barrier->count, memory_order_relaxed);
+        atomic_store(&barrier->phase, phase + 1);
+
+        if(atomic_load(&barrier->sleepers) > 0) {
+#ifdef __linux__
+            syscall(SYS_futex, &barrier->phase, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#endif
+            pthread_mutex_lock(&barrier->mutexBarrier);
+            internal_wake_all(&barrier->waitBarrier);
+            pthread_mutex_unlock(&barrier->mutexBarrier);
+        }
+
+        internal_barrier_leave(barrier);
+        return BARRIER_LAST;
+    }
+
+    for (unsigned int i = 0; i < barrier->spin; i++) {
+        if(atomic_load_explicit(&barrier->phase, memory_order_acquire) != phase) {
+            internal_barrier_leave(barrier);
+            return POOL_SUCCESS;
+        }
+    }
+
+    atomic_fetch_add(&barrier->sleepers, 1);
+
+#ifdef __linux__
+    if(!internal_in_fiber()) {
+        internal_release_batch();
+
+        // the kernel compares the phase again so a wake between the check and the sleep is not lost
+        while(atomic_load_explicit(&barrier->phase, memory_order_acquire) == phase) {
+            syscall(SYS_futex, &barrier->phase, FUTEX_WAIT_PRIVATE, phase, NULL, NULL, 0);
+        }
+
+        atomic_fetch_sub(&barrier->sleepers, 1);
+        internal_barrier_leave(barrier);
+        return POOL_SUCCESS;
+    }
+#endif
+
+    pthread_mutex_lock(&barrier->mutexBarrier);
+    while(atomic_load_explicit(&barrier->phase, memory_order_acquire) == phase) {
+        internal_wait(&barrier->waitBarrier, &barrier->mutexBarrier);
+    }
+    pthread_mutex_unlock(&barrier->mutexBarrier);
+
+    atomic_fetch_sub(&barrier->sleepers, 1);
+    internal_barrier_leave(barrier);
+    return POOL_SUCCESS;
+}
+
+/**
+ * Frees the barrier once the tasks of the last phase left barrier_wait().
+ * Any task of the last phase can call it as soon as its own barrier_wait() returned, no new phase may start.
+ *
+ * @param   barrier barrier struct
+ */
+void destroy_barrier(TBarrier *barrier) {
+    if(barrier == NULL) {
+        return;
+    }
+
+    // the last arrival is still waking the others and the woken ones still have to leave
+    pthread_mutex_lock(&barrier->mutexBarrier);
+    atomic_fetch_or(&barrier->inside, BARRIER_DESTROY);
+    while(atomic_load(&barrier->inside) != BARRIER_DESTROY) {
+        internal_wait(&barrier->waitBarrier, &barrier->mutexBarrier);
+    }
+    pthread_mutex_unlock(&barrier->mutexBarrier);
+
+    internal_destroy_waitq(&barrier->waitBarrier);
+    pthread_mutex_destroy(&barrier->mutexBarrier);
+
+    free(barrier);
+}
+
+/*  --Internal Functions--  */
+
+/**
+ * Last access of a task to the barrier.
+ * Once destroy_barrier() waits the count drops under the lock, so the task that leaves last wakes it before it can free the barrier.
+ */
+static void internal_barrier_leave(TBarrier *barrier) {
+    unsigned int inside = atomic_load(&barrier->inside);
+
+    while(!(inside & BARRIER_DESTROY)) {
+        if(atomic_compare_exchange_weak(&barrier->inside, &inside, inside - 1)) {
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&barrier->mutexBarrier);
+    if(atomic_fetch_sub(&barrier->inside, 1) == (BARRIER_DESTROY | 1)) {
+        internal_wake_all(&barrier->waitBarrier);
+    }
+    pthread_mutex_unlock(&barrier->mutexBarrier);
+}
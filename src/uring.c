@@ -0,0 +1,582 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define POOL_URING 1
+#endif
+#endif
+
+#ifdef POOL_URING
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+/**
+ * @note    will remove this later
+ */
+#include <assert.h>
+
+#include "pool.h"
+#include "il.h"
+#include "internal.h"
+
+// submission slots of the ring, a request that finds every slot taken fails with GROUP_FULL
+#define URING_ENTRIES 256
+// threads of the blocking group used when io_uring is not available, on top of the threads of the pool
+#define AIO_THREADS 4
+
+#define AIO_READ 0
+#define AIO_WRITE 1
+#define AIO_FSYNC 2
+
+/**
+ * File requests of a pool.
+ * Requests go to an io_uring instance that a completion thread reaps,
+ * or run with blocking calls in a small group of their own when the kernel has no io_uring.
+ */
+struct Uring {
+    pthread_mutex_t mutexUring;
+    pthread_cond_t condUring;
+
+    // requests that have not been handed to their group yet
+    atomic_size_t inflight;
+    atomic_int stop;
+
+    // group that runs the blocking calls, NULL while the ring is used
+    TGroup *ioGroup;
+
+#ifdef POOL_URING
+    int fd;
+    pthread_t thread;
+
+    void *sqMap;
+    size_t sqSize;
+    void *cqMap;
+    size_t cqSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+
+    _Atomic unsigned *sqHead;
+    _Atomic unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned sqEntries;
+
+    _Atomic unsigned *cqHead;
+    _Atomic unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+#endif
+};
+
+typedef struct AioReq {
+    Uring *u;
+    TGroup *tg;
+
+    int op;
+    int fd;
+    void *buf;
+    size_t len;
+    off_t offset;
+
+    // bytes transferred or -errno
+    ssize_t result;
+
+    aio_func func;
+    void *arg;
+} AioReq;
+
+static int internal_aio_submit(TGroup *tg, int op, int fd, void *buf, size_t len, off_t offset, aio_func func, void *arg);
+static void internal_aio_dispatch(AioReq *req);
+static void internal_aio_done(void *arg);
+static void internal_aio_cancel(void *arg);
+static void internal_aio_blocking(void *arg);
+static void internal_aio_abort(void *arg);
+static void internal_aio_leave(Uring *u);
+
+#ifdef POOL_URING
+static int internal_ring_setup(Uring *u);
+static void internal_ring_teardown(Uring *u);
+static int internal_ring_submit(Uring *u, AioReq *req);
+static int internal_ring_enter(Uring *u);
+static void *uring_thread_function(void *arg);
+#endif
+
+/**
+ * Reads from a file without blocking a worker thread.
+ * Once the read is done func is queued in the group with the bytes read or -errno.
+ *
+ * @param   tg      group the callback runs in
+ * @param   fd      file to read from
+ * @param   buf     receives the data, it has to stay valid until the callback runs
+ * @param   len     bytes to read
+ * @param   offset  position in the file
+ * @param   func    called with the result
+ * @param   arg     passed to func
+ * @return  GROUP_FULL when the ring has no free slot, POOL_ERROR for len above UINT32_MAX
+ */
+int async_read(TGroup *tg, int fd, void *buf, size_t len, off_t offset, aio_func func, void *arg) {
+    return internal_aio_submit(tg, AIO_READ, fd, buf, len, offset, func, arg);
+}
+
+/**
+ * Writes to a file without blocking a worker thread.
+ * Once the write is done func is queued in the group with the bytes written or -errno.
+ *
+ * @param   tg      group the callback runs in
+ * @param   fd      file to write to
+ * @param   buf     data to write, it has to stay valid until the callback runs
+ * @param   len     bytes to write
+ * @param   offset  position in the file
+ * @param   func    called with the result
+ * @param   arg     passed to func
+ * @return  GROUP_FULL when the ring has no free slot, POOL_ERROR for len above UINT32_MAX
+ */
+int async_write(TGroup *tg, int fd, const void *buf, size_t len, off_t offset, aio_func func, void *arg) {
+    return internal_aio_submit(tg, AIO_WRITE, fd, (void *)buf, len, offset, func, arg);
+}
+
+/**
+ * Flushes a file to its device without blocking a worker thread.
+ * Once the flush is done func is queued in the group with 0 or -errno.
+ *
+ * @param   tg      group the callback runs in
+ * @param   fd      file to flush
+ * @param   func    called with the result
+ * @param   arg     passed to func
+ */
+int async_fsync(TGroup *tg, int fd, aio_func func, void *arg) {
+    return internal_aio_submit(tg, AIO_FSYNC, fd, NULL, 0, 0, func, arg);
+}
+
+/*  --Module Hooks--  */
+
+/**
+ * Sets up the ring of a pool, or the blocking group when the ring is not available.
+ */
+Uring *internal_uring_init(TPool *tp) {
+    Uring *u;
+    u = (Uring *)malloc(sizeof(Uring));
+    assert(u != NULL);
+
+    pthread_mutex_init(&u->mutexUring, NULL);
+    pthread_cond_init(&u->condUring, NULL);
+    atomic_init(&u->inflight, 0);
+    atomic_init(&u->stop, 0);
+    u->ioGroup = NULL;
+
+#ifdef POOL_URING
+    if(internal_ring_setup(u) == POOL_SUCCESS) {
+        if(pthread_create(&u->thread, NULL, uring_thread_function, u) == 0) {
+            return u;
+        }
+        internal_ring_teardown(u);
+    }
+    u->fd = -1;
+#endif
+
+    u->ioGroup = internal_reserve_group(tp, 1, AIO_THREADS);
+    if(u->ioGroup == NULL) {
+        pthread_cond_destroy(&u->condUring);
+        pthread_mutex_destroy(&u->mutexUring);
+        free(u);
+        return NULL;
+    }
+
+    return u;
+}
+
+/**
+ * Waits for every request to reach its group then stops the completion thread.
+ * Called before the groups of the pool are destroyed.
+ */
+void internal_uring_stop(Uring *u) {
+    pthread_mutex_lock(&u->mutexUring);
+    atomic_store(&u->stop, 1);
+    while(atomic_load(&u->inflight) > 0) {
+        pthread_cond_wait(&u->condUring, &u->mutexUring);
+    }
+    pthread_mutex_unlock(&u->mutexUring);
+
+#ifdef POOL_URING
+    if(u->ioGroup == NULL) {
+        // a nop wakes the completion thread so it sees the stop
+        AioReq wake;
+        wake.u = NULL;
+        pthread_mutex_lock(&u->mutexUring);
+        while(internal_ring_submit(u, &wake) != POOL_SUCCESS);
+        // the nop has to reach the kernel, the completion thread frees up the room it may be short of
+        while(internal_ring_enter(u) != POOL_SUCCESS) {
+            sched_yield();
+        }
+        pthread_mutex_unlock(&u->mutexUring);
+
+        if(pthread_join(u->thread, NULL) != 0) {
+            assert(0);
+        }
+    }
+#endif
+}
+
+/**
+ * Frees the ring, the blocking group is destroyed with the other groups of the pool.
+ */
+void internal_uring_destroy(Uring *u) {
+#ifdef POOL_URING
+    if(u->ioGroup == NULL) {
+        internal_ring_teardown(u);
+    }
+#endif
+
+    pthread_cond_destroy(&u->condUring);
+    pthread_mutex_destroy(&u->mutexUring);
+    free(u);
+}
+
+/*  --Internal Functions--  */
+
+static int internal_aio_submit(TGroup *tg, int op, int fd, void *buf, size_t len, off_t offset, aio_func func, void *arg) {
+    if(tg == NULL || fd < 0 || func == NULL || (op != AIO_FSYNC && buf == NULL)) {
+        return POOL_ERROR;
+    }
+
+    // a ring entry holds a 32 bit length
+    if(len > UINT32_MAX) {
+        return POOL_ERROR;
+    }
+
+    Uring *u = internal_pool_uring(tg);
+    if(u == NULL || atomic_load(&u->stop)) {
+        return POOL_ERROR;
+    }
+
+    AioReq *req;
+    req = (AioReq *)malloc(sizeof(AioReq));
+    assert(req != NULL);
+
+    req->u = u;
+    req->tg = tg;
+    req->op = op;
+    req->fd = fd;
+    req->buf = buf;
+    req->len = len;
+    req->offset = offset;
+    req->result = 0;
+    req->func = func;
+    req->arg = arg;
+
+    atomic_fetch_add(&u->inflight, 1);
+
+    int rc;
+    if(u->ioGroup != NULL) {
+        Work *work;
+        init_work(&work);
+        add_work(work, internal_aio_blocking, req);
+        add_cancel(work, internal_aio_abort);
+        rc = do_work(u->ioGroup, work);
+        if(rc != POOL_SUCCESS) {
+            free(work);
+        }
+    } else {
+#ifdef POOL_URING
+        pthread_mutex_lock(&u->mutexUring);
+        rc = internal_ring_submit(u, req);
+        pthread_mutex_unlock(&u->mutexUring);
+#else
+        rc = POOL_ERROR;
+#endif
+    }
+
+    if(rc != POOL_SUCCESS) {
+        free(req);
+        internal_aio_leave(u);
+    }
+
+    return rc;
+}
+
+/**
+ * Hands a finished request to its group.
+ * The request was accepted so a full queue does not drop it,
+ * a closing or shedding group has it cancelled on the calling thread as if it had been discarded.
+ */
+static void internal_aio_dispatch(AioReq *req) {
+    Uring *u = req->u;
+    Work *work;
+
+    init_work(&work);
+    add_work(work, internal_aio_done, req);
+    add_cancel(work, internal_aio_cancel);
+
+    int rc = do_work(req->tg, work);
+    if(rc == GROUP_FULL) {
+        internal_requeue(req->tg, work);
+    } else if(rc != POOL_SUCCESS) {
+        free(work);
+        internal_aio_cancel(req);
+    }
+
+    internal_aio_leave(u);
+}
+
+static void internal_aio_done(void *arg) {
+    AioReq *req = (AioReq *)arg;
+
+    req->func(req->result, req->arg);
+    free(req);
+}
+
+/**
+ * The group was shut down before the callback ran, it is told the request was cancelled.
+ */
+static void internal_aio_cancel(void *arg) {
+    AioReq *req = (AioReq *)arg;
+
+    req->func(-ECANCELED, req->arg);
+    free(req);
+}
+
+/**
+ * Runs a request in the blocking group.
+ */
+static void internal_aio_blocking(void *arg) {
+    AioReq *req = (AioReq *)arg;
+    ssize_t rc;
+
+    do {
+        switch(req->op) {
+            case AIO_READ:
+                rc = pread(req->fd, req->buf, req->len, req->offset);
+                break;
+            case AIO_WRITE:
+                rc = pwrite(req->fd, req->buf, req->len, req->offset);
+                break;
+            default:
+                rc = fsync(req->fd);
+                break;
+        }
+    } while(rc < 0 && errno == EINTR);
+
+    req->result = (rc < 0) ? -errno : rc;
+    internal_aio_dispatch(req);
+}
+
+/**
+ * A request taken out of the blocking group before it ran is cancelled where it was taken.
+ * The callback cannot be queued from here so it runs on the cancelling thread.
+ */
+static void internal_aio_abort(void *arg) {
+    AioReq *req = (AioReq *)arg;
+    Uring *u = req->u;
+
+    internal_aio_cancel(req);
+    internal_aio_leave(u);
+}
+
+/**
+ * Counts a request as handed off and wakes the stop that waits for the last one.
+ */
+static void internal_aio_leave(Uring *u) {
+    if(atomic_fetch_sub(&u->inflight, 1) == 1) {
+        pthread_mutex_lock(&u->mutexUring);
+        pthread_cond_broadcast(&u->condUring);
+        pthread_mutex_unlock(&u->mutexUring);
+    }
+}
+
+#ifdef POOL_URING
+
+/**
+ * Maps the rings of a new io_uring instance.
+ * Kernels without IORING_FEAT_RW_CUR_POS predate the read and write opcodes and use the blocking group.
+ */
+static int internal_ring_setup(Uring *u) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    u->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if(u->fd < 0) {
+        return POOL_ERROR;
+    }
+
+    if(!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        close(u->fd);
+        return POOL_ERROR;
+    }
+
+    u->sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    // newer kernels share one mapping between both rings
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(u->cqSize > u->sqSize) {
+            u->sqSize = u->cqSize;
+        }
+        u->cqSize = u->sqSize;
+    }
+
+    u->sqMap = mmap(NULL, u->sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if(u->sqMap == MAP_FAILED) {
+        close(u->fd);
+        return POOL_ERROR;
+    }
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cqMap = u->sqMap;
+    } else {
+        u->cqMap = mmap(NULL, u->cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if(u->cqMap == MAP_FAILED) {
+            munmap(u->sqMap, u->sqSize);
+            close(u->fd);
+            return POOL_ERROR;
+        }
+    }
+
+    u->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if(u->sqes == MAP_FAILED) {
+        if(u->cqMap != u->sqMap) {
+            munmap(u->cqMap, u->cqSize);
+        }
+        munmap(u->sqMap, u->sqSize);
+        close(u->fd);
+        return POOL_ERROR;
+    }
+
+    char *sq = (char *)u->sqMap;
+    u->sqHead = (_Atomic unsigned *)(sq + p.sq_off.head);
+    u->sqTail = (_Atomic unsigned *)(sq + p.sq_off.tail);
+    u->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sqArray = (unsigned *)(sq + p.sq_off.array);
+    u->sqEntries = p.sq_entries;
+
+    char *cq = (char *)u->cqMap;
+    u->cqHead = (_Atomic unsigned *)(cq + p.cq_off.head);
+    u->cqTail = (_Atomic unsigned *)(cq + p.cq_off.tail);
+    u->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return POOL_SUCCESS;
+}
+
+static void internal_ring_teardown(Uring *u) {
+    munmap(u->sqes, u->sqesSize);
+    if(u->cqMap != u->sqMap) {
+        munmap(u->cqMap, u->cqSize);
+    }
+    munmap(u->sqMap, u->sqSize);
+    close(u->fd);
+}
+
+/**
+ * Fills the next submission entry and enters it, the caller holds the ring lock.
+ * A request with no ring is a nop that only wakes the completion thread.
+ *
+ * @return  GROUP_FULL when the submission ring has no room
+ */
+static int internal_ring_submit(Uring *u, AioReq *req) {
+    unsigned head = atomic_load_explicit(u->sqHead, memory_order_acquire);
+    unsigned tail = atomic_load_explicit(u->sqTail, memory_order_relaxed);
+
+    if(tail - head >= u->sqEntries) {
+        return GROUP_FULL;
+    }
+
+    unsigned idx = tail & *u->sqMask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+
+    if(req->u == NULL) {
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = 0;
+    } else {
+        switch(req->op) {
+            case AIO_READ:
+                sqe->opcode = IORING_OP_READ;
+                break;
+            case AIO_WRITE:
+                sqe->opcode = IORING_OP_WRITE;
+                break;
+            default:
+                sqe->opcode = IORING_OP_FSYNC;
+                break;
+        }
+        sqe->fd = req->fd;
+        sqe->addr = (uint64_t)(uintptr_t)req->buf;
+        sqe->len = (uint32_t)req->len;
+        sqe->off = (uint64_t)req->offset;
+        sqe->user_data = (uint64_t)(uintptr_t)req;
+    }
+
+    u->sqArray[idx] = idx;
+    atomic_store_explicit(u->sqTail, tail + 1, memory_order_release);
+
+    // an entry the kernel did not take stays in the ring and goes in with the next submission
+    internal_ring_enter(u);
+    return POOL_SUCCESS;
+}
+
+/**
+ * Hands every entry the kernel has not taken yet to it, the caller holds the ring lock.
+ * Entries left behind by an enter that failed are counted too so the ring never falls behind.
+ *
+ * @return  POOL_ERROR when entries are still left in the ring
+ */
+static int internal_ring_enter(Uring *u) {
+    unsigned tail = atomic_load_explicit(u->sqTail, memory_order_relaxed);
+    unsigned pending;
+
+    while((pending = tail - atomic_load_explicit(u->sqHead, memory_order_acquire)) > 0) {
+        int rc = (int)syscall(__NR_io_uring_enter, u->fd, pending, 0, 0, NULL, 0);
+        if(rc == 0 || (rc < 0 && errno != EINTR)) {
+            return POOL_ERROR;
+        }
+    }
+
+    return POOL_SUCCESS;
+}
+
+/**
+ * Reaps completions and hands the requests to their groups.
+ * Exits once the pool stops and no request is left in the ring.
+ */
+static void *uring_thread_function(void *arg) {
+    Uring *u = (Uring *)arg;
+
+    while(1) {
+        unsigned head = atomic_load_explicit(u->cqHead, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(u->cqTail, memory_order_acquire);
+
+        if(head == tail) {
+            if(atomic_load(&u->stop) && atomic_load(&u->inflight) == 0) {
+                break;
+            }
+
+            syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            continue;
+        }
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cqMask];
+            AioReq *req = (AioReq *)(uintptr_t)cqe->user_data;
+
+            if(req != NULL) {
+                req->result = cqe->res;
+                internal_aio_dispatch(req);
+            }
+        }
+        atomic_store_explicit(u->cqHead, head, memory_order_release);
+    }
+
+    return NULL;
+}
+
+#endif
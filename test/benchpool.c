@@ -5,15 +5,23 @@
 #include <stdlib.h>
 #include <math.h>
 #include <limits.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "pool.h"
 #include "jhs/thpool.h"
+#include "../src/ail.h"
 
 #define BENCH_ITERATIONS 10000
 #define STR_NUM(x) #x
 #define STR(x) STR_NUM(x)
 #define MESSAGE "Mean time for "STR(BENCH_ITERATIONS)" iterations"
 
+#define CONTENTION_TASKS 20000
+#define LIST_ITEMS 200000
+
 void mean_calc(double *mean, double times[], size_t len) {
     double sum = 0;
 
@@ -152,6 +160,45 @@ void multi_threaded_ewan17(int arr[], size_t len) {
     printf("\n");
 }
 
+void range_function(size_t begin, size_t end, void *ctx) {
+    int *arr = (int *)ctx;
+    for (size_t i = begin; i < end; i++) {
+        count_func(arr[i]);
+    }
+}
+
+/**
+ * Same work as multi_threaded_ewan17 but the loop is handed to parallel_for.
+ */
+void parallel_for_ewan17(int arr[], size_t len) {
+    double times[BENCH_ITERATIONS];
+    double mean;
+    double stdev;
+
+    struct timespec start, finish;
+    TPool *pool;
+    init_pool(&pool, 30);
+
+    TGroup *tg;
+    tg = add_group(pool, 30, 30, GROUP_FIXED);
+    assert(tg != NULL);
+
+    for (size_t i = 0; i < BENCH_ITERATIONS; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        parallel_for(tg, 0, len, 1, range_function, arr);
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        times[i] = elapsed_time(start, finish);
+    }
+
+    destroy_pool(pool);
+
+    mean_calc(&mean, times, BENCH_ITERATIONS);
+    std_dev_calc(&stdev, times, BENCH_ITERATIONS, mean);
+    printf("%s (ewan17 parallel_for): %.6f seconds\n", MESSAGE, mean);
+    confidence_interval(mean, stdev, BENCH_ITERATIONS);
+    printf("\n");
+}
+
 void multi_threaded_jhs(int arr[], size_t len) {
     double times[BENCH_ITERATIONS];
     double mean;
@@ -178,6 +225,370 @@ void multi_threaded_jhs(int arr[], size_t len) {
     printf("\n");
 }
 
+/*  --Contention--  */
+
+typedef struct Layout {
+    size_t numGroups;
+    unsigned int min;
+    unsigned int max;
+    unsigned int shards;
+} Layout;
+
+typedef struct Producer {
+    pthread_t id;
+
+    TGroup *tg;
+    size_t numTasks;
+    // tasks staged per flush, 0 submits straight to the group
+    unsigned int batch;
+
+    // latency of every do_work call made by this producer
+    double *latency;
+    size_t rejected;
+
+    struct timespec finish;
+} Producer;
+
+static atomic_size_t tasksDone;
+static atomic_int producersGo;
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Empty task so the bench only measures the pool overhead.
+ */
+void empty_function(void *arg) {
+    (void)arg;
+    atomic_fetch_add_explicit(&tasksDone, 1, memory_order_relaxed);
+}
+
+void *producer_function(void *arg) {
+    Producer *p = (Producer *)arg;
+    struct timespec start, finish;
+
+    if(p->batch > 0) {
+        int rc = register_producer(p->tg, p->batch, 50);
+        assert(rc == POOL_SUCCESS);
+    }
+
+    while(!atomic_load(&producersGo)) {
+        sched_yield();
+    }
+
+    for (size_t i = 0; i < p->numTasks; i++) {
+        Work *work;
+        int rc;
+
+        init_work(&work);
+        add_work(work, empty_function, NULL);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while((rc = do_work(p->tg, work)) == GROUP_FULL) {
+            p->rejected++;
+            sched_yield();
+        }
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        assert(rc == POOL_SUCCESS);
+
+        p->latency[i] = elapsed_time(start, finish);
+    }
+
+    if(p->batch > 0) {
+        while(flush_work(p->tg) == GROUP_FULL) {
+            p->rejected++;
+            sched_yield();
+        }
+        unregister_producer(p->tg);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &p->finish);
+
+    return NULL;
+}
+
+/**
+ * Many producer threads submitting tiny tasks into the same groups.
+ * Producers are spread round robin across the groups of the layout.
+ * 
+ * @param   numProducers    number of threads calling do_work concurrently
+ * @param   layout          number of groups and the thread limits of each group
+ * @param   batch           producer buffer size, 0 to submit without a buffer
+ */
+void multi_producer_ewan17(size_t numProducers, Layout layout, unsigned int batch) {
+    struct timespec start, submitted, finish;
+    TPool *pool;
+    int rc;
+
+    rc = init_pool(&pool, layout.numGroups * layout.max);
+    assert(rc == POOL_SUCCESS);
+
+    GroupAttr attr;
+    init_group_attr(&attr);
+    attr.shards = layout.shards;
+
+    TGroup *tg[layout.numGroups];
+    for (size_t i = 0; i < layout.numGroups; i++) {
+        tg[i] = add_group_attr(pool, layout.min, layout.max, GROUP_DYNAMIC, &attr);
+        assert(tg[i] != NULL);
+    }
+
+    Producer producers[numProducers];
+    size_t total = numProducers * CONTENTION_TASKS;
+    double *latency = (double *)malloc(total * sizeof(double));
+    assert(latency != NULL);
+
+    atomic_store(&tasksDone, 0);
+    atomic_store(&producersGo, 0);
+    for (size_t i = 0; i < numProducers; i++) {
+        Producer *p = &producers[i];
+        p->tg = tg[i % layout.numGroups];
+        p->numTasks = CONTENTION_TASKS;
+        p->batch = batch;
+        p->latency = &latency[i * CONTENTION_TASKS];
+        p->rejected = 0;
+
+        rc = pthread_create(&p->id, NULL, producer_function, p);
+        assert(rc == 0);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    atomic_store(&producersGo, 1);
+
+    size_t rejected = 0;
+    submitted = start;
+    for (size_t i = 0; i < numProducers; i++) {
+        Producer *p = &producers[i];
+        pthread_join(p->id, NULL);
+        if(elapsed_time(submitted, p->finish) > 0) {
+            submitted = p->finish;
+        }
+        rejected += p->rejected;
+    }
+
+    while(atomic_load(&tasksDone) < total) {
+        sched_yield();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+
+    destroy_pool(pool);
+
+    double mean;
+    qsort(latency, total, sizeof(double), cmp_double);
+    mean_calc(&mean, latency, total);
+
+    printf("producers %2zu, groups %2zu (%u-%u thrds, %u shards), batch %3u: ", numProducers, layout.numGroups, layout.min, layout.max, layout.shards, batch);
+    printf("%.0f submits/sec, %.0f tasks/sec, ", total / elapsed_time(start, submitted), total / elapsed_time(start, finish));
+    printf("latency mean %.2fus p50 %.2fus p99 %.2fus max %.2fus, %zu full\n",
+        mean * 1e6, latency[total / 2] * 1e6, latency[(total * 99) / 100] * 1e6, latency[total - 1] * 1e6, rejected);
+
+    free(latency);
+}
+
+void contention(void) {
+    size_t producerCounts[] = {1, 2, 4, 8, 16, 32};
+    Layout layouts[] = {
+        {1, 4, 8, 1},
+        {1, 4, 8, 8},
+        {4, 2, 2, 1},
+        {8, 1, 4, 1},
+    };
+
+    printf("Contention with %d tasks per producer\n", CONTENTION_TASKS);
+    for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+        for (size_t j = 0; j < sizeof(producerCounts) / sizeof(producerCounts[0]); j++) {
+            multi_producer_ewan17(producerCounts[j], layouts[i], 0);
+        }
+        printf("\n");
+    }
+
+    // same producers with thread local buffers
+    for (size_t j = 0; j < sizeof(producerCounts) / sizeof(producerCounts[0]); j++) {
+        multi_producer_ewan17(producerCounts[j], layouts[0], 64);
+    }
+    printf("\n");
+}
+
+/*  --Lock Free Lists--  */
+
+typedef struct Node {
+    IL move;
+    AIL link;
+} Node;
+
+typedef struct Lists {
+    // locked list and lock free variants, one of them is used per run
+    pthread_mutex_t mutex;
+    LL list;
+    AQ q;
+    AS s;
+    int lockFree;
+
+    Node *nodes;
+    size_t numItems;
+} Lists;
+
+static atomic_int listsGo;
+// next free node for a producer
+static atomic_size_t listsNext;
+
+static void *list_producer(void *arg) {
+    Lists *l = (Lists *)arg;
+    size_t base = atomic_fetch_add(&listsNext, l->numItems);
+
+    while(!atomic_load(&listsGo)) {
+        sched_yield();
+    }
+
+    for (size_t i = 0; i < l->numItems; i++) {
+        Node *node = &l->nodes[base + i];
+        if(l->lockFree) {
+            aq_push(&l->q, &node->link);
+        } else {
+            pthread_mutex_lock(&l->mutex);
+            list_append(&l->list, &node->move);
+            pthread_mutex_unlock(&l->mutex);
+        }
+    }
+
+    return NULL;
+}
+
+static void *list_churn(void *arg) {
+    Lists *l = (Lists *)arg;
+
+    while(!atomic_load(&listsGo)) {
+        sched_yield();
+    }
+
+    for (size_t i = 0; i < l->numItems; i++) {
+        if(l->lockFree) {
+            AIL *ail;
+            while((ail = as_pop(&l->s)) == NULL);
+            as_push(&l->s, ail);
+        } else {
+            IL *il;
+            pthread_mutex_lock(&l->mutex);
+            il = list_pop(&l->list);
+            pthread_mutex_unlock(&l->mutex);
+
+            pthread_mutex_lock(&l->mutex);
+            list_append(&l->list, il);
+            pthread_mutex_unlock(&l->mutex);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Producers push into a queue drained by a single consumer, locked list against the lock free queue.
+ */
+void queue_lists(size_t numProducers, int lockFree) {
+    struct timespec start, finish;
+    pthread_t thrds[numProducers];
+    Lists l;
+
+    pthread_mutex_init(&l.mutex, NULL);
+    init_list(&l.list);
+    init_aq(&l.q);
+    l.lockFree = lockFree;
+    l.numItems = LIST_ITEMS;
+    l.nodes = (Node *)malloc(numProducers * LIST_ITEMS * sizeof(Node));
+    assert(l.nodes != NULL);
+
+    atomic_store(&listsNext, 0);
+    atomic_store(&listsGo, 0);
+    for (size_t i = 0; i < numProducers; i++) {
+        pthread_create(&thrds[i], NULL, list_producer, &l);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    atomic_store(&listsGo, 1);
+
+    size_t total = numProducers * LIST_ITEMS;
+    size_t popped = 0;
+    while(popped < total) {
+        if(lockFree) {
+            popped += (aq_pop(&l.q) != NULL);
+        } else {
+            pthread_mutex_lock(&l.mutex);
+            popped += (list_pop(&l.list) != NULL);
+            pthread_mutex_unlock(&l.mutex);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+
+    for (size_t i = 0; i < numProducers; i++) {
+        pthread_join(thrds[i], NULL);
+    }
+
+    printf("queue %s, producers %2zu: %.0f items/sec\n", lockFree ? "lock free" : "locked   ", numProducers, total / elapsed_time(start, finish));
+
+    free(l.nodes);
+    pthread_mutex_destroy(&l.mutex);
+}
+
+/**
+ * Threads take an item from a shared free list and give it back, locked list against the lock free stack.
+ */
+void free_lists(size_t numThrds, int lockFree) {
+    struct timespec start, finish;
+    pthread_t thrds[numThrds];
+    Lists l;
+
+    pthread_mutex_init(&l.mutex, NULL);
+    init_list(&l.list);
+    init_as(&l.s);
+    l.lockFree = lockFree;
+    l.numItems = LIST_ITEMS;
+    l.nodes = (Node *)malloc(numThrds * sizeof(Node));
+    assert(l.nodes != NULL);
+
+    // one item per thread so nobody waits for an item
+    for (size_t i = 0; i < numThrds; i++) {
+        init_il(&l.nodes[i].move);
+        list_append(&l.list, &l.nodes[i].move);
+        as_push(&l.s, &l.nodes[i].link);
+    }
+
+    atomic_store(&listsGo, 0);
+    for (size_t i = 0; i < numThrds; i++) {
+        pthread_create(&thrds[i], NULL, list_churn, &l);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    atomic_store(&listsGo, 1);
+    for (size_t i = 0; i < numThrds; i++) {
+        pthread_join(thrds[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+
+    printf("free list %s, threads %2zu: %.0f takes/sec\n", lockFree ? "lock free" : "locked   ", numThrds, (numThrds * LIST_ITEMS) / elapsed_time(start, finish));
+
+    free(l.nodes);
+    pthread_mutex_destroy(&l.mutex);
+}
+
+void lists(void) {
+    size_t thrdCounts[] = {1, 2, 4, 8};
+
+    printf("Lists with %d items per thread\n", LIST_ITEMS);
+    for (size_t i = 0; i < sizeof(thrdCounts) / sizeof(thrdCounts[0]); i++) {
+        queue_lists(thrdCounts[i], 0);
+        queue_lists(thrdCounts[i], 1);
+    }
+    printf("\n");
+
+    for (size_t i = 0; i < sizeof(thrdCounts) / sizeof(thrdCounts[0]); i++) {
+        free_lists(thrdCounts[i], 0);
+        free_lists(thrdCounts[i], 1);
+    }
+    printf("\n");
+}
+
 int main(int argc, char *argv[]) {
     /**
      * @todo    better to read the possible scenarios from an input file
@@ -197,9 +608,22 @@ int main(int argc, char *argv[]) {
                             ,1000000,1000000,1000000,1000000,1000000,1000000,1000000,1000000,1000000,1000000,1000000,1000000,1000000,1000000,1000000,1000000,1000000,1000000,1000000,1000000};
     size_t len = 80;
 
+    // only run the contention bench with "./benchpool contention"
+    if(argc > 1 && strcmp(argv[1], "contention") == 0) {
+        contention();
+        return 0;
+    }
+
+    // only run the list bench with "./benchpool lists"
+    if(argc > 1 && strcmp(argv[1], "lists") == 0) {
+        lists();
+        return 0;
+    }
+
     // single_threaded(arr, len);
     multi_threaded_jhs(arr, len);
     multi_threaded_ewan17(arr, len);
+    parallel_for_ewan17(arr, len);
 
     return 0;
 }
\ No newline at end of file
@@ -1,12 +1,222 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include "pool.h"
+#include "../src/ail.h"
 
 static TPool *init_test(unsigned int thrds);
 static void destroy_test(TPool *tp);
 
 static void thread_func(void *arg);
+static void count_func(void *arg);
+static void wait_count(atomic_size_t *count, size_t expected);
+static size_t drain_test(TCompQ *cq, size_t expected);
+static void *submit_func(void *arg);
+static void mark_func(size_t begin, size_t end, void *ctx);
+static void sum_identity(void *acc, void *ctx);
+static void sum_accumulate(void *acc, size_t begin, size_t end, void *ctx);
+static void sum_combine(void *acc, const void *other, void *ctx);
+static void square_func(const void *in, void *out, void *ctx);
+static void stage_func(void *arg);
+static void fib_func(void *arg);
+static void gate_func(void *arg);
+static void held_func(void *arg);
+static void ping_func(void *arg);
+static void pong_func(void *arg);
+static void read_func(int fd, int events, void *arg);
+static void hold_func(int fd, int events, void *arg);
+static void aio_func_test(ssize_t result, void *arg);
+static void block_func(void *arg);
+static void cpu_func(void *arg);
+static void attr_func(void *arg);
+static void policy_func(void *arg);
+static void sleep_func(void *arg);
+static void spin_func(void *arg);
+static uint64_t now_ms(void);
+static void *shutdown_func(void *arg);
+static void serial_func(void *arg);
+static void phase_func(void *arg);
+static void meet_func(void *arg);
+static void *waiter_func(void *arg);
+static void busy_func(void *arg);
+static void probe_func(void *arg);
+static void request_func(void *arg);
+static void request_done(void *arg);
+static void *push_func(void *arg);
+static void *churn_func(void *arg);
+
+typedef struct Fib {
+    TGroup *tg;
+    unsigned int n;
+    size_t result;
+} Fib;
+
+typedef struct Stage {
+    atomic_size_t *clock;
+    // value of the clock when this stage ran
+    size_t ran;
+} Stage;
+
+typedef struct Gate {
+    TLatch *started;
+    TLatch *open;
+    atomic_size_t *count;
+} Gate;
+
+// holds its worker without telling the pool, so the worker keeps its batch
+typedef struct Hold {
+    TLatch *started;
+    atomic_int open;
+} Hold;
+
+typedef struct Pipe {
+    TChan *chan;
+    size_t len;
+    size_t sum;
+} Pipe;
+
+typedef struct Reader {
+    atomic_size_t bytes;
+    // callbacks of one descriptor never overlap
+    atomic_int inside;
+    // read one byte for each callback instead of draining the descriptor
+    int single;
+} Reader;
+
+typedef struct Transfer {
+    atomic_size_t bytes;
+    atomic_size_t done;
+    // set by a request that failed
+    atomic_int failed;
+} Transfer;
+
+typedef struct Blocker {
+    // the blocked tasks wait till the other tasks are done
+    atomic_size_t *count;
+    size_t expected;
+    atomic_size_t blocked;
+} Blocker;
+
+typedef struct Placement {
+    atomic_size_t count;
+    // set by a task that ran outside of the cpus of its group
+    atomic_int misplaced;
+    int cpu;
+} Placement;
+
+typedef struct Sched {
+    atomic_size_t count;
+    // set by a task whose thread does not have the attributes of its group
+    atomic_int wrong;
+    const char *name;
+    int policy;
+    int nice;
+    size_t stackSize;
+} Sched;
+
+typedef struct Shutdown {
+    TGroup *tg;
+    int mode;
+    unsigned int timeoutMs;
+} Shutdown;
+
+typedef struct Serial {
+    atomic_size_t *count;
+    // tasks of one key never overlap
+    atomic_int inside;
+    size_t next;
+    // set by a task that ran out of order or next to another task of its key
+    atomic_int wrong;
+} Serial;
+
+typedef struct Step {
+    Serial *serial;
+    size_t seq;
+} Step;
+
+typedef struct Phases {
+    TBarrier *barrier;
+    size_t tasks;
+    size_t phases;
+    atomic_size_t arrived;
+    atomic_size_t last;
+    // set by a task that left a phase before every task arrived
+    atomic_int early;
+    atomic_size_t *count;
+} Phases;
+
+typedef struct Meet {
+    // freed by the task that arrives last
+    TBarrier *barrier;
+    atomic_size_t *count;
+} Meet;
+
+typedef struct Waiter {
+    TPool *tp;
+    // counted down by each waiter right before it waits
+    TLatch *ready;
+    atomic_size_t *done;
+} Waiter;
+
+typedef struct Busy {
+    // tasks running at once and the most seen
+    atomic_size_t running;
+    atomic_size_t most;
+    atomic_size_t count;
+} Busy;
+
+typedef struct Probe {
+    TGroup *tg;
+    // queue length seen by the task
+    size_t queued;
+} Probe;
+
+typedef struct Request {
+    // the work of the request lives next to its data
+    WorkSlot slot;
+    atomic_size_t *ran;
+    atomic_size_t *done;
+} Request;
+
+typedef struct Item {
+    AIL move;
+    size_t producer;
+    size_t seq;
+    size_t uses;
+} Item;
+
+typedef struct Pusher {
+    AQ *q;
+    Item *items;
+    size_t numItems;
+} Pusher;
+
+typedef struct Churner {
+    AS *s;
+    size_t rounds;
+} Churner;
+
+typedef struct Submitter {
+    TGroup *tg;
+    atomic_size_t *count;
+    size_t len;
+} Submitter;
 
 void init_pool_test(unsigned int thrds) {
     TPool *tp;
@@ -112,34 +322,2409 @@ void heavy_test() {
     destroy_test(tp);
 }
 
-int main(int argc, char *argv[]) {
-    init_pool_test(8);
-    add_group_test();
-    add_work_test();
-    add_work_test2();
-    heavy_test();
-    return 0;    
+void producer_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    TGroup *tg;
+    tg = add_group(tp, 2, 4, GROUP_DYNAMIC);
+
+    atomic_size_t count = 0;
+    int rc;
+
+    rc = register_producer(tg, 8, 100);
+    assert(rc == 0);
+    // a thread can only have one buffer per group
+    rc = register_producer(tg, 8, 100);
+    assert(rc != 0);
+
+    // the last few tasks are left for the manager to flush
+    size_t len = 100;
+    for (size_t i = 0; i < len; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, count_func, &count);
+
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+    wait_count(&count, len);
+
+    for (size_t i = 0; i < len; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, count_func, &count);
+
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+    rc = flush_work(tg);
+    assert(rc == 0);
+    wait_count(&count, 2 * len);
+
+    unregister_producer(tg);
+    destroy_test(tp);
 }
 
-static void thread_func(void *arg) {
-    int sum = 0;
-    for (int i = 0; i < 1000000; i++)
-    {
-        sum++;
+void sharded_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    GroupAttr attr;
+    init_group_attr(&attr);
+    attr.shards = 4;
+
+    TGroup *tg;
+    tg = add_group_attr(tp, 2, 4, GROUP_DYNAMIC, &attr);
+    assert(tg != NULL);
+
+    atomic_size_t count = 0;
+    size_t numSubmitters = 4;
+    pthread_t ids[numSubmitters];
+    Submitter sub = {tg, &count, 100};
+
+    for (size_t i = 0; i < numSubmitters; i++) {
+        int rc = pthread_create(&ids[i], NULL, submit_func, &sub);
+        assert(rc == 0);
     }
-    assert(sum == 1000000);
+    for (size_t i = 0; i < numSubmitters; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    wait_count(&count, numSubmitters * sub.len);
+
+    destroy_test(tp);
 }
 
-static TPool *init_test(unsigned int thrds) {
+void parallel_for_test() {
     TPool *tp;
+    tp = init_test(8);
+
+    TGroup *tg;
+    tg = add_group(tp, 2, 4, GROUP_DYNAMIC);
+
+    size_t len = 100000;
+    unsigned char *marks = calloc(len, 1);
+    assert(marks != NULL);
+
     int rc;
+    rc = parallel_for(tg, 0, len, 64, mark_func, marks);
+    assert(rc == 0);
+    for (size_t i = 0; i < len; i++) {
+        assert(marks[i] == 1);
+    }
 
-    rc = init_pool(&tp, thrds);
+    // empty ranges and single chunks do not touch the group
+    rc = parallel_for(tg, 10, 10, 64, mark_func, marks);
     assert(rc == 0);
+    rc = parallel_for(tg, 0, 10, 64, mark_func, marks);
+    assert(rc == 0);
+    assert(marks[0] == 2 && marks[10] == 1);
 
-    return tp;
+    free(marks);
+    destroy_test(tp);
 }
 
-static void destroy_test(TPool *tp) {
-    destroy_pool(tp);
-}
\ No newline at end of file
+void parallel_reduce_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    TGroup *tg;
+    tg = add_group(tp, 2, 4, GROUP_DYNAMIC);
+
+    size_t len = 100000;
+    size_t *in = malloc(len * sizeof(size_t));
+    size_t *out = malloc(len * sizeof(size_t));
+    assert(in != NULL && out != NULL);
+    for (size_t i = 0; i < len; i++) {
+        in[i] = i;
+    }
+
+    int rc;
+    rc = parallel_map(tg, in, out, len, sizeof(size_t), sizeof(size_t), 128, square_func, NULL);
+    assert(rc == 0);
+    for (size_t i = 0; i < len; i++) {
+        assert(out[i] == i * i);
+    }
+
+    Reducer red = {sizeof(size_t), sum_identity, sum_accumulate, sum_combine};
+    size_t sum;
+    rc = parallel_reduce(tg, 0, len, 128, &red, in, &sum);
+    assert(rc == 0);
+    assert(sum == len * (len - 1) / 2);
+
+    // an empty range reduces to the identity
+    rc = parallel_reduce(tg, 5, 5, 128, &red, in, &sum);
+    assert(rc == 0 && sum == 0);
+
+    free(in);
+    free(out);
+    destroy_test(tp);
+}
+
+void graph_test() {
+    TPool *tp;
+    tp = init_test(9);
+
+    TGroup *tg1, *tg2;
+    tg1 = add_group(tp, 2, 4, GROUP_DYNAMIC);
+    tg2 = add_group(tp, 2, 4, GROUP_DYNAMIC);
+
+    TGraph *graph;
+    int rc;
+    rc = init_graph(&graph);
+    assert(rc == 0);
+
+    // diamond: extract -> (left, right) -> load, the middle stages run in another group
+    atomic_size_t clock = 0;
+    Stage stages[4];
+    for (size_t i = 0; i < 4; i++) {
+        stages[i].clock = &clock;
+        stages[i].ran = 0;
+    }
+
+    TNode *extract, *left, *right, *load;
+    extract = add_node(graph, tg1, stage_func, &stages[0], NULL, 0);
+    left = add_node(graph, tg2, stage_func, &stages[1], &extract, 1);
+    right = add_node(graph, tg1, stage_func, &stages[2], &extract, 1);
+    TNode *preds[] = {left, right};
+    load = add_node(graph, tg1, stage_func, &stages[3], preds, 2);
+    assert(extract != NULL && left != NULL && right != NULL && load != NULL);
+
+    for (size_t run = 0; run < 2; run++) {
+        rc = run_graph(graph);
+        assert(rc == 0);
+        wait_graph(graph);
+
+        assert(stages[0].ran < stages[1].ran && stages[0].ran < stages[2].ran);
+        assert(stages[1].ran < stages[3].ran && stages[2].ran < stages[3].ran);
+    }
+
+    destroy_graph(graph);
+
+    // a node discarded by a shutdown is skipped with the nodes after it and the run still finishes
+    TGroup *tg3;
+    tg3 = add_group(tp, 1, 1, GROUP_FIXED);
+    assert(tg3 != NULL);
+
+    atomic_size_t gated;
+    atomic_init(&gated, 0);
+    Gate gate = {NULL, NULL, &gated};
+    rc = init_latch(&gate.started, 1);
+    assert(rc == 0);
+    rc = init_latch(&gate.open, 1);
+    assert(rc == 0);
+
+    Work *work;
+    init_work(&work);
+    add_work(work, gate_func, &gate);
+    rc = do_work(tg3, work);
+    assert(rc == 0);
+    latch_wait(gate.started);
+
+    rc = init_graph(&graph);
+    assert(rc == 0);
+    for (size_t i = 0; i < 3; i++) {
+        stages[i].ran = 0;
+    }
+
+    TNode *dropped, *kept, *after;
+    dropped = add_node(graph, tg3, stage_func, &stages[0], NULL, 0);
+    kept = add_node(graph, tg1, stage_func, &stages[1], NULL, 0);
+    TNode *both[] = {dropped, kept};
+    after = add_node(graph, tg1, stage_func, &stages[2], both, 2);
+    assert(dropped != NULL && kept != NULL && after != NULL);
+
+    rc = run_graph(graph);
+    assert(rc == 0);
+
+    // the shutdown discards the queued node then waits for the gate
+    Shutdown shutdown = {tg3, SHUTDOWN_DISCARD, 0};
+    pthread_t thrd;
+    pthread_create(&thrd, NULL, shutdown_func, &shutdown);
+
+    wait_graph(graph);
+    assert(stages[0].ran == 0 && stages[1].ran != 0 && stages[2].ran == 0);
+
+    // the closing group turns new nodes away, they are skipped instead of run on the caller
+    TGraph *closed;
+    rc = init_graph(&closed);
+    assert(rc == 0);
+    for (size_t i = 0; i < 2; i++) {
+        stages[i].ran = 0;
+    }
+
+    TNode *refused, *behind;
+    refused = add_node(closed, tg3, stage_func, &stages[0], NULL, 0);
+    behind = add_node(closed, tg1, stage_func, &stages[1], &refused, 1);
+    assert(refused != NULL && behind != NULL);
+
+    rc = run_graph(closed);
+    assert(rc == 0);
+    wait_graph(closed);
+    assert(stages[0].ran == 0 && stages[1].ran == 0);
+    destroy_graph(closed);
+
+    latch_count_down(gate.open);
+    pthread_join(thrd, NULL);
+
+    destroy_graph(graph);
+    destroy_latch(gate.started);
+    destroy_latch(gate.open);
+
+    // the nodes of a full group run on the caller in order
+    GroupAttr attr;
+    init_group_attr(&attr);
+    attr.capacity = 1;
+
+    TGroup *tg4;
+    tg4 = add_group_attr(tp, 1, 1, GROUP_FIXED, &attr);
+    assert(tg4 != NULL);
+
+    rc = init_latch(&gate.started, 1);
+    assert(rc == 0);
+    rc = init_latch(&gate.open, 1);
+    assert(rc == 0);
+
+    init_work(&work);
+    add_work(work, gate_func, &gate);
+    rc = do_work(tg4, work);
+    assert(rc == 0);
+    latch_wait(gate.started);
+
+    atomic_size_t count;
+    atomic_init(&count, 0);
+    init_work(&work);
+    add_work(work, count_func, &count);
+    rc = do_work(tg4, work);
+    assert(rc == 0);
+
+    rc = init_graph(&graph);
+    assert(rc == 0);
+    for (size_t i = 0; i < 3; i++) {
+        stages[i].ran = 0;
+    }
+
+    TNode *chain[3];
+    chain[0] = add_node(graph, tg4, stage_func, &stages[0], NULL, 0);
+    chain[1] = add_node(graph, tg4, stage_func, &stages[1], &chain[0], 1);
+    chain[2] = add_node(graph, tg4, stage_func, &stages[2], &chain[1], 1);
+    assert(chain[0] != NULL && chain[1] != NULL && chain[2] != NULL);
+
+    rc = run_graph(graph);
+    assert(rc == 0);
+    assert(stages[0].ran != 0 && stages[0].ran < stages[1].ran && stages[1].ran < stages[2].ran);
+    wait_graph(graph);
+
+    latch_count_down(gate.open);
+    wait_count(&count, 1);
+
+    destroy_graph(graph);
+    destroy_latch(gate.started);
+    destroy_latch(gate.open);
+    destroy_test(tp);
+}
+
+void join_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    // every level of the recursion waits inside a task, only two threads are available
+    TGroup *tg;
+    tg = add_group(tp, 2, 2, GROUP_FIXED);
+
+    TJoin *join;
+    int rc;
+    rc = init_join(&join);
+    assert(rc == 0);
+
+    Fib fib = {tg, 15, 0};
+    Work *work;
+    init_work(&work);
+    add_work(work, fib_func, &fib);
+
+    rc = join_work(join, tg, work);
+    assert(rc == 0);
+    wait_join(join);
+    assert(fib.result == 610);
+
+    destroy_join(join);
+    destroy_test(tp);
+}
+
+void fiber_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    // a single thread has to keep every waiting task alive
+    GroupAttr attr;
+    init_group_attr(&attr);
+    attr.fiberStack = 64 * 1024;
+
+    TGroup *tg;
+    tg = add_group_attr(tp, 1, 1, GROUP_FIXED, &attr);
+    assert(tg != NULL);
+
+    size_t tasks = 100;
+    atomic_size_t count;
+    atomic_init(&count, 0);
+
+    Gate gate = {NULL, NULL, &count};
+    int rc;
+    rc = init_latch(&gate.started, tasks);
+    assert(rc == 0);
+    rc = init_latch(&gate.open, 1);
+    assert(rc == 0);
+
+    for (size_t i = 0; i < tasks; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, gate_func, &gate);
+
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+
+    // every task is suspended on the closed latch at the same time
+    latch_wait(gate.started);
+    assert(atomic_load(&count) == 0);
+    latch_count_down(gate.open);
+    wait_count(&count, tasks);
+
+    destroy_latch(gate.open);
+    destroy_latch(gate.started);
+
+    // sender and receiver take turns on the thread through a channel of one item
+    Pipe pipe = {NULL, 1000, 0};
+    rc = init_chan(&pipe.chan, 1);
+    assert(rc == 0);
+
+    TJoin *join;
+    rc = init_join(&join);
+    assert(rc == 0);
+
+    Work *work;
+    init_work(&work);
+    add_work(work, pong_func, &pipe);
+    rc = join_work(join, tg, work);
+    assert(rc == 0);
+
+    init_work(&work);
+    add_work(work, ping_func, &pipe);
+    rc = join_work(join, tg, work);
+    assert(rc == 0);
+
+    wait_join(join);
+    assert(pipe.sum == pipe.len * (pipe.len + 1) / 2);
+    destroy_chan(pipe.chan);
+
+    // joins suspend the waiting task too
+    Fib fib = {tg, 12, 0};
+    init_work(&work);
+    add_work(work, fib_func, &fib);
+    rc = join_work(join, tg, work);
+    assert(rc == 0);
+    wait_join(join);
+    assert(fib.result == 144);
+    destroy_join(join);
+
+    // the group keeps its thread while tasks are suspended on a latch, they finish before it is gone
+    atomic_size_t parked;
+    atomic_init(&parked, 0);
+    Gate hold = {NULL, NULL, &parked};
+    rc = init_latch(&hold.started, 10);
+    assert(rc == 0);
+    rc = init_latch(&hold.open, 1);
+    assert(rc == 0);
+
+    for (int i = 0; i < 10; i++) {
+        init_work(&work);
+        add_work(work, gate_func, &hold);
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+    latch_wait(hold.started);
+
+    Shutdown shutdown = {tg, SHUTDOWN_DISCARD, 0};
+    pthread_t closer;
+    rc = pthread_create(&closer, NULL, shutdown_func, &shutdown);
+    assert(rc == 0);
+    usleep(20000);
+    latch_count_down(hold.open);
+    pthread_join(closer, NULL);
+    assert(atomic_load(&parked) == 10);
+
+    destroy_latch(hold.open);
+    destroy_latch(hold.started);
+
+    // stacks below 16 KiB are turned down
+    attr.fiberStack = 4096;
+    assert(add_group_attr(tp, 1, 1, GROUP_FIXED, &attr) == NULL);
+
+    destroy_test(tp);
+}
+
+void reactor_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    TGroup *tg;
+    tg = add_group(tp, 4, 4, GROUP_FIXED);
+
+    // level triggered, the descriptor stays ready until every byte is read one at a time
+    int sv[2];
+    int rc;
+    rc = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    assert(rc == 0);
+
+    Reader level;
+    atomic_init(&level.bytes, 0);
+    atomic_init(&level.inside, 0);
+    level.single = 1;
+
+    TWatch *w;
+    w = watch_fd(tg, sv[0], IO_READ, read_func, &level);
+    assert(w != NULL);
+
+    char buf[100] = {0};
+    assert(write(sv[1], buf, sizeof(buf)) == sizeof(buf));
+    wait_count(&level.bytes, sizeof(buf));
+
+    unwatch_fd(w);
+
+    // unwatching waits for a callback that is still running
+    atomic_size_t held;
+    atomic_init(&held, 0);
+    Gate gate = {NULL, NULL, &held};
+    rc = init_latch(&gate.started, 1);
+    assert(rc == 0);
+
+    w = watch_fd(tg, sv[0], IO_READ, hold_func, &gate);
+    assert(w != NULL);
+    assert(write(sv[1], buf, 1) == 1);
+    latch_wait(gate.started);
+    unwatch_fd(w);
+    assert(atomic_load(&held) == 1);
+    destroy_latch(gate.started);
+
+    close(sv[0]);
+    close(sv[1]);
+
+    // edge triggered, every callback drains the pipe
+    int fds[2];
+    rc = pipe(fds);
+    assert(rc == 0);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+    Reader edge;
+    atomic_init(&edge.bytes, 0);
+    atomic_init(&edge.inside, 0);
+    edge.single = 0;
+
+    w = watch_fd(tg, fds[0], IO_READ | IO_EDGE, read_func, &edge);
+    assert(w != NULL);
+
+    for (int i = 0; i < 50; i++) {
+        assert(write(fds[1], buf, sizeof(buf)) == sizeof(buf));
+    }
+    wait_count(&edge.bytes, 50 * sizeof(buf));
+
+    // left watched so the pool frees it
+    close(fds[1]);
+    destroy_test(tp);
+    close(fds[0]);
+}
+
+void compq_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    // a small ring so most completions go through the overflow list
+    TCompQ *cq;
+    int rc;
+    rc = init_compq(&cq, 16);
+    assert(rc == 0);
+
+    TGroup *tg;
+    tg = add_group(tp, 4, 4, GROUP_FIXED);
+
+    atomic_size_t count;
+    atomic_init(&count, 0);
+
+    size_t tasks = 150;
+    for (size_t i = 1; i <= tasks; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, count_func, &count);
+
+        rc = compq_work(cq, tg, work, (void *)i);
+        assert(rc == 0);
+    }
+    assert(drain_test(cq, tasks) == tasks * (tasks + 1) / 2);
+
+    // every task of the group posts with its work arg as the tag
+    GroupAttr attr;
+    init_group_attr(&attr);
+    attr.compq = cq;
+
+    TGroup *tg2;
+    tg2 = add_group_attr(tp, 2, 2, GROUP_FIXED, &attr);
+    assert(tg2 != NULL);
+
+    for (size_t i = 0; i < 10; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, count_func, &count);
+
+        rc = do_work(tg2, work);
+        assert(rc == 0);
+    }
+    assert(drain_test(cq, 10) == 10 * (size_t)&count);
+    assert(atomic_load(&count) == tasks + 10);
+
+    destroy_test(tp);
+    destroy_compq(cq);
+}
+
+void aio_test() {
+    TPool *tp;
+    tp = init_test(2);
+
+    // the group takes every thread, the blocking file threads come on top of them
+    TGroup *tg;
+    tg = add_group(tp, 2, 2, GROUP_FIXED);
+    assert(tg != NULL);
+
+    char path[] = "/tmp/testpoolXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+
+    size_t blocks = 16;
+    size_t size = 4096;
+    char *out = (char *)malloc(blocks * size);
+    char *in = (char *)calloc(blocks, size);
+    assert(out != NULL && in != NULL);
+    for (size_t i = 0; i < blocks * size; i++) {
+        out[i] = (char)(i * 31);
+    }
+
+    Transfer t;
+    atomic_init(&t.bytes, 0);
+    atomic_init(&t.done, 0);
+    atomic_init(&t.failed, 0);
+
+    int rc;
+    for (size_t i = 0; i < blocks; i++) {
+        rc = async_write(tg, fd, out + i * size, size, i * size, aio_func_test, &t);
+        assert(rc == 0);
+    }
+    wait_count(&t.done, blocks);
+    assert(atomic_load(&t.bytes) == blocks * size);
+
+    rc = async_fsync(tg, fd, aio_func_test, &t);
+    assert(rc == 0);
+    wait_count(&t.done, blocks + 1);
+
+    for (size_t i = 0; i < blocks; i++) {
+        rc = async_read(tg, fd, in + i * size, size, i * size, aio_func_test, &t);
+        assert(rc == 0);
+    }
+    wait_count(&t.done, 2 * blocks + 1);
+    assert(atomic_load(&t.bytes) == 2 * blocks * size);
+    assert(atomic_load(&t.failed) == 0);
+    assert(memcmp(in, out, blocks * size) == 0);
+
+#if SIZE_MAX > UINT32_MAX
+    // longer requests do not fit in a ring entry
+    rc = async_read(tg, fd, in, (size_t)UINT32_MAX + 1, 0, aio_func_test, &t);
+    assert(rc == POOL_ERROR);
+#endif
+
+    destroy_test(tp);
+    close(fd);
+    free(in);
+    free(out);
+}
+
+void block_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    // every thread of the group blocks, only compensating threads can run the other tasks
+    GroupAttr attr;
+    init_group_attr(&attr);
+    attr.blockMax = 2;
+
+    TGroup *tg;
+    tg = add_group_attr(tp, 2, 2, GROUP_FIXED, &attr);
+    assert(tg != NULL);
+
+    atomic_size_t count;
+    atomic_init(&count, 0);
+
+    size_t tasks = 100;
+    Blocker blocker = {&count, tasks, 0};
+    int rc;
+
+    for (int i = 0; i < 2; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, block_func, &blocker);
+
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+    wait_count(&blocker.blocked, 2);
+
+    for (size_t i = 0; i < tasks; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, count_func, &count);
+
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+    wait_count(&count, tasks + 2);
+
+    destroy_test(tp);
+}
+
+void numa_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    GroupAttr attr;
+    init_group_attr(&attr);
+
+    // a node that does not exist is refused
+    attr.numaNode = 4000;
+    assert(add_group_attr(tp, 1, 1, GROUP_FIXED, &attr) == NULL);
+
+    // the threads run on the one cpu they are pinned to
+    int cpus[1] = {0};
+    attr.numaNode = -1;
+    attr.cpus = cpus;
+    attr.numCpus = 1;
+
+    TGroup *tg;
+    tg = add_group_attr(tp, 2, 2, GROUP_FIXED, &attr);
+    assert(tg != NULL);
+
+    Placement placement;
+    atomic_init(&placement.count, 0);
+    atomic_init(&placement.misplaced, 0);
+    placement.cpu = cpus[0];
+
+    int rc;
+    for (int i = 0; i < 20; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, cpu_func, &placement);
+
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+    wait_count(&placement.count, 20);
+    assert(atomic_load(&placement.misplaced) == 0);
+
+    // the group memory and threads are placed on node 0
+    attr.cpus = NULL;
+    attr.numCpus = 0;
+    attr.numaNode = 0;
+
+    TGroup *tg2;
+    tg2 = add_group_attr(tp, 2, 2, GROUP_FIXED, &attr);
+    assert(tg2 != NULL);
+
+    atomic_size_t count;
+    atomic_init(&count, 0);
+    for (int i = 0; i < 20; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, count_func, &count);
+
+        rc = do_work(tg2, work);
+        assert(rc == 0);
+    }
+    wait_count(&count, 20);
+
+    destroy_group(tg2);
+    destroy_test(tp);
+}
+
+void sched_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    GroupAttr attr;
+    init_group_attr(&attr);
+
+    // stacks below the minimum and priorities out of range are refused
+    attr.stackSize = 1;
+    assert(add_group_attr(tp, 1, 1, GROUP_FIXED, &attr) == NULL);
+    attr.stackSize = 0;
+    attr.priority = 40;
+    assert(add_group_attr(tp, 1, 1, GROUP_FIXED, &attr) == NULL);
+    attr.policy = POLICY_FIFO;
+    attr.priority = 0;
+    assert(add_group_attr(tp, 1, 1, GROUP_FIXED, &attr) == NULL);
+
+    // small named batch threads with a nice level
+    attr.stackSize = 256 * 1024;
+    attr.guardSize = 8 * 1024;
+    attr.policy = POLICY_BATCH;
+    attr.priority = 5;
+    attr.name = "batchgroup";
+
+    TGroup *tg;
+    tg = add_group_attr(tp, 2, 2, GROUP_FIXED, &attr);
+    assert(tg != NULL);
+
+    Sched sched;
+    atomic_init(&sched.count, 0);
+    atomic_init(&sched.wrong, 0);
+    sched.name = attr.name;
+    sched.policy = POLICY_BATCH;
+    sched.nice = attr.priority;
+    sched.stackSize = attr.stackSize;
+
+    int rc;
+    for (int i = 0; i < 20; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, attr_func, &sched);
+
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+    wait_count(&sched.count, 20);
+    assert(atomic_load(&sched.wrong) == 0);
+
+    // realtime threads run their tasks whether or not realtime scheduling is permitted
+    attr.stackSize = 0;
+    attr.guardSize = 0;
+    attr.policy = POLICY_FIFO;
+    attr.priority = 1;
+    attr.name = NULL;
+
+    TGroup *tg2;
+    tg2 = add_group_attr(tp, 1, 1, GROUP_FIXED, &attr);
+    assert(tg2 != NULL);
+
+    atomic_size_t count;
+    atomic_init(&count, 0);
+    for (int i = 0; i < 20; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, count_func, &count);
+
+        rc = do_work(tg2, work);
+        assert(rc == 0);
+    }
+    wait_count(&count, 20);
+
+    // the configured policy is kept and the stats tell whether realtime was permitted
+    GroupStats stats;
+    rc = group_stats(tg2, &stats);
+    assert(rc == 0);
+    assert(stats.policy == POLICY_FIFO || stats.policy == POLICY_NORMAL);
+
+    atomic_int policy;
+    atomic_init(&policy, -1);
+    Work *work;
+    init_work(&work);
+    add_work(work, policy_func, &policy);
+    rc = do_work(tg2, work);
+    assert(rc == 0);
+    while(atomic_load(&policy) < 0) {
+        usleep(100);
+    }
+    assert(atomic_load(&policy) == stats.policy);
+
+    destroy_group(tg2);
+    destroy_test(tp);
+}
+
+void cancel_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    TGroup *tg;
+    tg = add_group(tp, 1, 1, GROUP_FIXED);
+    assert(tg != NULL);
+
+    // the only thread is held by a task so the rest stays queued
+    atomic_size_t gated;
+    atomic_init(&gated, 0);
+    Gate gate = {NULL, NULL, &gated};
+    int rc;
+    rc = init_latch(&gate.started, 1);
+    assert(rc == 0);
+    rc = init_latch(&gate.open, 1);
+    assert(rc == 0);
+
+    Work *work;
+    init_work(&work);
+    add_work(work, gate_func, &gate);
+    rc = do_work(tg, work);
+    assert(rc == 0);
+    latch_wait(gate.started);
+
+    TCompQ *cq;
+    rc = init_compq(&cq, 64);
+    assert(rc == 0);
+    TJoin *join;
+    rc = init_join(&join);
+    assert(rc == 0);
+
+    atomic_size_t count;
+    atomic_init(&count, 0);
+
+    Work *works[20];
+    for (int i = 0; i < 20; i++) {
+        init_work(&works[i]);
+        add_work(works[i], count_func, &count);
+        add_cancel(works[i], count_func);
+        retain_work(works[i]);
+
+        if(i < 10) {
+            rc = compq_work(cq, tg, works[i], (void *)(size_t)(i + 1));
+        } else {
+            rc = join_work(join, tg, works[i]);
+        }
+        assert(rc == 0);
+    }
+
+    // every other task is cancelled, a task can only be cancelled once
+    for (int i = 0; i < 20; i += 2) {
+        rc = cancel_work(tg, works[i]);
+        assert(rc == 0);
+        rc = cancel_work(tg, works[i]);
+        assert(rc != 0);
+    }
+    // the cancel callback ran in place of the task
+    assert(atomic_load(&count) == 10);
+
+    latch_count_down(gate.open);
+    wait_count(&count, 20);
+    wait_join(join);
+
+    // work that ran can not be cancelled
+    for (int i = 0; i < 20; i++) {
+        if(i % 2 == 1) {
+            rc = cancel_work(tg, works[i]);
+            assert(rc != 0);
+        }
+        release_work(works[i]);
+    }
+
+    // the cancelled completions carry their own status
+    Completion comps[16];
+    size_t n = 0;
+    size_t failed = 0;
+    while(n < 10) {
+        size_t got = compq_drain(cq, comps, 16);
+        for (size_t i = 0; i < got; i++) {
+            size_t tag = (size_t)comps[i].tag;
+            assert(comps[i].status == (((tag - 1) % 2 == 0) ? POOL_CANCELLED : POOL_SUCCESS));
+            failed += (comps[i].status == POOL_CANCELLED);
+        }
+        n += got;
+        if(got == 0) {
+            usleep(100);
+        }
+    }
+    assert(failed == 5);
+
+    destroy_join(join);
+    destroy_compq(cq);
+    destroy_latch(gate.started);
+    destroy_latch(gate.open);
+
+    // discarding calls the cancel callbacks instead of running the queued tasks
+    rc = init_latch(&gate.started, 1);
+    assert(rc == 0);
+    rc = init_latch(&gate.open, 1);
+    assert(rc == 0);
+
+    init_work(&work);
+    add_work(work, gate_func, &gate);
+    rc = do_work(tg, work);
+    assert(rc == 0);
+    latch_wait(gate.started);
+
+    // the cancel callback gets the same arg as the task, a task that ran counts twice
+    atomic_store(&count, 0);
+    for (int i = 0; i < 50; i++) {
+        init_work(&work);
+        add_work(work, sleep_func, &count);
+        add_cancel(work, count_func);
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+
+    // the shutdown waits for the held task
+    Shutdown shutdown = {tg, SHUTDOWN_DISCARD, 0};
+    pthread_t thread;
+    rc = pthread_create(&thread, NULL, shutdown_func, &shutdown);
+    assert(rc == 0);
+
+    wait_count(&count, 50);
+    latch_count_down(gate.open);
+    pthread_join(thread, NULL);
+    assert(atomic_load(&count) == 50);
+
+    destroy_latch(gate.started);
+    destroy_latch(gate.open);
+
+    // a discard cancels the tasks a worker took in a batch along with the task it is running
+    tg = add_group(tp, 1, 1, GROUP_FIXED);
+    assert(tg != NULL);
+
+    Gate busy = {NULL, NULL, &gated};
+    rc = init_latch(&busy.started, 1);
+    assert(rc == 0);
+    rc = init_latch(&busy.open, 1);
+    assert(rc == 0);
+    Hold hold;
+    rc = init_latch(&hold.started, 1);
+    assert(rc == 0);
+    atomic_init(&hold.open, 0);
+
+    init_work(&work);
+    add_work(work, gate_func, &busy);
+    rc = do_work(tg, work);
+    assert(rc == 0);
+    latch_wait(busy.started);
+
+    init_work(&work);
+    add_work(work, held_func, &hold);
+    rc = do_work(tg, work);
+    assert(rc == 0);
+
+    atomic_store(&count, 0);
+    for (int i = 0; i < 40; i++) {
+        init_work(&work);
+        add_work(work, sleep_func, &count);
+        add_cancel(work, count_func);
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+
+    // the held task is fetched with a batch of the tasks behind it
+    latch_count_down(busy.open);
+    latch_wait(hold.started);
+
+    shutdown.tg = tg;
+    rc = pthread_create(&thread, NULL, shutdown_func, &shutdown);
+    assert(rc == 0);
+
+    // the queue is cancelled once the shutdown started discarding, the batch is cancelled after the held task
+    wait_count(&count, 40 - 16);
+    atomic_store(&hold.open, 1);
+    pthread_join(thread, NULL);
+    assert(atomic_load(&count) == 40);
+
+    destroy_latch(busy.started);
+    destroy_latch(busy.open);
+    destroy_latch(hold.started);
+
+    // a deadline runs what it can and cancels the rest
+    tg = add_group(tp, 1, 1, GROUP_FIXED);
+    assert(tg != NULL);
+
+    atomic_store(&count, 0);
+    for (int i = 0; i < 50; i++) {
+        init_work(&work);
+        add_work(work, sleep_func, &count);
+        add_cancel(work, count_func);
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+    shutdown_group(tg, SHUTDOWN_DEADLINE, 50);
+    assert(atomic_load(&count) < 100);
+    assert(atomic_load(&count) > 50);
+
+    // a pool discards the queues of all its groups
+    tg = add_group(tp, 1, 1, GROUP_FIXED);
+    assert(tg != NULL);
+
+    atomic_store(&count, 0);
+    for (int i = 0; i < 50; i++) {
+        init_work(&work);
+        add_work(work, sleep_func, &count);
+        add_cancel(work, count_func);
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+    shutdown_pool(tp, SHUTDOWN_DISCARD, 0);
+    assert(atomic_load(&count) >= 50 && atomic_load(&count) < 100);
+}
+
+void codel_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    GroupAttr attr;
+    init_group_attr(&attr);
+    attr.targetUs = 1000;
+    attr.intervalUs = 10000;
+    attr.shed = SHED_REJECT;
+
+    TGroup *tg;
+    tg = add_group_attr(tp, 1, 1, GROUP_FIXED, &attr);
+    assert(tg != NULL);
+
+    // the only thread is held by three gates in a row, each one queued for two intervals
+    // the first interval ends on the second gate, so the one that ends on the third gate only saw its delay
+    Gate gates[3];
+    atomic_size_t gated;
+    atomic_init(&gated, 0);
+    int rc;
+    for (int i = 0; i < 3; i++) {
+        gates[i].count = &gated;
+        rc = init_latch(&gates[i].started, 1);
+        assert(rc == 0);
+        rc = init_latch(&gates[i].open, 1);
+        assert(rc == 0);
+
+        Work *work;
+        init_work(&work);
+        add_work(work, gate_func, &gates[i]);
+        rc = do_work(tg, work);
+        assert(rc == 0);
+        if(i == 0) {
+            latch_wait(gates[i].started);
+        }
+    }
+
+    atomic_size_t count;
+    atomic_init(&count, 0);
+    for (int i = 0; i < 10; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, count_func, &count);
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+
+    for (int i = 1; i < 3; i++) {
+        usleep(2 * attr.intervalUs);
+        latch_count_down(gates[i - 1].open);
+        latch_wait(gates[i].started);
+    }
+
+    // new work is turned away while the group is overloaded
+    Work *shed;
+    init_work(&shed);
+    add_work(shed, count_func, &count);
+    rc = do_work(tg, shed);
+    assert(rc == GROUP_SHED);
+    free(shed);
+
+    GroupStats stats;
+    rc = group_stats(tg, &stats);
+    assert(rc == 0);
+    assert(stats.overloaded);
+    assert(stats.rejected == 1);
+    assert(stats.minDelayUs >= 2 * attr.intervalUs);
+
+    latch_count_down(gates[2].open);
+    wait_count(&count, 10);
+    for (int i = 0; i < 3; i++) {
+        destroy_latch(gates[i].started);
+        destroy_latch(gates[i].open);
+    }
+
+    // the group takes work again once its queue ran empty
+    do {
+        usleep(1000);
+        group_stats(tg, &stats);
+    } while(stats.overloaded || stats.queued > 0);
+
+    Work *work;
+    init_work(&work);
+    add_work(work, count_func, &count);
+    rc = do_work(tg, work);
+    assert(rc == 0);
+
+    // dropping cancels the work that waited too long instead
+    attr.shed = SHED_DROP;
+    TGroup *tg2;
+    tg2 = add_group_attr(tp, 1, 1, GROUP_FIXED, &attr);
+    assert(tg2 != NULL);
+
+    atomic_size_t count2;
+    atomic_init(&count2, 0);
+    for (int i = 0; i < 50; i++) {
+        init_work(&work);
+        add_work(work, sleep_func, &count2);
+        add_cancel(work, count_func);
+        rc = do_work(tg2, work);
+        assert(rc == 0);
+    }
+
+    // a task that ran counts twice and a dropped one once, so this only holds once every task is accounted for
+    do {
+        usleep(1000);
+        group_stats(tg2, &stats);
+    } while(atomic_load(&count2) != 100 - stats.dropped);
+    assert(stats.dropped > 0 && stats.dropped < 50);
+    destroy_group(tg2);
+
+    // a rate limit hands each task to the idle thread on a refill, the handed work is checked and dropped as well
+    attr.rate = 50;
+    attr.burst = 1;
+    attr.rateUnit = RATE_TASKS;
+    TGroup *tg3;
+    tg3 = add_group_attr(tp, 1, 1, GROUP_FIXED, &attr);
+    assert(tg3 != NULL);
+
+    atomic_store(&count2, 0);
+    for (int i = 0; i < 20; i++) {
+        init_work(&work);
+        add_work(work, sleep_func, &count2);
+        add_cancel(work, count_func);
+        rc = do_work(tg3, work);
+        assert(rc == 0);
+    }
+
+    do {
+        usleep(1000);
+        group_stats(tg3, &stats);
+    } while(atomic_load(&count2) != 40 - stats.dropped);
+    assert(stats.dropped > 0);
+    destroy_group(tg3);
+
+    destroy_test(tp);
+}
+
+void rate_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    GroupAttr attr;
+    init_group_attr(&attr);
+    attr.rate = 200;
+    attr.burst = 10;
+    attr.rateUnit = RATE_TASKS;
+
+    TGroup *tg;
+    tg = add_group_attr(tp, 2, 2, GROUP_FIXED, &attr);
+    assert(tg != NULL);
+
+    TGroup *other;
+    other = add_group(tp, 1, 1, GROUP_FIXED);
+    assert(other != NULL);
+
+    // the burst runs at once and the other 50 tasks wait for tokens, which come in at 200 a second
+    atomic_size_t count;
+    atomic_init(&count, 0);
+    uint64_t start = now_ms();
+    int rc;
+    for (int i = 0; i < 60; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, count_func, &count);
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+
+    // a group without a limit is not held up by the one over budget
+    atomic_size_t otherCount;
+    atomic_init(&otherCount, 0);
+    for (int i = 0; i < 20; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, count_func, &otherCount);
+        rc = do_work(other, work);
+        assert(rc == 0);
+    }
+    wait_count(&otherCount, 20);
+
+    // the refills keep going while the pool is waited on
+    wait_pool(tp);
+    assert(atomic_load(&count) == 60);
+
+    // only the limited group ran out of tokens, and the 50 tokens past the burst take at least 250ms to earn
+    GroupStats stats;
+    rc = group_stats(tg, &stats);
+    assert(rc == 0);
+    assert(stats.throttled > 0);
+    rc = group_stats(other, &stats);
+    assert(rc == 0);
+    assert(stats.throttled == 0);
+    assert(now_ms() - start >= 150);
+
+    // a cpu budget of 200ms a second stretches 100ms of cpu work to at least 450ms
+    attr.rateUnit = RATE_CPU;
+    TGroup *tg2;
+    tg2 = add_group_attr(tp, 1, 1, GROUP_FIXED, &attr);
+    assert(tg2 != NULL);
+
+    atomic_store(&count, 0);
+    start = now_ms();
+    for (int i = 0; i < 20; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, spin_func, &count);
+        rc = do_work(tg2, work);
+        assert(rc == 0);
+    }
+    wait_count(&count, 20);
+    rc = group_stats(tg2, &stats);
+    assert(rc == 0);
+    assert(stats.throttled > 0);
+    assert(now_ms() - start >= 300);
+
+    // unknown units are refused
+    attr.rateUnit = 0;
+    assert(add_group_attr(tp, 1, 1, GROUP_FIXED, &attr) == NULL);
+
+    destroy_test(tp);
+}
+
+void strand_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    TGroup *tg;
+    tg = add_group(tp, 4, 4, GROUP_FIXED);
+    assert(tg != NULL);
+
+    TStrandMap *map;
+    int rc;
+    rc = init_strand_map(&map, tg, 3);
+    assert(rc == 0);
+
+    // tasks of a key run one at a time in the order they were posted while the keys run in parallel
+    atomic_size_t count;
+    atomic_init(&count, 0);
+    Serial serials[4];
+    for (int k = 0; k < 4; k++) {
+        serials[k].count = &count;
+        atomic_init(&serials[k].inside, 0);
+        serials[k].next = 0;
+        atomic_init(&serials[k].wrong, 0);
+    }
+
+    Step *steps = (Step *)malloc(4 * 200 * sizeof(Step));
+    assert(steps != NULL);
+    for (size_t i = 0; i < 200; i++) {
+        for (int k = 0; k < 4; k++) {
+            Step *step = &steps[i * 4 + k];
+            step->serial = &serials[k];
+            step->seq = i;
+
+            Work *work;
+            init_work(&work);
+            add_work(work, serial_func, step);
+            rc = strand_map_work(map, (size_t)k, work);
+            assert(rc == 0);
+        }
+    }
+
+    // destroying the map waits for the strands to run out of work
+    destroy_strand_map(map);
+    assert(atomic_load(&count) == 800);
+    for (int k = 0; k < 4; k++) {
+        assert(atomic_load(&serials[k].wrong) == 0);
+        assert(serials[k].next == 200);
+    }
+
+    // a single strand keeps its order across the batches it is split in
+    TStrand *strand;
+    rc = init_strand(&strand, tg);
+    assert(rc == 0);
+
+    serials[0].next = 0;
+    for (size_t i = 0; i < 200; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, serial_func, &steps[i]);
+        steps[i].serial = &serials[0];
+        steps[i].seq = i;
+        rc = strand_work(strand, work);
+        assert(rc == 0);
+    }
+
+    destroy_strand(strand);
+    assert(atomic_load(&count) == 1000);
+    assert(atomic_load(&serials[0].wrong) == 0);
+    assert(serials[0].next == 200);
+
+    free(steps);
+    destroy_test(tp);
+}
+
+void barrier_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    // every task of a phase needs its own thread
+    TGroup *tg;
+    tg = add_group(tp, 4, 4, GROUP_FIXED);
+    assert(tg != NULL);
+
+    atomic_size_t count;
+    atomic_init(&count, 0);
+
+    Phases phases;
+    int rc;
+    rc = init_barrier(&phases.barrier, 4);
+    assert(rc == 0);
+    phases.tasks = 4;
+    phases.phases = 1000;
+    atomic_init(&phases.arrived, 0);
+    atomic_init(&phases.last, 0);
+    atomic_init(&phases.early, 0);
+    phases.count = &count;
+
+    for (int i = 0; i < 4; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, phase_func, &phases);
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+
+    wait_count(&count, 4);
+    assert(atomic_load(&phases.early) == 0);
+    assert(atomic_load(&phases.last) == 1000);
+    destroy_barrier(phases.barrier);
+
+    // fibers let a single thread hold every task of a phase
+    GroupAttr attr;
+    init_group_attr(&attr);
+    attr.fiberStack = 64 * 1024;
+
+    TGroup *tg2;
+    tg2 = add_group_attr(tp, 1, 1, GROUP_FIXED, &attr);
+    assert(tg2 != NULL);
+
+    atomic_store(&count, 0);
+    rc = init_barrier(&phases.barrier, 8);
+    assert(rc == 0);
+    phases.tasks = 8;
+    phases.phases = 100;
+    atomic_store(&phases.arrived, 0);
+    atomic_store(&phases.last, 0);
+
+    for (int i = 0; i < 8; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, phase_func, &phases);
+        rc = do_work(tg2, work);
+        assert(rc == 0);
+    }
+
+    wait_count(&count, 8);
+    assert(atomic_load(&phases.early) == 0);
+    assert(atomic_load(&phases.last) == 100);
+    destroy_barrier(phases.barrier);
+
+    assert(init_barrier(&phases.barrier, 0) == POOL_ERROR);
+
+    // the last arrival frees the barrier while the others can still be waking up
+    TGroup *groups[] = {tg, tg2};
+    for (size_t g = 0; g < 2; g++) {
+        atomic_store(&count, 0);
+        for (size_t round = 0; round < 200; round++) {
+            Meet meet = {NULL, &count};
+            rc = init_barrier(&meet.barrier, 4);
+            assert(rc == 0);
+
+            for (int i = 0; i < 4; i++) {
+                Work *work;
+                init_work(&work);
+                add_work(work, meet_func, &meet);
+                rc = do_work(groups[g], work);
+                assert(rc == 0);
+            }
+            wait_count(&count, 4 * (round + 1));
+        }
+    }
+
+    destroy_test(tp);
+}
+
+void quiet_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    TGroup *tg;
+    tg = add_group(tp, 2, 2, GROUP_FIXED);
+    assert(tg != NULL);
+
+    TGroup *other;
+    other = add_group(tp, 1, 1, GROUP_FIXED);
+    assert(other != NULL);
+
+    // a task that is running keeps its group busy after the queue ran empty
+    atomic_size_t gateCount;
+    atomic_init(&gateCount, 0);
+    Gate gate = {NULL, NULL, &gateCount};
+    int rc;
+    rc = init_latch(&gate.started, 1);
+    assert(rc == 0);
+    rc = init_latch(&gate.open, 1);
+    assert(rc == 0);
+
+    Work *work;
+    init_work(&work);
+    add_work(work, gate_func, &gate);
+    rc = do_work(other, work);
+    assert(rc == 0);
+    latch_wait(gate.started);
+
+    // a group is waited on without the busy one
+    atomic_size_t count;
+    atomic_init(&count, 0);
+    for (int i = 0; i < 100; i++) {
+        init_work(&work);
+        add_work(work, count_func, &count);
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+    wait_group(tg);
+    assert(atomic_load(&count) == 100);
+    assert(wait_group_timed(tg, 1) == POOL_SUCCESS);
+
+    // the gate stays closed so these time out however long they take
+    assert(wait_group_timed(other, 100) == POOL_TIMEOUT);
+    assert(wait_pool_timed(tp, 100) == POOL_TIMEOUT);
+
+    // every waiter wakes up once the last task is done, the gate keeps them waiting till then
+    atomic_size_t done;
+    atomic_init(&done, 0);
+    Waiter waiter = {tp, NULL, &done};
+    rc = init_latch(&waiter.ready, 3);
+    assert(rc == 0);
+    pthread_t waiters[3];
+    for (int i = 0; i < 3; i++) {
+        rc = pthread_create(&waiters[i], NULL, waiter_func, &waiter);
+        assert(rc == 0);
+    }
+
+    // the waiters are given plenty of time to fall asleep so the wake is what lets them go
+    latch_wait(waiter.ready);
+    usleep(100000);
+    assert(atomic_load(&done) == 0);
+
+    latch_count_down(gate.open);
+    for (int i = 0; i < 3; i++) {
+        pthread_join(waiters[i], NULL);
+    }
+    assert(atomic_load(&done) == 3);
+    assert(atomic_load(&gateCount) == 1);
+
+    destroy_latch(waiter.ready);
+    destroy_latch(gate.started);
+    destroy_latch(gate.open);
+    destroy_test(tp);
+}
+
+void resize_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    TGroup *tg;
+    tg = add_group(tp, 1, 1, GROUP_FIXED);
+    assert(tg != NULL);
+
+    // the group grows at once, its threads all run the tasks that wait on each other
+    int rc;
+    rc = resize_group(tg, 4, 4, GROUP_FIXED);
+    assert(rc == 0);
+
+    atomic_size_t count;
+    atomic_init(&count, 0);
+    Gate gate = {NULL, NULL, &count};
+    rc = init_latch(&gate.started, 4);
+    assert(rc == 0);
+    rc = init_latch(&gate.open, 1);
+    assert(rc == 0);
+
+    for (int i = 0; i < 4; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, gate_func, &gate);
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+    latch_wait(gate.started);
+
+    // a smaller capacity turns work away till the queue drained below it
+    GroupConfig config;
+    rc = group_config(tg, &config);
+    assert(rc == 0);
+    assert(config.min == 4 && config.max == 4 && config.flags == GROUP_FIXED);
+    config.capacity = 5;
+    rc = configure_group(tg, &config);
+    assert(rc == 0);
+
+    Busy busy;
+    atomic_init(&busy.running, 0);
+    atomic_init(&busy.most, 0);
+    atomic_init(&busy.count, 0);
+    size_t accepted = 0;
+    for (int i = 0; i < 10; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, busy_func, &busy);
+        rc = do_work(tg, work);
+        if(rc == 0) {
+            accepted++;
+        } else {
+            assert(rc == GROUP_FULL);
+            free(work);
+        }
+    }
+    assert(accepted == 5);
+
+    // shrinking keeps the queued work, the threads above max leave between tasks
+    rc = resize_group(tg, 1, 1, GROUP_FIXED);
+    assert(rc == 0);
+    latch_count_down(gate.open);
+    wait_group(tg);
+    assert(atomic_load(&count) == 4);
+    assert(atomic_load(&busy.count) == 5);
+
+    GroupStats stats;
+    do {
+        usleep(1000);
+        group_stats(tg, &stats);
+    } while(stats.threads != 1);
+
+    atomic_store(&busy.most, 0);
+    for (int i = 0; i < 5; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, busy_func, &busy);
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+    wait_group(tg);
+    assert(atomic_load(&busy.most) == 1);
+    assert(atomic_load(&busy.count) == 10);
+
+    // the limits cannot go past the threads left in the pool
+    rc = resize_group(tg, 2, 100, GROUP_DYNAMIC);
+    assert(rc == 0);
+    rc = group_config(tg, &config);
+    assert(rc == 0);
+    assert(config.min == 2 && config.max == 8 && config.flags == GROUP_DYNAMIC);
+    assert(add_group(tp, 1, 1, GROUP_FIXED) == NULL);
+    assert(resize_group(tg, 3, 2, GROUP_DYNAMIC) == POOL_ERROR);
+
+    destroy_latch(gate.started);
+    destroy_latch(gate.open);
+    destroy_test(tp);
+}
+
+void migrate_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    TGroup *src;
+    src = add_group(tp, 1, 1, GROUP_FIXED);
+    assert(src != NULL);
+
+    GroupAttr attr;
+    init_group_attr(&attr);
+    attr.capacity = 10;
+
+    TGroup *dst;
+    dst = add_group_attr(tp, 2, 2, GROUP_FIXED, &attr);
+    assert(dst != NULL);
+
+    // the only thread of the source is held so its backlog stays queued
+    atomic_size_t gateCount;
+    atomic_init(&gateCount, 0);
+    Gate gate = {NULL, NULL, &gateCount};
+    int rc;
+    rc = init_latch(&gate.started, 1);
+    assert(rc == 0);
+    rc = init_latch(&gate.open, 1);
+    assert(rc == 0);
+
+    Work *work;
+    init_work(&work);
+    add_work(work, gate_func, &gate);
+    rc = do_work(src, work);
+    assert(rc == 0);
+    latch_wait(gate.started);
+
+    atomic_size_t count;
+    atomic_init(&count, 0);
+    for (int i = 0; i < 20; i++) {
+        init_work(&work);
+        add_work(work, count_func, &count);
+        rc = do_work(src, work);
+        assert(rc == 0);
+    }
+
+    size_t moved = migrate_group_work(src, dst, 5);
+    assert(moved == 5);
+    wait_group(dst);
+    assert(atomic_load(&count) == 5);
+
+    // the destination only takes what fits in its capacity
+    moved = migrate_group_work(src, dst, 0);
+    assert(moved == 10);
+    wait_group(dst);
+    assert(atomic_load(&count) == 15);
+
+    GroupStats stats;
+    group_stats(src, &stats);
+    assert(stats.queued == 5);
+    assert(migrate_group_work(src, src, 0) == 0);
+
+    // the rest moves when the source is destroyed, whatever does not move runs on the old thread
+    latch_count_down(gate.open);
+    moved = shutdown_group_into(src, dst);
+    assert(moved <= 5);
+    wait_group(dst);
+    assert(atomic_load(&count) == 20);
+    assert(atomic_load(&gateCount) == 1);
+
+    destroy_latch(gate.started);
+    destroy_latch(gate.open);
+    destroy_test(tp);
+}
+
+void batch_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    GroupAttr attr;
+    init_group_attr(&attr);
+    attr.blockMax = 1;
+
+    TGroup *tg;
+    tg = add_group_attr(tp, 1, 1, GROUP_FIXED, &attr);
+    assert(tg != NULL);
+
+    // the only thread is held so the tasks queue up behind it
+    atomic_size_t gateCount;
+    atomic_init(&gateCount, 0);
+    Gate gate = {NULL, NULL, &gateCount};
+    int rc;
+    rc = init_latch(&gate.started, 1);
+    assert(rc == 0);
+    rc = init_latch(&gate.open, 1);
+    assert(rc == 0);
+
+    Work *work;
+    init_work(&work);
+    add_work(work, gate_func, &gate);
+    rc = do_work(tg, work);
+    assert(rc == 0);
+    latch_wait(gate.started);
+
+    Probe probe = {tg, 0};
+    init_work(&work);
+    add_work(work, probe_func, &probe);
+    rc = do_work(tg, work);
+    assert(rc == 0);
+
+    atomic_size_t count;
+    atomic_init(&count, 0);
+    for (int i = 0; i < 39; i++) {
+        init_work(&work);
+        add_work(work, count_func, &count);
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+
+    // the worker takes the probe with a batch, the rest of the batch still counts as queued
+    latch_count_down(gate.open);
+    wait_group(tg);
+    assert(probe.queued == 39);
+    assert(atomic_load(&count) == 39);
+
+    // a blocked task hands the rest of its batch back, the compensating thread runs it
+    destroy_latch(gate.started);
+    destroy_latch(gate.open);
+    rc = init_latch(&gate.started, 1);
+    assert(rc == 0);
+    rc = init_latch(&gate.open, 1);
+    assert(rc == 0);
+
+    init_work(&work);
+    add_work(work, gate_func, &gate);
+    rc = do_work(tg, work);
+    assert(rc == 0);
+    latch_wait(gate.started);
+
+    atomic_store(&count, 0);
+    Blocker blocker = {&count, 7, 0};
+    init_work(&work);
+    add_work(work, block_func, &blocker);
+    rc = do_work(tg, work);
+    assert(rc == 0);
+
+    for (int i = 0; i < 7; i++) {
+        init_work(&work);
+        add_work(work, count_func, &count);
+        rc = do_work(tg, work);
+        assert(rc == 0);
+    }
+
+    latch_count_down(gate.open);
+    wait_group(tg);
+    assert(atomic_load(&count) == 8);
+    assert(atomic_load(&blocker.blocked) == 1);
+
+    destroy_latch(gate.started);
+    destroy_latch(gate.open);
+    destroy_test(tp);
+}
+
+void slot_test() {
+    TPool *tp;
+    tp = init_test(8);
+
+    TGroup *tg;
+    tg = add_group(tp, 4, 4, GROUP_FIXED);
+    assert(tg != NULL);
+
+    atomic_size_t ran;
+    atomic_size_t done;
+    atomic_init(&ran, 0);
+    atomic_init(&done, 0);
+
+    Request reqs[16];
+    int rc;
+
+    // the slots are used again once the pool handed them back
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 16; i++) {
+            reqs[i].ran = &ran;
+            reqs[i].done = &done;
+
+            Work *work;
+            init_work_slot(&work, &reqs[i].slot, request_done);
+            assert(work != NULL);
+            add_work(work, request_func, &reqs[i]);
+            rc = do_work(tg, work);
+            assert(rc == 0);
+        }
+        wait_group(tg);
+        assert(atomic_load(&ran) == 16 * (size_t)(round + 1));
+        assert(atomic_load(&done) == 16 * (size_t)(round + 1));
+    }
+
+    // a retained slot is handed back with its last reference, after it was cancelled
+    TGroup *tg2;
+    tg2 = add_group(tp, 1, 1, GROUP_FIXED);
+    assert(tg2 != NULL);
+
+    atomic_size_t gated;
+    atomic_init(&gated, 0);
+    Gate gate = {NULL, NULL, &gated};
+    rc = init_latch(&gate.started, 1);
+    assert(rc == 0);
+    rc = init_latch(&gate.open, 1);
+    assert(rc == 0);
+
+    Work *work;
+    init_work(&work);
+    add_work(work, gate_func, &gate);
+    rc = do_work(tg2, work);
+    assert(rc == 0);
+    latch_wait(gate.started);
+
+    atomic_store(&ran, 0);
+    atomic_store(&done, 0);
+
+    Work *works[16];
+    for (int i = 0; i < 16; i++) {
+        init_work_slot(&works[i], &reqs[i].slot, request_done);
+        add_work(works[i], request_func, &reqs[i]);
+        retain_work(works[i]);
+        rc = do_work(tg2, works[i]);
+        assert(rc == 0);
+    }
+
+    for (int i = 0; i < 16; i += 2) {
+        rc = cancel_work(tg2, works[i]);
+        assert(rc == 0);
+    }
+    assert(atomic_load(&done) == 0);
+
+    latch_count_down(gate.open);
+    wait_group(tg2);
+    assert(atomic_load(&ran) == 8);
+    assert(atomic_load(&done) == 0);
+
+    for (int i = 0; i < 16; i++) {
+        release_work(works[i]);
+    }
+    assert(atomic_load(&done) == 16);
+
+    destroy_latch(gate.started);
+    destroy_latch(gate.open);
+    destroy_test(tp);
+}
+
+void ail_test() {
+    enum { PRODUCERS = 4, ITEMS = 20000, FREE = 64 };
+
+    // every producer is seen in the order it pushed
+    AQ q;
+    init_aq(&q);
+    assert(aq_pop(&q) == NULL);
+    assert(aq_empty(&q));
+
+    Item *items = (Item *)malloc(PRODUCERS * ITEMS * sizeof(Item));
+    assert(items != NULL);
+    Pusher pushers[PRODUCERS];
+    pthread_t thrds[PRODUCERS];
+    for (size_t i = 0; i < PRODUCERS; i++) {
+        pushers[i].q = &q;
+        pushers[i].items = &items[i * ITEMS];
+        pushers[i].numItems = ITEMS;
+        for (size_t j = 0; j < ITEMS; j++) {
+            pushers[i].items[j].producer = i;
+            pushers[i].items[j].seq = j;
+        }
+        pthread_create(&thrds[i], NULL, push_func, &pushers[i]);
+    }
+
+    size_t next[PRODUCERS] = {0};
+    size_t popped = 0;
+    while(popped < PRODUCERS * ITEMS) {
+        AIL *ail = aq_pop(&q);
+        if(ail == NULL) {
+            sched_yield();
+            continue;
+        }
+
+        Item *item = CONTAINER_OF(ail, Item, move);
+        assert(item->seq == next[item->producer]);
+        next[item->producer]++;
+        popped++;
+    }
+    for (size_t i = 0; i < PRODUCERS; i++) {
+        pthread_join(thrds[i], NULL);
+    }
+    assert(aq_pop(&q) == NULL);
+    assert(aq_empty(&q));
+
+    // a free list shared by threads that keep taking and giving back items
+    AS s;
+    init_as(&s);
+    assert(as_pop(&s) == NULL);
+    for (size_t i = 0; i < FREE; i++) {
+        items[i].uses = 0;
+        items[i].seq = i;
+        as_push(&s, &items[i].move);
+    }
+
+    Churner churner = {&s, ITEMS};
+    for (size_t i = 0; i < PRODUCERS; i++) {
+        pthread_create(&thrds[i], NULL, churn_func, &churner);
+    }
+    for (size_t i = 0; i < PRODUCERS; i++) {
+        pthread_join(thrds[i], NULL);
+    }
+
+    // every item comes back once, taken all at once in the order it was pushed
+    AIL *chain = ail_reverse(as_take_all(&s));
+    assert(as_take_all(&s) == NULL);
+    size_t count = 0;
+    size_t uses = 0;
+    while(chain != NULL) {
+        Item *item = CONTAINER_OF(chain, Item, move);
+        uses += item->uses;
+        count++;
+        chain = atomic_load(&chain->next);
+    }
+    assert(count == FREE);
+    assert(uses == PRODUCERS * ITEMS);
+
+    for (size_t i = 0; i < 3; i++) {
+        as_push(&s, &items[i].move);
+    }
+    chain = ail_reverse(as_take_all(&s));
+    for (size_t i = 0; i < 3; i++) {
+        assert(chain == &items[i].move);
+        chain = atomic_load(&chain->next);
+    }
+    assert(chain == NULL);
+
+    free(items);
+}
+
+int main(int argc, char *argv[]) {
+    init_pool_test(8);
+    add_group_test();
+    add_work_test();
+    add_work_test2();
+    heavy_test();
+    producer_test();
+    sharded_test();
+    parallel_for_test();
+    parallel_reduce_test();
+    graph_test();
+    join_test();
+    fiber_test();
+    reactor_test();
+    compq_test();
+    aio_test();
+    block_test();
+    numa_test();
+    sched_test();
+    cancel_test();
+    codel_test();
+    rate_test();
+    strand_test();
+    barrier_test();
+    quiet_test();
+    resize_test();
+    migrate_test();
+    batch_test();
+    slot_test();
+    ail_test();
+    return 0;    
+}
+
+static void thread_func(void *arg) {
+    int sum = 0;
+    for (int i = 0; i < 1000000; i++)
+    {
+        sum++;
+    }
+    assert(sum == 1000000);
+}
+
+static void count_func(void *arg) {
+    atomic_size_t *count = (atomic_size_t *)arg;
+    atomic_fetch_add(count, 1);
+}
+
+static void wait_count(atomic_size_t *count, size_t expected) {
+    while(atomic_load(count) < expected) {
+        usleep(100);
+    }
+}
+
+/**
+ * Drains the completion queue like an event loop would and sums the tags.
+ */
+static size_t drain_test(TCompQ *cq, size_t expected) {
+    struct pollfd pfd = {compq_fd(cq), POLLIN, 0};
+    Completion comps[32];
+    size_t received = 0;
+    size_t sum = 0;
+
+    while(received < expected) {
+        int rc = poll(&pfd, 1, 5000);
+        assert(rc == 1);
+
+        size_t n = compq_drain(cq, comps, 32);
+        for (size_t i = 0; i < n; i++) {
+            assert(comps[i].status == POOL_SUCCESS);
+            sum += (size_t)comps[i].tag;
+        }
+        received += n;
+    }
+
+    return sum;
+}
+
+static void *submit_func(void *arg) {
+    Submitter *sub = (Submitter *)arg;
+    for (size_t i = 0; i < sub->len; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, count_func, sub->count);
+
+        int rc = do_work(sub->tg, work);
+        assert(rc == 0);
+    }
+    return NULL;
+}
+
+static void mark_func(size_t begin, size_t end, void *ctx) {
+    unsigned char *marks = (unsigned char *)ctx;
+    for (size_t i = begin; i < end; i++) {
+        marks[i]++;
+    }
+}
+
+static void sum_identity(void *acc, void *ctx) {
+    (void)ctx;
+    *(size_t *)acc = 0;
+}
+
+static void sum_accumulate(void *acc, size_t begin, size_t end, void *ctx) {
+    size_t *in = (size_t *)ctx;
+    for (size_t i = begin; i < end; i++) {
+        *(size_t *)acc += in[i];
+    }
+}
+
+static void sum_combine(void *acc, const void *other, void *ctx) {
+    (void)ctx;
+    *(size_t *)acc += *(const size_t *)other;
+}
+
+static void square_func(const void *in, void *out, void *ctx) {
+    (void)ctx;
+    size_t value = *(const size_t *)in;
+    *(size_t *)out = value * value;
+}
+
+static void stage_func(void *arg) {
+    Stage *stage = (Stage *)arg;
+    stage->ran = atomic_fetch_add(stage->clock, 1) + 1;
+}
+
+static void fib_func(void *arg) {
+    Fib *fib = (Fib *)arg;
+    if(fib->n < 2) {
+        fib->result = fib->n;
+        return;
+    }
+
+    TJoin *join;
+    int rc;
+    rc = init_join(&join);
+    assert(rc == 0);
+
+    Fib children[2] = {{fib->tg, fib->n - 1, 0}, {fib->tg, fib->n - 2, 0}};
+    for (size_t i = 0; i < 2; i++) {
+        Work *work;
+        init_work(&work);
+        add_work(work, fib_func, &children[i]);
+
+        // a full queue runs the child inline
+        rc = join_work(join, fib->tg, work);
+        if(rc == GROUP_FULL) {
+            free(work);
+            fib_func(&children[i]);
+        }
+        assert(rc == 0 || rc == GROUP_FULL);
+    }
+    wait_join(join);
+    destroy_join(join);
+
+    fib->result = children[0].result + children[1].result;
+}
+
+static void gate_func(void *arg) {
+    Gate *gate = (Gate *)arg;
+
+    latch_count_down(gate->started);
+    latch_wait(gate->open);
+    atomic_fetch_add(gate->count, 1);
+}
+
+static void held_func(void *arg) {
+    Hold *hold = (Hold *)arg;
+
+    latch_count_down(hold->started);
+    while(!atomic_load(&hold->open)) {
+        usleep(100);
+    }
+}
+
+static void ping_func(void *arg) {
+    Pipe *pipe = (Pipe *)arg;
+    for (size_t i = 1; i <= pipe->len; i++) {
+        int rc = chan_send(pipe->chan, (void *)i);
+        assert(rc == 0);
+    }
+    close_chan(pipe->chan);
+}
+
+static void pong_func(void *arg) {
+    Pipe *pipe = (Pipe *)arg;
+    void *item;
+    while(chan_recv(pipe->chan, &item) == 0) {
+        pipe->sum += (size_t)item;
+    }
+}
+
+static void read_func(int fd, int events, void *arg) {
+    Reader *reader = (Reader *)arg;
+    char buf[64];
+    ssize_t n;
+    (void)events;
+
+    assert(atomic_exchange(&reader->inside, 1) == 0);
+    if(reader->single) {
+        n = read(fd, buf, 1);
+        if(n > 0) {
+            atomic_fetch_add(&reader->bytes, n);
+        }
+    } else {
+        while((n = read(fd, buf, sizeof(buf))) > 0) {
+            atomic_fetch_add(&reader->bytes, n);
+        }
+    }
+    atomic_store(&reader->inside, 0);
+}
+
+/**
+ * Still runs for a while after it told the test it started.
+ */
+static void hold_func(int fd, int events, void *arg) {
+    Gate *gate = (Gate *)arg;
+    (void)fd;
+    (void)events;
+
+    latch_count_down(gate->started);
+    usleep(20000);
+    atomic_fetch_add(gate->count, 1);
+}
+
+static void aio_func_test(ssize_t result, void *arg) {
+    Transfer *t = (Transfer *)arg;
+
+    if(result < 0) {
+        atomic_store(&t->failed, 1);
+    } else {
+        atomic_fetch_add(&t->bytes, (size_t)result);
+    }
+    atomic_fetch_add(&t->done, 1);
+}
+
+static void block_func(void *arg) {
+    Blocker *blocker = (Blocker *)arg;
+
+    pool_block_begin();
+    atomic_fetch_add(&blocker->blocked, 1);
+    while(atomic_load(blocker->count) < blocker->expected) {
+        usleep(100);
+    }
+    pool_block_end();
+
+    atomic_fetch_add(blocker->count, 1);
+}
+
+static void cpu_func(void *arg) {
+    Placement *placement = (Placement *)arg;
+
+#ifdef __linux__
+    if(sched_getcpu() != placement->cpu) {
+        atomic_store(&placement->misplaced, 1);
+    }
+#endif
+    atomic_fetch_add(&placement->count, 1);
+}
+
+static void attr_func(void *arg) {
+    Sched *sched = (Sched *)arg;
+
+#ifdef __linux__
+    char name[16];
+    pthread_getname_np(pthread_self(), name, sizeof(name));
+    if(strcmp(name, sched->name) != 0) {
+        atomic_store(&sched->wrong, 1);
+    }
+
+    if(sched->policy == POLICY_BATCH && sched_getscheduler(0) != SCHED_BATCH) {
+        atomic_store(&sched->wrong, 1);
+    }
+    if(getpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid)) != sched->nice) {
+        atomic_store(&sched->wrong, 1);
+    }
+
+    // sanitizers add to the stack so it is only checked to be below the default
+    pthread_attr_t attr;
+    size_t stackSize, defaultSize;
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr, &defaultSize);
+    pthread_attr_destroy(&attr);
+    pthread_getattr_np(pthread_self(), &attr);
+    pthread_attr_getstacksize(&attr, &stackSize);
+    pthread_attr_destroy(&attr);
+    if(stackSize < sched->stackSize || stackSize >= defaultSize) {
+        atomic_store(&sched->wrong, 1);
+    }
+#endif
+    atomic_fetch_add(&sched->count, 1);
+}
+
+static void policy_func(void *arg) {
+    atomic_int *policy = (atomic_int *)arg;
+
+    int current;
+    struct sched_param param;
+    pthread_getschedparam(pthread_self(), &current, &param);
+    atomic_store(policy, current == SCHED_FIFO ? POLICY_FIFO : POLICY_NORMAL);
+}
+
+/**
+ * Counts twice so a task that ran and a task that was cancelled with count_func() can share one counter.
+ */
+static void sleep_func(void *arg) {
+    atomic_size_t *count = (atomic_size_t *)arg;
+
+    usleep(5000);
+    atomic_fetch_add(count, 2);
+}
+
+/**
+ * Uses 5ms of cpu time.
+ */
+static void spin_func(void *arg) {
+    atomic_size_t *count = (atomic_size_t *)arg;
+    struct timespec ts;
+    uint64_t start, now;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    start = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    do {
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        now = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    } while(now - start < 5000000ULL);
+
+    atomic_fetch_add(count, 1);
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void *shutdown_func(void *arg) {
+    Shutdown *shutdown = (Shutdown *)arg;
+
+    shutdown_group(shutdown->tg, shutdown->mode, shutdown->timeoutMs);
+    return NULL;
+}
+
+static void serial_func(void *arg) {
+    Step *step = (Step *)arg;
+    Serial *serial = step->serial;
+
+    if(atomic_exchange(&serial->inside, 1) != 0) {
+        atomic_store(&serial->wrong, 1);
+    }
+    if(serial->next != step->seq) {
+        atomic_store(&serial->wrong, 1);
+    }
+    serial->next++;
+    atomic_store(&serial->inside, 0);
+
+    atomic_fetch_add(serial->count, 1);
+}
+
+/**
+ * Meets the other tasks at the barrier in every phase, no task can get past a phase before all of them arrived.
+ */
+static void phase_func(void *arg) {
+    Phases *phases = (Phases *)arg;
+
+    for (size_t i = 0; i < phases->phases; i++) {
+        atomic_fetch_add(&phases->arrived, 1);
+
+        if(barrier_wait(phases->barrier) == BARRIER_LAST) {
+            atomic_fetch_add(&phases->last, 1);
+        }
+
+        if(atomic_load(&phases->arrived) < (i + 1) * phases->tasks) {
+            atomic_store(&phases->early, 1);
+        }
+    }
+
+    atomic_fetch_add(phases->count, 1);
+}
+
+static void meet_func(void *arg) {
+    Meet *meet = (Meet *)arg;
+
+    if(barrier_wait(meet->barrier) == BARRIER_LAST) {
+        destroy_barrier(meet->barrier);
+    }
+
+    atomic_fetch_add(meet->count, 1);
+}
+
+static void *waiter_func(void *arg) {
+    Waiter *waiter = (Waiter *)arg;
+
+    latch_count_down(waiter->ready);
+    wait_pool(waiter->tp);
+    atomic_fetch_add(waiter->done, 1);
+    return NULL;
+}
+
+static void busy_func(void *arg) {
+    Busy *busy = (Busy *)arg;
+
+    size_t running = atomic_fetch_add(&busy->running, 1) + 1;
+    size_t most = atomic_load(&busy->most);
+    while(running > most && !atomic_compare_exchange_weak(&busy->most, &most, running));
+
+    usleep(2000);
+    atomic_fetch_sub(&busy->running, 1);
+    atomic_fetch_add(&busy->count, 1);
+}
+
+static void request_func(void *arg) {
+    Request *req = (Request *)arg;
+
+    atomic_fetch_add(req->ran, 1);
+}
+
+static void request_done(void *arg) {
+    Request *req = (Request *)arg;
+
+    atomic_fetch_add(req->done, 1);
+}
+
+static void *push_func(void *arg) {
+    Pusher *pusher = (Pusher *)arg;
+
+    for (size_t i = 0; i < pusher->numItems; i++) {
+        aq_push(pusher->q, &pusher->items[i].move);
+    }
+
+    return NULL;
+}
+
+static void *churn_func(void *arg) {
+    Churner *churner = (Churner *)arg;
+
+    for (size_t i = 0; i < churner->rounds; i++) {
+        AIL *ail;
+        while((ail = as_pop(churner->s)) == NULL) {
+            sched_yield();
+        }
+
+        // nobody else holds the item till it is pushed back
+        Item *item = CONTAINER_OF(ail, Item, move);
+        item->uses++;
+        as_push(churner->s, ail);
+    }
+
+    return NULL;
+}
+
+static void probe_func(void *arg) {
+    Probe *probe = (Probe *)arg;
+    GroupStats stats;
+
+    group_stats(probe->tg, &stats);
+    probe->queued = stats.queued;
+}
+
+static TPool *init_test(unsigned int thrds) {
+    TPool *tp;
+    int rc;
+
+    rc = init_pool(&tp, thrds);
+    assert(rc == 0);
+
+    return tp;
+}
+
+static void destroy_test(TPool *tp) {
+    destroy_pool(tp);
+}